@@ -17,12 +17,6 @@
   
  ***************************************************************************/
 
-/* TODO:
- * store AT strings in PROGMEM to save ram.
- * profile variable usage to reduce RAM requirements
- * complete implementation of sleep support for battery-powered applications.
- */
-
 #ifdef SOFTWARE_SERIAL
 #include <SoftwareSerial.h>
 #endif
@@ -36,126 +30,517 @@
 #define UARTDEBUGLN(x)
 #endif
 
+/* Protocol strings live in flash. PROGMEM is a no-op on cores with a single
+ * address space, where the _P functions map onto the standard ones. */
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#else
+#ifndef PROGMEM
+#define PROGMEM
+#endif
+#ifndef PSTR
+#define PSTR(s) (s)
+#endif
+#ifndef pgm_read_byte
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#endif
+#ifndef memcmp_P
+#define memcmp_P memcmp
+#endif
+#endif
+
 #ifdef DEBUG_ESEYETELEMETRYMODULE
 #define MAX_DBG_LEN 50
-void eseyeETM::dbg_uart(const char* fmt, ...){
+/* fmt is a flash string */
+void eseyeETMBase::dbg_uart(const char* fmt, ...){
     char tmp[MAX_DBG_LEN + 1];
     va_list ap;
     va_start(ap, fmt);
+#if defined(__AVR__)
+    vsnprintf_P(tmp, MAX_DBG_LEN, fmt, ap);
+#else
     vsnprintf(tmp, MAX_DBG_LEN, fmt, ap);
+#endif
     va_end( ap );
     this->dbguart->print(tmp);
 }
-#define UARTDEBUGPRINTF(x...) if(this->dbguart != NULL){ this->dbg_uart(x); }
+#define UARTDEBUGPRINTF(fmt, ...) if(this->dbguart != NULL){ this->dbg_uart(PSTR(fmt), ##__VA_ARGS__); }
 #else
-#define UARTDEBUGPRINTF(x...) ;
-#endif
-
-//const char etm_start[]   = "AT+ETM";
-const char etm_mqtt_start[] = "AT+EMQ";
-const char etm_sub[]     = "SUBOPEN=";
-const char etm_subcl[]   = "SUBCLOSE=";
-const char etm_pub[]     = "PUBOPEN=";
-const char etm_pubcl[]   = "PUBCLOSE=";
-const char etm_publish[] = "PUBLISH=";
-const char etm_sendok[]  = ":SEND OK";
-const char etm_sendfail[] = ":SEND FAIL";
-
-const char at_start[]     = "AT";
-const char etm_urc[]      = "+ETM";
-const char emq_urc[]      = "+EMQ";
-const char etmrdyurc[]    = "IDLE";
-const char emqrdyurc[]    = "EMQRDY";
-const char eurdyurc[]     = "EURDY";
-const char pub_start[]    = "PUB";
-const char sub_start[]    = "SUB";
-const char open_msg[]     = "OPEN";
-const char close_msg[]    = "CLOSE";
-const char state_msg[]    = "STATE";
-#ifdef FILTER_OK
-const char ok_msg[]       = "OK";
-const char error_msg[]    = "ERROR";
-const char crlf_msg[]     = "\r\n";
+#define UARTDEBUGPRINTF(fmt, ...) ;
+#endif
+
+const char at_subopen[]    PROGMEM = "AT+EMQSUBOPEN=";
+const char at_subclose[]   PROGMEM = "AT+EMQSUBCLOSE=";
+const char at_pubopen[]    PROGMEM = "AT+EMQPUBOPEN=";
+const char at_pubclose[]   PROGMEM = "AT+EMQPUBCLOSE=";
+const char at_publish[]    PROGMEM = "AT+EMQPUBLISH=";
+#ifdef UDP_TRANSFER
+const char at_udpsend[]    PROGMEM = "AT+EUDPSEND=";
+#endif
+const char at_statequery[] PROGMEM = "AT+ETMSTATE?\r\n";
+const char at_stateon[]    PROGMEM = "AT+ETMSTATE=1\r\n";
+const char at_stateoff[]   PROGMEM = "AT+ETMSTATE=0\r\n";
+const char at_startmqtt[]  PROGMEM = "AT+ETMSTATE=startmqtt\r\n";
+const char at_startudp[]   PROGMEM = "AT+ETMSTATE=startudp\r\n";
+const char at_echooff[]    PROGMEM = "ATE0\r\n";
+const char str_crlf[]      PROGMEM = "\r\n";
+const char str_quotecrlf[] PROGMEM = "\"\r\n";
+const char str_commaquote[] PROGMEM = ",\"";
+
+/* Write a flash string to the modem a block at a time */
+void eseyeETMBase::writeP(const char *pstr){
+    char blk[16];
+    uint8_t len = 0;
+    char c;
+    while((c = pgm_read_byte(pstr++)) != 0){
+        blk[len++] = c;
+        if(len == sizeof(blk)){
+            this->atwrite((const uint8_t *)blk, len);
+            len = 0;
+        }
+    }
+    if(len > 0)
+        this->atwrite((const uint8_t *)blk, len);
+}
+
+#ifdef ETM_STATS
+#define STAT_INC(field) this->etmstat.field++
+#define STAT_ADD(field, n) this->etmstat.field += (n)
+#else
+#define STAT_INC(field)
+#define STAT_ADD(field, n)
+#endif
+
+#ifdef TIMEOUT_RESPONSES
+/* What a response deadline is for - idx is the topic or publish queue slot */
+#define DL_SUBTOPIC 0
+#define DL_PUBTOPIC 1
+#define DL_PUBMSG   2
+#endif
+
+#ifdef PUB_QUEUE
+/* Send order entries holding the place of a publish that timed out */
+#define PUBSENT_LATEOK 0xfe /* Its OK may still come */
+#define PUBSENT_LATE   0xff /* Accepted, its :SEND OK/FAIL may still come */
+#endif
+
+#ifdef SESSION_RECOVERY
+/* Session recovery steps */
+#define RECOVER_NONE      0
+#define RECOVER_WAIT      1 /* Waiting for ETM to come back or reconnect by itself */
+#define RECOVER_START     2 /* startproto() to send */
+#define RECOVER_WAITREADY 3
+#define RECOVER_OPEN      4 /* Topics to re-open */
+#define RECOVER_WAITOPEN  5
+/* Commands sent before the session was lost fail without touching their topic */
+#define RECOVER_LOST(s) ((s) != RECOVER_NONE && (s) < RECOVER_OPEN)
+#endif
+
+void eseyeETMBase::atwrite(const uint8_t *buf, size_t len){
+    STAT_ADD(txbytes, this->atuart->write(buf, len));
+}
+
+void eseyeETMBase::atwrite(const char *str){
+    this->atwrite((const uint8_t *)str, strlen(str));
+}
+
+void eseyeETMBase::atwrite(char c){
+    STAT_ADD(txbytes, this->atuart->write((uint8_t)c));
+}
+
+void eseyeETMBase::atprint(long val){
+    STAT_ADD(txbytes, this->atuart->print(val));
+}
+
+/* URC dispatch table. Each received line is classified by a single pass over
+ * the table - prefix lengths are computed at compile time and the first
+ * character is checked before comparing the rest of the prefix. */
+typedef enum {URC_ETM_IDLE, URC_EMQRDY, URC_EURDY, URC_ETMSTATE, URC_SUBOPEN, URC_PUBOPEN, URC_SUBCLOSE, URC_PUBCLOSE,
+              URC_EMQMSG, URC_SENDOK, URC_SENDFAIL, URC_APPRDY, URC_OK, URC_ERROR, URC_EUDPMSG} turcId;
+
+#define URC_PREFIX_MAX 14
+struct urcentry{
+  char prefix[URC_PREFIX_MAX];
+  uint8_t len;
+  uint8_t id;
+};
+
+#define URC_ENTRY(str, id) { str, sizeof(str) - 1, id }
+static const struct urcentry urctable[] PROGMEM = {
+  URC_ENTRY("+EMQ:",         URC_EMQMSG),
+  URC_ENTRY(":SEND OK",      URC_SENDOK),
+  URC_ENTRY("OK",            URC_OK),
+  URC_ENTRY("+ETMSTATE:",    URC_ETMSTATE),
+  URC_ENTRY("+EMQPUBOPEN:",  URC_PUBOPEN),
+  URC_ENTRY("+EMQSUBOPEN:",  URC_SUBOPEN),
+  URC_ENTRY("+EMQPUBCLOSE:", URC_PUBCLOSE),
+  URC_ENTRY("+EMQSUBCLOSE:", URC_SUBCLOSE),
+  URC_ENTRY(":SEND FAIL",    URC_SENDFAIL),
+  URC_ENTRY("ERROR",         URC_ERROR),
+  /* Extended final result codes from commands sent with sendAT() */
+  URC_ENTRY("+CME ERROR",    URC_ERROR),
+  URC_ENTRY("+CMS ERROR",    URC_ERROR),
+  URC_ENTRY("+ETM:IDLE",     URC_ETM_IDLE),
+  URC_ENTRY("+ETM:EMQRDY",   URC_EMQRDY),
+  URC_ENTRY("+ETM:EURDY",    URC_EURDY),
+  URC_ENTRY("APP RDY",       URC_APPRDY),
+#ifdef UDP_TRANSFER
+  URC_ENTRY("+EUDP:",        URC_EUDPMSG),
 #endif
-const char apprdy[]       = "APP RDY";
+};
+#define URC_TABLE_LEN (sizeof(urctable) / sizeof(urctable[0]))
+#define URC_NONE 0xff
 
 #ifdef FILTER_OK
-void eseyeETM::incOKreq(){
-    this->outstanding_ok++;
+/* Reserve the FIFO slot for a command that will be answered by OK/ERROR - called
+ * before any of it is written, as waiting for room polls and a callback may write
+ * a command of its own */
+void eseyeETMBase::incOKreq(tetmCmd cmdtype, uint8_t idx){
+    /* Responses arrive in order so the oldest command frees the next slot */
+    while(this->cmdcount == CMD_FIFO_LEN){
+        yield();
+        this->poll();
+    }
+    struct atcmd *cmd = &this->cmdfifo[(this->cmdhead + this->cmdcount) % CMD_FIFO_LEN];
+    cmd->cmdtype = cmdtype;
+    cmd->idx = idx;
+    cmd->senttime = millis();
+    this->cmdcount++;
+}
+
+/* Match an OK/ERROR to the oldest outstanding command */
+tetmCmd eseyeETMBase::cmddone(boolean ok){
+    struct atcmd *cmd = &this->cmdfifo[this->cmdhead];
+    tetmCmd cmdtype = (tetmCmd)cmd->cmdtype;
+    uint8_t idx = cmd->idx;
+#if defined(ETM_STATS) && !defined(PUB_QUEUE)
+    if(ok && cmdtype == ETM_CMD_PUBLISH)
+        this->histadd(&this->etmstat.publish, cmd->senttime);
+#endif
+    this->cmdhead = (this->cmdhead + 1) % CMD_FIFO_LEN;
+    this->cmdcount--;
+    if(cmdtype == ETM_CMD_NONE){
+        /* The late answer to a command that has already timed out (idx holds its type) */
+        this->cmdlate--;
+#if defined(PUB_QUEUE) && defined(TIMEOUT_RESPONSES)
+        if(idx == ETM_CMD_PUBLISH){
+            int pos = this->pubsentfind(PUB_MSG_UNKNOWN, PUBSENT_LATEOK);
+            if(pos >= 0 && ok){
+                /* Accepted after all - it will still get a :SEND OK/FAIL */
+                this->pubsent[(this->pubsenthead + pos) % (2 * this->pubqlen)] = PUBSENT_LATE;
+                this->publate++;
+                this->publatetime = millis();
+            }else if(pos >= 0){
+                this->pubsentdel(pos);
+            }
+        }
+#endif
+        return cmdtype;
+    }
+#ifdef PUB_QUEUE
+    if(cmdtype == ETM_CMD_PUBLISH)
+        this->pubcmddone(ok);
+#endif
+    this->cmdresult(cmdtype, idx, ok);
+    return cmdtype;
+}
+
+/* Act on the answer to a command, or on it timing out */
+void eseyeETMBase::cmdresult(tetmCmd cmdtype, uint8_t idx, boolean ok){
+    switch(cmdtype){
+      case ETM_CMD_SUBSCRIBE:
+#ifdef SESSION_RECOVERY
+        if(RECOVER_LOST(this->recoverstate))
+          break;
+#endif
+        if(ok == false && this->subtopics[idx].substate == SUB_TOPIC_SUBSCRIBING){
+          this->subtopics[idx].substate = SUB_TOPIC_ERROR;
+#ifdef TIMEOUT_RESPONSES
+          this->deadlinedel(DL_SUBTOPIC, idx);
+#endif
+          this->opdone(ETM_CMD_SUBSCRIBE, idx, -1);
+        }
+        break;
+      case ETM_CMD_UNSUBSCRIBE:
+        if(ok == false && this->subtopics[idx].substate == SUB_TOPIC_UNSUBSCRIBING){
+          this->subtopics[idx].substate = SUB_TOPIC_SUBSCRIBED;
+#ifdef TIMEOUT_RESPONSES
+          this->deadlinedel(DL_SUBTOPIC, idx);
+#endif
+        }
+        break;
+      case ETM_CMD_PUBREG:
+#ifdef SESSION_RECOVERY
+        if(RECOVER_LOST(this->recoverstate))
+          break;
+#endif
+        if(ok == false && this->pubtopics[idx].pubstate == PUB_TOPIC_REGISTERING){
+          this->pubtopics[idx].pubstate = PUB_TOPIC_ERROR;
+#ifdef TIMEOUT_RESPONSES
+          this->deadlinedel(DL_PUBTOPIC, idx);
+#endif
+          this->opdone(ETM_CMD_PUBREG, idx, -1);
+        }
+        break;
+      case ETM_CMD_PUBUNREG:
+        if(ok == false && this->pubtopics[idx].pubstate == PUB_TOPIC_UNREGISTERING){
+          this->pubtopics[idx].pubstate = PUB_TOPIC_REGISTERED;
+#ifdef TIMEOUT_RESPONSES
+          this->deadlinedel(DL_PUBTOPIC, idx);
+#endif
+        }
+        break;
+      default:
+        break;
+    }
+    if(ok == false){
+        UARTDEBUGPRINTF("Command %d idx %d failed\n", cmdtype, idx);
+    }
+#ifdef BINARY_TRANSFER
+    /* The binary publish is always the newest command - stop waiting for its prompt */
+    if(this->cmdcount == this->cmdlate && this->txbuf != NULL){
+        this->txbuf = NULL;
+        this->txbuflen = 0;
+    }
+#endif
+    if(this->cmdcallback != NULL)
+        this->cmdcallback(cmdtype, idx, ok);
+}
+
+/* Forget outstanding commands - the modem has restarted and won't answer them */
+void eseyeETMBase::cmdflush(void){
+#ifdef PUB_QUEUE
+    /* Publishes with the modem won't be answered either. Under autorecover() those
+     * that can be sent again are queued for when their topic is re-opened */
+    while(this->pubsentcount > 0){
+        uint8_t slot = this->pubsent[this->pubsenthead];
+        this->pubsentdel(0);
+        if(slot >= PUBSENT_LATEOK)
+            continue;
+        struct pubmsg *msg = &this->pubqueue[slot];
+#if defined(SESSION_RECOVERY) && defined(PUB_RETRY)
+        if(this->recoverstate != RECOVER_NONE && msg->retain){
+#ifdef TIMEOUT_RESPONSES
+            this->deadlinedel(DL_PUBMSG, slot);
+#endif
+            msg->msgstate = PUB_MSG_QUEUED;
+            msg->goback = false;
+            msg->backoff = 0;
+            continue;
+        }
+#endif
+        this->pubmsgdone(msg, false);
+    }
+#ifdef TIMEOUT_RESPONSES
+    this->publate = 0;
+#endif
+#endif
+    while(this->cmdcount > 0)
+        this->cmddone(false);
 }
 
-bool eseyeETM::inSync(void){
-    return this->outstanding_ok != 0 ? false : true;
+bool eseyeETMBase::inSync(void){
+    return this->cmdcount != this->cmdlate ? false : true;
 }
 
-void eseyeETM::waitSync(void){
+void eseyeETMBase::waitSync(void){
     while(this->inSync() != true){
         yield();
         this->poll();
     }
 }
+
+void eseyeETMBase::cmdcb(_cmdcb cmdcallback){
+    this->cmdcallback = cmdcallback;
+}
 #endif
 
 /* Subscribe topic API */
 
+/* FNV-1a folded to 16 bits - lets subindex() skip most string compares */
+static uint16_t topichash(const char *topic){
+  uint32_t hash = 2166136261UL;
+  while(*topic != 0){
+    hash ^= (uint8_t)*topic++;
+    hash *= 16777619UL;
+  }
+  return (uint16_t)(hash ^ (hash >> 16));
+}
+
+/* Does an MQTT topic filter match a topic. Wildcards in a subscribed topic
+ * are compared as literal characters. */
+static boolean topicmatch(const char *filter, const char *topic){
+  while(*filter != 0){
+    if(*filter == '#')
+      return true;
+    if(*filter == '+'){
+      while(*topic != 0 && *topic != '/')
+        topic++;
+      filter++;
+    }else if(*filter == *topic){
+      filter++;
+      topic++;
+    }else{
+      /* "a/#" also matches "a" */
+      return (*topic == 0 && filter[0] == '/' && filter[1] == '#' && filter[2] == 0);
+    }
+  }
+  return *topic == 0;
+}
+
 /* Subscribe to a topic using the first available topic index */
-int eseyeETM::subscribe(char *topic, _msgcb callback){
+int eseyeETMBase::subscribe(char *topic, _msgcb callback){
+  return this->subscribetopic(topic, callback, NULL);
+}
+
+/* A binary payload is waiting for its > prompt, so nothing else can be written. Only
+ * seen from callbacks run by writebinary()'s poll */
+boolean eseyeETMBase::txbusy(void){
+#ifdef BINARY_TRANSFER
+  return this->txbuf != NULL;
+#else
+  return false;
+#endif
+}
+
+/* Subscribe to a topic and receive messages in chunks of up to the receive buffer size */
+int eseyeETMBase::subscribestream(char *topic, _chunkcb callback){
+  return this->subscribetopic(topic, NULL, callback);
+}
+
+int eseyeETMBase::subscribetopic(char *topic, _msgcb callback, _chunkcb chunkcallback){
   int topiccount = 0;
 #ifdef TIMEOUT_RESPONSES
   this->checkTimeout();
 #endif
-  while(this->subtopics[topiccount].substate != SUB_TOPIC_NOT_IN_USE && this->subtopics[topiccount].substate != SUB_TOPIC_ERROR && topiccount < MAX_SUB_TOPICS){
+  if(this->txbusy())
+    return -1;
+  while(topiccount < this->maxsubs && this->subtopics[topiccount].substate != SUB_TOPIC_NOT_IN_USE && this->subtopics[topiccount].substate != SUB_TOPIC_ERROR){
     topiccount++;
   }
-  if(topiccount == MAX_SUB_TOPICS)
+  if(topiccount == this->maxsubs)
     return -1;
   UARTDEBUGPRINTF("Subscribe to %s\n", topic);
-  this->atuart->write(etm_mqtt_start);
-  this->atuart->write(etm_sub);
-  this->atuart->print(topiccount);
-  this->atuart->write(",\"");
-  this->atuart->write(topic);
-  this->atuart->write("\"\r\n");
-#ifdef FILTER_OK
-  this->incOKreq();
-#endif
-  this->subtopics[topiccount].substate = SUB_TOPIC_SUBSCRIBING;
   this->subtopics[topiccount].messagecb = callback;
+  this->subtopics[topiccount].chunkcb = chunkcallback;
+  this->subtopics[topiccount].topic = topic;
+  this->subtopics[topiccount].topichash = topichash(topic);
+  this->subtopics[topiccount].handlers = this->topicmatches(topic);
+  this->subopen(topiccount, topic);
   return topiccount;
 }
 
+void eseyeETMBase::subopen(uint8_t idx, const char *topic){
+#ifdef FILTER_OK
+  this->incOKreq(ETM_CMD_SUBSCRIBE, idx);
+#endif
+  this->writeP(at_subopen);
+  this->atprint(idx);
+  this->writeP(str_commaquote);
+  this->atwrite(topic);
+  this->writeP(str_quotecrlf);
+  this->subtopics[idx].substate = SUB_TOPIC_SUBSCRIBING;
+#ifdef ETM_STATS
+  this->subtopics[idx].senttime = millis();
+#endif
+#ifdef TIMEOUT_RESPONSES
+  this->deadlineadd(DL_SUBTOPIC, idx, this->subtimeout);
+#endif
+}
+
 /* Have we successfully subscribed */
-tsubTopicState eseyeETM::substate(int idx){
+tsubTopicState eseyeETMBase::substate(int idx){
 #ifdef TIMEOUT_RESPONSES
   this->checkTimeout();
 #endif
-  return this->subtopics[idx].substate;
+  return (tsubTopicState)this->subtopics[idx].substate;
 }
 
 #ifdef FILTER_OK
-int eseyeETM::subscribeconfirm(char *topic, _msgcb callback){
+int eseyeETMBase::subscribeconfirm(char *topic, _msgcb callback){
     int res = this->subscribe(topic, callback);
     this->waitSync();
     return res;
 }
 #endif
 
+/* Find the subscription index for a topic */
+int eseyeETMBase::subindex(const char *topic){
+  uint16_t hash = topichash(topic);
+  for(uint8_t i = 0; i < this->maxsubs; i++){
+    struct subtpc *sub = &this->subtopics[i];
+    if(sub->substate != SUB_TOPIC_NOT_IN_USE && sub->substate != SUB_TOPIC_ERROR &&
+       sub->topichash == hash && strcmp(sub->topic, topic) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/* The topic subscribed on an index */
+const char *eseyeETMBase::subtopic(int idx){
+  if(idx < 0 || idx >= this->maxsubs || this->subtopics[idx].substate == SUB_TOPIC_NOT_IN_USE)
+    return NULL;
+  return this->subtopics[idx].topic;
+}
+
+/* Handlers whose filter matches topic */
+thandlermask eseyeETMBase::topicmatches(const char *topic){
+  thandlermask mask = 0;
+  for(uint8_t i = 0; i < MAX_TOPIC_HANDLERS; i++){
+    if(this->topichandlers[i].callback != NULL && topicmatch(this->topichandlers[i].filter, topic))
+      mask |= (thandlermask)(1 << i);
+  }
+  return mask;
+}
+
+/* Register a handler for subscriptions matching filter. Matching is done here
+ * and in subscribe() so delivering a message doesn't compare any strings. */
+int eseyeETMBase::topicreg(const char *filter, _topiccb callback, void *ctx){
+  if(filter == NULL || callback == NULL)
+    return -1;
+  for(uint8_t i = 0; i < MAX_TOPIC_HANDLERS; i++){
+    if(this->topichandlers[i].callback == NULL){
+      this->topichandlers[i].filter = filter;
+      this->topichandlers[i].callback = callback;
+      this->topichandlers[i].ctx = ctx;
+      for(uint8_t j = 0; j < this->maxsubs; j++){
+        if(this->subtopics[j].topic != NULL && topicmatch(filter, this->subtopics[j].topic))
+          this->subtopics[j].handlers |= (thandlermask)(1 << i);
+      }
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Remove a topic handler */
+int eseyeETMBase::topicunreg(int handler){
+  if(handler < 0 || handler >= MAX_TOPIC_HANDLERS)
+    return -1;
+  this->topichandlers[handler].callback = NULL;
+  for(uint8_t j = 0; j < this->maxsubs; j++)
+    this->subtopics[j].handlers &= (thandlermask)~(1 << handler);
+  return 0;
+}
+
 /* Unsubscribe from a topic index */
-int eseyeETM::unsubscribe(int idx){
+int eseyeETMBase::unsubscribe(int idx){
 #ifdef TIMEOUT_RESPONSES
   this->checkTimeout();
 #endif
-  if(idx >= MAX_SUB_TOPICS)
+  if(idx >= this->maxsubs || this->txbusy())
     return -1;
   if(this->subtopics[idx].substate == SUB_TOPIC_SUBSCRIBED){
-    this->atuart->write(etm_mqtt_start);
-    this->atuart->write(etm_subcl);
-    this->atuart->print(idx);
-    this->atuart->write("\r\n");
-    this->subtopics[idx].substate = SUB_TOPIC_UNSUBSCRIBING;
 #ifdef FILTER_OK
-    this->incOKreq();
+    this->incOKreq(ETM_CMD_UNSUBSCRIBE, idx);
 #endif  
+    this->writeP(at_subclose);
+    this->atprint(idx);
+    this->writeP(str_crlf);
+    this->subtopics[idx].substate = SUB_TOPIC_UNSUBSCRIBING;
+#ifdef TIMEOUT_RESPONSES
+    this->deadlineadd(DL_SUBTOPIC, idx, this->subtimeout);
+#endif
     return 0;
   }
   return -1;
@@ -168,407 +553,2149 @@ int eseyeETM::unsubscribe(int idx){
 #define TOPIC_REGISTERED     2
 
 /* Register a publish topic */
-int eseyeETM::pubreg(char *topic){
+int eseyeETMBase::pubreg(char *topic){
   int topiccount = 0;
 #ifdef TIMEOUT_RESPONSES
   this->checkTimeout();
 #endif
-  while(this->pubtopics[topiccount].pubstate != PUB_TOPIC_NOT_IN_USE && this->pubtopics[topiccount].pubstate != PUB_TOPIC_ERROR && topiccount < MAX_PUB_TOPICS){
+  if(this->txbusy())
+    return -1;
+  while(topiccount < this->maxpubs && this->pubtopics[topiccount].pubstate != PUB_TOPIC_NOT_IN_USE && this->pubtopics[topiccount].pubstate != PUB_TOPIC_ERROR){
     topiccount++;
   }
-  if(topiccount == MAX_PUB_TOPICS)
+  if(topiccount == this->maxpubs)
     return -1;
-  this->atuart->write(etm_mqtt_start);
-  this->atuart->write(etm_pub);
-  this->atuart->print(topiccount);
-  this->atuart->write(",\"");
-  this->atuart->write(topic);
-  this->atuart->write("\"\r\n");
   UARTDEBUGPRINTF("Pubreg %s\n", topic);
+#ifdef SESSION_RECOVERY
+  this->pubtopics[topiccount].topic = topic;
+#endif
+#ifdef STORE_FORWARD
+  this->pubtopics[topiccount].topichash = topichash(topic);
+#endif
+  this->pubopen(topiccount, topic);
+#ifdef PUB_FILTER
+  this->pubtopics[topiccount].filtered = false;
+  this->pubtopics[topiccount].hassent = false;
+  this->pubtopics[topiccount].suppressed = 0;
+#endif
+  return topiccount;
+}
+
+void eseyeETMBase::pubopen(uint8_t idx, const char *topic){
 #ifdef FILTER_OK
-  this->incOKreq();
+  this->incOKreq(ETM_CMD_PUBREG, idx);
+#endif
+  this->writeP(at_pubopen);
+  this->atprint(idx);
+  this->writeP(str_commaquote);
+  this->atwrite(topic);
+  this->writeP(str_quotecrlf);
+  this->pubtopics[idx].pubstate = PUB_TOPIC_REGISTERING;
+#ifdef ETM_STATS
+  this->pubtopics[idx].senttime = millis();
 #endif
-  this->pubtopics[topiccount].pubstate = PUB_TOPIC_REGISTERING;
 #ifdef TIMEOUT_RESPONSES
-  this->pubtopics[topiccount].senttime = millis();
+  this->deadlineadd(DL_PUBTOPIC, idx, this->pubtimeout);
 #endif
-  return topiccount;
 }
 
 /* Check if publish topic is registered */
-tpubTopicState eseyeETM::pubstate(int idx){
+tpubTopicState eseyeETMBase::pubstate(int idx){
 #ifdef TIMEOUT_RESPONSES
   this->checkTimeout();
 #endif
-  return this->pubtopics[idx].pubstate;
+  return (tpubTopicState)this->pubtopics[idx].pubstate;
 }
 
 /* Unregister a publish topic */
-int eseyeETM::pubunreg(int idx){
+int eseyeETMBase::pubunreg(int idx){
 #ifdef TIMEOUT_RESPONSES
   this->checkTimeout();
 #endif
-  if(idx >= MAX_PUB_TOPICS)
+  if(idx >= this->maxpubs || this->txbusy())
     return -1;
   if(this->pubtopics[idx].pubstate == PUB_TOPIC_REGISTERED){
-    this->atuart->write(etm_mqtt_start);
-    this->atuart->write(etm_pubcl);
-    this->atuart->print(idx);
-    this->atuart->write("\r\n"); 
+#ifdef FILTER_OK
+    this->incOKreq(ETM_CMD_PUBUNREG, idx);
+#endif
+    this->writeP(at_pubclose);
+    this->atprint(idx);
+    this->writeP(str_crlf);
     this->pubtopics[idx].pubstate = PUB_TOPIC_UNREGISTERING; 
 #ifdef TIMEOUT_RESPONSES
-    this->pubtopics[idx].senttime = millis();
-#endif
-#ifdef FILTER_OK
-    this->incOKreq();
+    this->deadlineadd(DL_PUBTOPIC, idx, this->pubtimeout);
 #endif
     return 0;
   }
   return -1;
 }
 
-/* Given an octext convert it to a two-character string ascii-hex representation */
-static void octettohex(uint8_t octet, char *dest){
-    uint8_t nibble = (octet >> 4) & 0x0f;
-    if(nibble < 10)
-        dest[0] = '0' + nibble;
-    else
-        dest[0] = 'A' + (nibble - 10);
-    nibble = octet & 0x0f;
-    if(nibble < 10)
-        dest[1] = '0' + nibble;
-    else
-        dest[1] = 'A' + (nibble - 10);
-    dest[2] = 0;
-}
+/* Ascii-hex digits for the publish encoder */
+static const char hexdigits[16] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'};
 
-/* Publish a message to a topic by index */
-int eseyeETM::publish(int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen){
-    char hexbyte[3];
-#ifdef TIMEOUT_RESPONSES
-  this->checkTimeout();
-#endif  
-  /* TODO - check we're not already sending something */
-  
-  if(tpcidx < MAX_PUB_TOPICS && this->pubtopics[tpcidx].pubstate == PUB_TOPIC_REGISTERED){
-    this->atuart->write(etm_mqtt_start);
-    this->atuart->write(etm_publish);
-    this->atuart->print(tpcidx);
-    this->atuart->write(",");
-    this->atuart->print(qos);
-    this->atuart->write(",\"");    
-    /* Convert data to ascii-hex */
-    for(uint16_t countlen=0; countlen < datalen; countlen++){
-        octettohex(data[countlen], hexbyte);
-        this->atuart->write(hexbyte);
-    }
-    this->atuart->write("\"\r\n");
-#ifdef FILTER_OK
-    this->incOKreq();
-#endif    
-  }
-  return 0;
+/* Convert octets to their ascii-hex representation (2 * datalen characters, no terminator) */
+static void hexencode(const uint8_t *data, uint16_t datalen, char *dest){
+    while(datalen-- > 0){
+        dest[0] = hexdigits[*data >> 4];
+        dest[1] = hexdigits[*data & 0x0f];
+        data++;
+        dest += 2;
+    }
 }
 
-/* Check if previous publish is complete */
-boolean eseyeETM::pubdone(void){
-  return true;
+#ifdef BINARY_TRANSFER
+/* Select how publish payloads are sent to the modem */
+void eseyeETMBase::txencoding(tetmEncoding enc){
+    this->encoding = enc;
 }
 
-#ifdef FILTER_OK
-int eseyeETM::pubregconfirm(char *topic){
-    int pubtemp;
-    tpubTopicState pstate = PUB_TOPIC_REGISTERING;
-    pubtemp = this->pubreg(topic);
-    while(pubtemp != -1 && pstate == PUB_TOPIC_REGISTERING){
+/* Send a length-prefixed command and stream the raw payload at the > prompt.
+ * The modem takes everything after the command as payload so nothing else can be
+ * written until the prompt has been answered - wait for it here. */
+void eseyeETMBase::writebinary(uint8_t *data, uint16_t datalen){
+    unsigned long start = millis();
+    this->atprint(datalen);
+    this->writeP(str_crlf);
+    this->txbuf = data;
+    this->txbuflen = datalen;
+    while(this->txbuf != NULL && millis() - start < PROMPT_TIMEOUT){
         yield();
         this->poll();
-        pstate = this->pubstate(pubtemp);
     }
-    if(pstate == PUB_TOPIC_ERROR)
-        pubtemp = -1;
-    return pubtemp;
+    if(this->txbuf != NULL){
+        UARTDEBUGPRINTF("No data prompt\n");
+        this->txbuf = NULL;
+        this->txbuflen = 0;
+    }
 }
 #endif
 
+/* Write a publish command to the uart */
+void eseyeETMBase::writepublish(int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen){
+#ifdef BINARY_TRANSFER
+    if(this->encoding == ETM_ENC_BINARY){
 #ifdef FILTER_OK
-int eseyeETM::publishconfirm(int tpcidx, uint8_t qos, uint8_t *data, uint8_t datalen){
-    int res = this->publish(tpcidx, qos, data, datalen);
-    this->waitSync();
-    return res;
-}
+        this->incOKreq(ETM_CMD_PUBLISH, tpcidx);
 #endif
-
-/* Polling loop - the work is done here */
-void eseyeETM::poll(void){
-  char nextchar;
-#ifdef TIMEOUT_RESPONSES
-  this->checkTimeout();
-#endif 
-  while (this->atuart->available() > 0) {
-    nextchar = this->atuart->read();
-
-#ifdef removed
-    char tempstr[2];
-    tempstr[0] = nextchar;
-    tempstr[1] = 0;
-    if(nextchar == 0x0d){
-        UARTDEBUGLN(tempstr);
-    }else{
-        UARTDEBUG(tempstr);
+        this->writeP(at_publish);
+        this->atprint(tpcidx);
+        this->atwrite(',');
+        this->atprint(qos);
+        this->atwrite(',');
+        this->writebinary(data, datalen);
+        return;
     }
 #endif
-
-    this->modemrxbuf[this->rxbufidx++] = nextchar;
-    this->modemrxbuf[this->rxbufidx] = 0;
-    if(this->binaryread > 0){
-      this->binaryread--;
-      this->buffered++;      
-      if(this->binaryread == 0){
-        /* modemrxbuf contains the binary response/message */
-        if(this->readingsub < MAX_SUB_TOPICS && this->subtopics[this->readingsub].messagecb != NULL){
-          this->subtopics[this->readingsub].messagecb(this->modemrxbuf, this->buffered);
-          this->buffered = 0;
-          this->readingsub = 0xff; 
-        }
-        this->rxbufidx = 0;
-      }
-    }else{
-      if(this->rxbufidx == 1 && nextchar == '>'){
-        nextchar = 0;
-      }
-      
-      /* Filter out leading CR/LF - an issue with BG96 */
-      if(this->rxbufidx == 1 && (nextchar == 0x0d || nextchar == 0x0a)){
-          this->rxbufidx = 0;
-          continue;
-      }
-      
-      if(nextchar == 0x0a){
-          
-        //UARTDEBUGPRINTF("Process %s\n", (char *)this->modemrxbuf);
-          
-        char *parseptr;
-        boolean handled = false;
-        /* This is the end of a response */
-        if(strncmp((char *)this->modemrxbuf, etm_urc, strlen(etm_urc)) == 0){
-            /* Handle module URCs */
-            parseptr = (char *)&this->modemrxbuf[strlen(etm_urc)];          
-            if(*parseptr == ':'){
-                parseptr++;
-                if(strncmp(parseptr, etmrdyurc, strlen(etmrdyurc)) == 0){
-                    this->urcseen |= ETM_IDLE;
-                    UARTDEBUGPRINTF("ETM running\n");
-                    handled = true;
-                }else if(strncmp(parseptr, emqrdyurc, strlen(emqrdyurc)) == 0){
-                    this->urcseen |= ETM_MQTT_RDY;
-                    UARTDEBUGPRINTF("MQTT ready\n");
-                    handled = true;
-                }else if(strncmp(parseptr, eurdyurc, strlen(eurdyurc)) == 0){
-                    this->urcseen |= ETM_UDP_RDY;
-                    UARTDEBUGPRINTF("UDP ready\n");
-                    handled = true;
-                }
-            }else if(strncmp(parseptr, state_msg, strlen(state_msg)) == 0){
-                this->currentstate = (tetmState)strtol(parseptr + 7, NULL, 10);
-                if(this->statecallback != NULL)
-                    this->statecallback();
-                handled = true;
-            }
-        }else if(strncmp((char *)this->modemrxbuf, emq_urc, strlen(emq_urc)) == 0){
-            /* Handle MQTT URCs */
-            parseptr = (char *)&this->modemrxbuf[strlen(emq_urc)];
-            if(strncmp(parseptr + 3, open_msg, strlen(open_msg)) == 0){
-              char *errptr;
-              /* Read the index */
-              uint8_t idx = strtol(parseptr + 8, &errptr, 10);
-              /* Read the error code */
-              int8_t err = strtol(errptr + 1, NULL, 10);
-              if(strncmp(parseptr, sub_start, strlen(sub_start)) == 0){
-                UARTDEBUGPRINTF("subscribe %d err %d\n", idx, err);
-                /* If we get an already subscribed error assume it was us from before a reboot */
-                if(err == 0 || err == -2)
-                  this->subtopics[idx].substate = SUB_TOPIC_SUBSCRIBED;
-                else
-                  this->subtopics[idx].substate = SUB_TOPIC_ERROR;
-              }else if(strncmp(parseptr, pub_start, strlen(pub_start)) == 0){
-                UARTDEBUGPRINTF("pubreg %d err %d\n", idx, err);
-                /* If we get an already registered error assume it was us from before a reboot */
-                if(err == 0 || err == -2)
-                  this->pubtopics[idx].pubstate = PUB_TOPIC_REGISTERED;
-                else
-                  this->pubtopics[idx].pubstate = PUB_TOPIC_ERROR;    
-              }
-              handled = true;
-            }else if(strncmp(parseptr + 3, close_msg, strlen(close_msg)) == 0){
-              char *errptr;
-              /* Read the index */
-              uint8_t idx = strtol(parseptr + 9, &errptr, 10);
-              /* Read the error code */
-              int8_t err = strtol(errptr + 1, NULL, 10);
-              if(strncmp(parseptr, sub_start, strlen(sub_start)) == 0){
-                UARTDEBUGPRINTF("unsubscribe %d err %d\n", idx, err);
-                //if(err == 0)
-                  this->subtopics[idx].substate = SUB_TOPIC_NOT_IN_USE;
-                //else
-                //  subtopics[idx].substate = SUB_TOPIC_SUBSCRIBED;
-              }else if(strncmp(parseptr, pub_start, strlen(pub_start)) == 0){
-                UARTDEBUGPRINTF("pubunreg %d err %d\n", idx, err);
-                //if(err == 0)
-                  this->pubtopics[idx].pubstate = PUB_TOPIC_NOT_IN_USE;
-                //else
-                //  pubtopics[idx].pubstate = PUB_TOPIC_REGISTERED;
-              }
-              handled = true;
-            }else if(*parseptr == ':'){
-                parseptr++;
-                /* This is a published message to which we are subscribed */
-                char *lenptr;
-                /* Read the subindex */
-                uint8_t idx = strtol(parseptr, &lenptr, 10);
-                /* Read the length */
-                uint8_t len = strtol(lenptr + 1, NULL, 10);
-                this->readingsub = idx;
-                this->binaryread = len;
-                handled = true;
-            }
-        }else if(strncmp((char *)this->modemrxbuf, etm_sendok, strlen(etm_sendok)) == 0){
-          UARTDEBUGPRINTF("Send OK\n");
-          handled = true;
-        }else if(strncmp((char *)this->modemrxbuf, etm_sendfail, strlen(etm_sendfail)) == 0){
-          UARTDEBUGPRINTF("Send Fail\n");
-          handled = true;
-        }
-        /* Specially for BG96 - AT channel starts with echo true so we turn it off */
-        else if(strncmp((char *)this->modemrxbuf, apprdy, strlen(apprdy)) == 0){
-          this->atuart->write("ATE0\r\n");
-          UARTDEBUGPRINTF("BG96 found\n");
-          handled = true;
-        }
 #ifdef FILTER_OK
-        else if(this->outstanding_ok > 0){
-            if(strncmp((char *)this->modemrxbuf, ok_msg, strlen(ok_msg)) == 0){
-              this->outstanding_ok--;
-              handled = true;
-            }else if(strncmp((char *)this->modemrxbuf, error_msg, strlen(error_msg)) == 0){
-              this->outstanding_ok--;
-              handled = true;
-            }else if(strncmp((char *)this->modemrxbuf, crlf_msg, strlen(crlf_msg)) == 0){
-              handled = true;
-            }
-        }
-#endif
-        if(handled == false){
-          if(this->atcallback != NULL){
-            //UARTDEBUGPRINTF("Forwarding %s\n", (char *)this->modemrxbuf);
-            this->atcallback((char *)this->modemrxbuf);
-          }else{
-            UARTDEBUGPRINTF("Discarding %s\n", (char *)this->modemrxbuf);
-          }
+    this->incOKreq(ETM_CMD_PUBLISH, tpcidx);
+#endif    
+    this->writeP(at_publish);
+    this->atprint(tpcidx);
+    this->atwrite(',');
+    this->atprint(qos);
+    this->writeP(str_commaquote);
+    this->writehex(data, datalen);
+}
+
+void eseyeETMBase::writehex(uint8_t *data, uint16_t datalen){
+    /* Ascii-hex is staged and written to the uart a block at a time - the
+     * extra bytes hold the closing quote and CRLF */
+    char hexblk[HEX_STAGE_LEN + 3];
+    uint16_t countlen = 0, chunk, blklen;
+    do{
+        chunk = datalen - countlen;
+        if(chunk > HEX_STAGE_LEN / 2)
+            chunk = HEX_STAGE_LEN / 2;
+        hexencode(&data[countlen], chunk, hexblk);
+        blklen = chunk * 2;
+        countlen += chunk;
+        if(countlen == datalen){
+            hexblk[blklen++] = '"';
+            hexblk[blklen++] = '\r';
+            hexblk[blklen++] = '\n';
         }
-        
-        //this->modemrxbuf[this->rxbufidx] = 0;
-        //UARTDEBUGPRINTF("Handled %s\n", (char *)this->modemrxbuf);
-        
-        this->rxbufidx = 0;
-      }
-    }
-    if(this->rxbufidx >= MODEM_RX_BUFSIZE){
-      this->rxbufidx = 0;
-    }
-  }
+        this->atwrite((const uint8_t *)hexblk, blklen);
+    }while(countlen < datalen);
 }
 
-/* Send an AT command */
-void eseyeETM::sendAT(char *atcmd){
+/* Publish a message to a topic by index */
+int eseyeETMBase::publish(int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen){
 #ifdef TIMEOUT_RESPONSES
-    this->checkTimeout();
+  this->checkTimeout();
+#endif  
+#ifdef STORE_FORWARD
+  /* Keep publishes to a topic in use until it can take them, behind any of its
+   * stored messages so they stay in order */
+  if(this->store != NULL && tpcidx >= 0 && tpcidx < this->maxpubs){
+    struct pubtpc *tpc = &this->pubtopics[tpcidx];
+    if(tpc->pubstate == PUB_TOPIC_REGISTERING ||
+       (tpc->pubstate == PUB_TOPIC_REGISTERED && (this->mqttup == false || this->storefind(tpc->topichash))))
+      return this->storeput(tpcidx, qos, data, datalen);
+  }
 #endif
-    this->atuart->print(atcmd);
-}
-
-void eseyeETM::updateState(tetmRequestState streq){
-    if(streq == ETM_STATE_ONCE){
-        this->currentstate = ETM_UNKNOWN;
-        this->atuart->write("AT+ETMSTATE?\r\n");
-    }else if(streq == ETM_STATE_ON){
-        this->atuart->write("AT+ETMSTATE=1\r\n");
-    }else{
-        this->atuart->write("AT+ETMSTATE=0\r\n");
-    }
-#ifdef FILTER_OK
-    this->incOKreq();
+  if(tpcidx < 0 || tpcidx >= this->maxpubs || this->pubtopics[tpcidx].pubstate != PUB_TOPIC_REGISTERED)
+    return -1;
+#ifdef PUB_QUEUE
+  /* Send now if nothing that could go is ahead of us, otherwise copy to the queue.
+   * A message waiting out its backoff only holds up its own topic */
+  boolean sendnow = this->cmdcount < CMD_FIFO_LEN && this->pubinflight() < this->pubwin && this->pubmsgnext() == NULL;
+#ifdef BINARY_TRANSFER
+  /* Called back while a binary payload waits for its prompt - the line is taken */
+  if(this->txbuf != NULL)
+    sendnow = false;
+#endif
+#ifdef PUB_RETRY
+  if(sendnow && this->pubtopicheld(tpcidx, this->pubqcount))
+    sendnow = false;
+#endif
+  if(sendnow == false && (datalen > PUB_QUEUE_MSGLEN || (this->features & ETM_FEAT_PUBQUEUE) == 0))
+    return -1;
+  struct pubmsg *msg = this->pubmsgalloc();
+  if(msg == NULL)
+    return -1;
+  msg->tpcidx = tpcidx;
+  msg->qos = qos;
+  msg->datalen = datalen;
+  msg->inbatch = this->batching;
+  if(this->batching)
+    this->batchpending++;
+#ifdef PUB_RETRY
+  msg->retain = this->retries > 0 && qos > 0 && datalen <= PUB_QUEUE_MSGLEN && this->pubqdata != NULL;
+  msg->goback = false;
+  msg->fails = 0;
+  msg->backoff = 0;
+  if(sendnow && msg->retain)
+    memcpy(this->pubmsgdata(msg), data, datalen);
+#endif
+  if(sendnow){
+    this->pubmsgsend(msg, data);
+  }else{
+    memcpy(this->pubmsgdata(msg), data, datalen);
+    msg->msgstate = PUB_MSG_QUEUED;
+  }
+  return msg->handle;
+#else
+#ifdef BINARY_TRANSFER
+  if(this->txbuf != NULL)
+    return -1;
+#endif
+  this->writepublish(tpcidx, qos, data, datalen);
+  return 0;
 #endif
 }
 
+int eseyeETMBase::publish(int tpcidx, uint8_t qos, eseyeCBOR *msg){
+  if(msg == NULL || msg->overflow())
+    return -1;
+  return this->publish(tpcidx, qos, msg->data(), msg->length());
+}
+
+int eseyeETMBase::publish(int tpcidx, uint8_t qos, eseyeLZBase *msg){
+  if(msg == NULL || msg->finish() == false)
+    return -1;
+  return this->publish(tpcidx, qos, msg->data(), msg->length());
+}
+
+#ifdef UDP_TRANSFER
+/* Datagram receive buffer marker in readingsub */
+#define UDP_READING 0xfe
+
+/* Send a datagram - only the OK is tracked */
+int eseyeETMBase::sendDatagram(uint8_t *data, uint16_t datalen){
+#ifdef TIMEOUT_RESPONSES
+  this->checkTimeout();
+#endif
+  if(isdone(this->urcseen, ETM_UDP_RDY) == false)
+    return -1;
+#ifdef FILTER_OK
+  /* Drop rather than wait for room */
+  if(this->cmdcount == CMD_FIFO_LEN)
+    return -1;
+#endif
+#ifdef BINARY_TRANSFER
+  /* Called back while a binary payload waits for its prompt - the line is taken */
+  if(this->txbuf != NULL)
+    return -1;
+#endif
+#ifdef FILTER_OK
+  this->incOKreq(ETM_CMD_UDPSEND, 0);
+#endif
+  this->writeP(at_udpsend);
+#ifdef BINARY_TRANSFER
+  if(this->encoding == ETM_ENC_BINARY){
+    this->writebinary(data, datalen);
+    STAT_INC(udpsent);
+    return 0;
+  }
+#endif
+  this->atwrite('"');
+  this->writehex(data, datalen);
+  STAT_INC(udpsent);
+  return 0;
+}
+
+int eseyeETMBase::sendDatagram(eseyeCBOR *msg){
+  if(msg == NULL || msg->overflow())
+    return -1;
+  return this->sendDatagram(msg->data(), msg->length());
+}
+
+void eseyeETMBase::datagramcb(_udpcb callback, void *ctx){
+  this->udpcallback = callback;
+  this->udpctx = ctx;
+}
+#endif
+
+#ifdef PUB_FILTER
+int eseyeETMBase::pubfilter(int tpcidx, uint32_t deadband, uint16_t relband, uint32_t mininterval, uint32_t maxsilence){
+  if(tpcidx < 0 || tpcidx >= this->maxpubs)
+    return -1;
+  struct pubtpc *tpc = &this->pubtopics[tpcidx];
+  tpc->deadband = deadband;
+  tpc->relband = relband;
+  tpc->mininterval = mininterval;
+  tpc->maxsilence = maxsilence;
+  tpc->filtered = (deadband != 0 || relband != 0 || mininterval != 0 || maxsilence != 0);
+  return 0;
+}
+
+int eseyeETMBase::publishvalue(int tpcidx, uint8_t qos, int32_t value, uint8_t *data, uint16_t datalen){
+  if(tpcidx < 0 || tpcidx >= this->maxpubs)
+    return -1;
+  struct pubtpc *tpc = &this->pubtopics[tpcidx];
+  unsigned long now = millis();
+
+  if(tpc->filtered && tpc->hassent){
+    unsigned long elapsed = now - tpc->lastsent;
+    if(tpc->mininterval != 0 && elapsed < tpc->mininterval){
+      tpc->suppressed++;
+      return ETM_PUB_SUPPRESSED;
+    }
+    if(tpc->maxsilence == 0 || elapsed < tpc->maxsilence){
+      /* Unsigned difference can't overflow */
+      uint32_t diff = value >= tpc->lastvalue ? (uint32_t)value - (uint32_t)tpc->lastvalue : (uint32_t)tpc->lastvalue - (uint32_t)value;
+      uint32_t band = tpc->deadband;
+      if(tpc->relband != 0){
+        uint32_t mag = tpc->lastvalue < 0 ? -(uint32_t)tpc->lastvalue : (uint32_t)tpc->lastvalue;
+        uint32_t relband = (mag / 1000) * tpc->relband + (mag % 1000) * tpc->relband / 1000;
+        if(relband > band)
+          band = relband;
+      }
+      if(diff <= band){
+        tpc->suppressed++;
+        return ETM_PUB_SUPPRESSED;
+      }
+    }
+  }
+
+  char text[12];
+  if(data == NULL){
+    snprintf(text, sizeof(text), "%ld", (long)value);
+    data = (uint8_t *)text;
+    datalen = strlen(text);
+  }
+  int res = this->publish(tpcidx, qos, data, datalen);
+  if(res != -1){
+    tpc->lastvalue = value;
+    tpc->lastsent = now;
+    tpc->hassent = true;
+  }
+  return res;
+}
+
+uint16_t eseyeETMBase::pubsuppressed(int tpcidx){
+  if(tpcidx < 0 || tpcidx >= this->maxpubs)
+    return 0;
+  return this->pubtopics[tpcidx].suppressed;
+}
+#endif
+
+#ifdef STORE_FORWARD
+/* Record header: qos (or STORE_REC_SENT), topic hash, payload length */
+#define STORE_REC_SENT 0xff
+#define STORE_REC_HASH(rec) ((rec)[1] | ((rec)[2] << 8))
+#define STORE_REC_LEN(rec)  ((rec)[3] | ((rec)[4] << 8))
+
+boolean eseyeETMBase::storeforward(eseyeStore *store, tstorePolicy policy, uint16_t drainms){
+  uint8_t rec[STORE_RECSIZE_MAX];
+  if(store != NULL && (store->recsize() > STORE_RECSIZE_MAX || store->recsize() <= STORE_REC_HDRLEN || store->capacity() == 0))
+    return false;
+  this->store = store;
+  this->storepolicy = policy;
+  this->drainms = drainms;
+  this->storehead = 0;
+  this->storecount = 0;
+  this->storesent = 0;
+  this->storeheld = false;
+  if(store != NULL && store->load(&this->storehead, &this->storecount) == false){
+    this->storehead = 0;
+    this->storecount = 0;
+  }
+  /* Records already sent from behind held ones */
+  for(uint16_t i = 0; i < this->storecount; i++){
+    if(store->readrec((this->storehead + i) % store->capacity(), rec) && rec[0] == STORE_REC_SENT)
+      this->storesent++;
+  }
+  if(this->storecount > 0)
+    this->storeskip();
+  return true;
+}
+
+uint16_t eseyeETMBase::storedcount(void){
+  return this->storecount - this->storesent;
+}
+
+uint16_t eseyeETMBase::storedropped(void){
+  return this->storedrops;
+}
+
+/* Is a publish to the topic waiting in the store */
+boolean eseyeETMBase::storefind(uint16_t topichash){
+  uint8_t rec[STORE_RECSIZE_MAX];
+  if(this->storecount == this->storesent)
+    return false;
+  for(uint16_t i = 0; i < this->storecount; i++){
+    if(this->store->readrec((this->storehead + i) % this->store->capacity(), rec) == false)
+      continue;
+    if(rec[0] != STORE_REC_SENT && STORE_REC_HASH(rec) == topichash)
+      return true;
+  }
+  return false;
+}
+
+/* Move the records still to send up behind the head, over the ones sent out of order */
+void eseyeETMBase::storecompact(void){
+  uint8_t rec[STORE_RECSIZE_MAX];
+  uint16_t capacity = this->store->capacity();
+  uint16_t kept = 0;
+  for(uint16_t i = 0; i < this->storecount; i++){
+    if(this->store->readrec((this->storehead + i) % capacity, rec) == false || rec[0] == STORE_REC_SENT)
+      continue;
+    if(kept != i)
+      this->store->writerec((this->storehead + kept) % capacity, rec);
+    kept++;
+  }
+  this->storecount = kept;
+  this->storesent = 0;
+  this->store->save(this->storehead, this->storecount);
+}
+
+/* Append a publish to the store ring */
+int eseyeETMBase::storeput(int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen){
+  uint8_t rec[STORE_RECSIZE_MAX];
+  uint16_t recsize = this->store->recsize();
+  uint16_t capacity = this->store->capacity();
+  uint16_t topichash = this->pubtopics[tpcidx].topichash;
+  if(datalen > recsize - STORE_REC_HDRLEN)
+    return -1;
+  if(this->storecount == capacity && this->storesent > 0)
+    this->storecompact();
+  if(this->storecount == capacity){
+    this->storedrops++;
+    if(this->storepolicy == STORE_DROP_NEWEST)
+      return -1;
+    this->storehead = (this->storehead + 1) % capacity;
+    this->storecount--;
+    this->storeskip();
+  }
+  rec[0] = qos;
+  rec[1] = topichash;
+  rec[2] = topichash >> 8;
+  rec[3] = datalen;
+  rec[4] = datalen >> 8;
+  memcpy(&rec[STORE_REC_HDRLEN], data, datalen);
+  if(this->store->writerec((this->storehead + this->storecount) % capacity, rec) == false)
+    return -1;
+  this->storecount++;
+  this->storeheld = false;
+  this->store->save(this->storehead, this->storecount);
+  UARTDEBUGPRINTF("Stored publish to %d (%u waiting)\n", tpcidx, this->storecount - this->storesent);
+  return ETM_PUB_STORED;
+}
+
+/* Drop records at the head that have already been sent */
+void eseyeETMBase::storeskip(void){
+  uint8_t rec[STORE_RECSIZE_MAX];
+  while(this->storesent > 0 && this->store->readrec(this->storehead, rec) && rec[0] == STORE_REC_SENT){
+    this->storehead = (this->storehead + 1) % this->store->capacity();
+    this->storecount--;
+    this->storesent--;
+  }
+}
+
+/* Take a record out of the ring - a record behind the head is marked sent in place */
+void eseyeETMBase::storeremove(uint16_t pos, uint8_t *rec){
+  uint16_t capacity = this->store->capacity();
+  if(pos > 0){
+    rec[0] = STORE_REC_SENT;
+    if(this->store->writerec((this->storehead + pos) % capacity, rec))
+      this->storesent++;
+    return;
+  }
+  this->storehead = (this->storehead + 1) % capacity;
+  this->storecount--;
+  this->storeskip();
+  this->store->save(this->storehead, this->storecount);
+}
+
+/* A registered topic with this hash, or -1 */
+int eseyeETMBase::storetopic(uint16_t topichash){
+  for(int i = 0; i < this->maxpubs; i++){
+    if(this->pubtopics[i].pubstate == PUB_TOPIC_REGISTERED && this->pubtopics[i].topichash == topichash)
+      return i;
+  }
+  return -1;
+}
+
+/* Send the oldest stored publish whose topic is registered. Records for other
+ * topics are held in place, so one topic that doesn't come back can't hold up
+ * the rest and each topic's messages still go in order. */
+void eseyeETMBase::storedrain(void){
+  uint8_t rec[STORE_RECSIZE_MAX];
+  if(this->store == NULL || this->storecount == 0 || this->mqttup == false || this->storeheld)
+    return;
+  if(this->drainms != 0 && millis() - this->lastdrain < this->drainms)
+    return;
+#ifdef FILTER_OK
+  if(this->cmdcount >= CMD_FIFO_LEN)
+    return;
+#endif
+#ifdef PUB_QUEUE
+  if(this->pubmsgnext() != NULL)
+    return;
+#endif
+  for(uint16_t i = 0; i < this->storecount; i++){
+    if(this->store->readrec((this->storehead + i) % this->store->capacity(), rec) == false)
+      return;
+    if(rec[0] == STORE_REC_SENT)
+      continue;
+    uint16_t datalen = STORE_REC_LEN(rec);
+    if(datalen > this->store->recsize() - STORE_REC_HDRLEN){
+      /* Not something we can send - don't let it block the rest */
+      this->storeremove(i, rec);
+      return;
+    }
+    int tpcidx = this->storetopic(STORE_REC_HASH(rec));
+    if(tpcidx < 0)
+      continue;
+    /* Publish with the store out of the way so it isn't stored again */
+    eseyeStore *store = this->store;
+    this->store = NULL;
+    int res = this->publish(tpcidx, rec[0], &rec[STORE_REC_HDRLEN], datalen);
+    this->store = store;
+    if(res != -1){
+      this->storeremove(i, rec);
+      this->lastdrain = millis();
+    }
+    return;
+  }
+  /* Nothing to send until a topic is registered or MQTT comes back */
+  this->storeheld = true;
+}
+#endif
+
+#ifdef PUB_QUEUE
+/* Take the next entry in the publish queue, reusing completed entries */
+struct pubmsg *eseyeETMBase::pubmsgalloc(void){
+  struct pubmsg *msg;
+  while(this->pubqcount > 0){
+    msg = &this->pubqueue[this->pubqhead];
+    if(msg->msgstate != PUB_MSG_SENT && msg->msgstate != PUB_MSG_FAILED)
+      break;
+    msg->msgstate = PUB_MSG_FREE;
+    this->pubqhead = (this->pubqhead + 1) % this->pubqlen;
+    this->pubqcount--;
+  }
+  if(this->pubqcount == this->pubqlen)
+    return NULL;
+  msg = &this->pubqueue[(this->pubqhead + this->pubqcount) % this->pubqlen];
+  this->pubqcount++;
+  msg->handle = this->pubseq++;
+  return msg;
+}
+
+/* Write a publish to the uart - the caller has checked there is room in the command FIFO */
+void eseyeETMBase::pubmsgsend(struct pubmsg *msg, uint8_t *data){
+  if(this->pubtopics[msg->tpcidx].pubstate != PUB_TOPIC_REGISTERED){
+    this->pubmsgdone(msg, false);
+    return;
+  }
+  /* A binary publish can be answered before writepublish() returns */
+  msg->msgstate = PUB_MSG_SENDING;
+  this->pubsentadd(msg);
+#ifdef ETM_STATS
+  msg->senttime = millis();
+#endif
+  this->writepublish(msg->tpcidx, msg->qos, data, msg->datalen);
+}
+
+/* Pipeline queued publishes while there is room in the command FIFO */
+void eseyeETMBase::pubqueuesend(void){
+  struct pubmsg *msg;
+#ifdef BINARY_TRANSFER
+  /* Nothing can be sent while a binary payload waits for its prompt */
+  if(this->txbuf != NULL)
+    return;
+#endif
+  while(this->cmdcount < CMD_FIFO_LEN && this->pubinflight() < this->pubwin && (msg = this->pubmsgnext()) != NULL){
+    this->pubmsgsend(msg, this->pubmsgdata(msg));
+  }
+}
+
+uint8_t *eseyeETMBase::pubmsgdata(struct pubmsg *msg){
+  return &this->pubqdata[(msg - this->pubqueue) * PUB_QUEUE_MSGLEN];
+}
+
+struct pubmsg *eseyeETMBase::pubmsgnext(void){
+  for(uint8_t i = 0; i < this->pubqcount; i++){
+    struct pubmsg *msg = &this->pubqueue[(this->pubqhead + i) % this->pubqlen];
+    if(msg->msgstate != PUB_MSG_QUEUED)
+      continue;
+#ifdef SESSION_RECOVERY
+    /* Sent again once the session is back and its topic re-opened */
+    if(this->pubtopics[msg->tpcidx].pubstate == PUB_TOPIC_REGISTERING)
+      continue;
+#endif
+#ifdef PUB_RETRY
+    if(this->pubmsgheld(i))
+      continue;
+#endif
+    return msg;
+  }
+  return NULL;
+}
+
+void eseyeETMBase::pubsentadd(struct pubmsg *msg){
+  uint8_t len = 2 * this->pubqlen;
+  if(this->pubsentcount == len){
+    /* At most pubqlen are messages - give up on the oldest timed out one */
+    int pos = this->pubsentfind(PUB_MSG_UNKNOWN, PUBSENT_LATE);
+    if(pos < 0)
+      pos = this->pubsentfind(PUB_MSG_UNKNOWN, PUBSENT_LATEOK);
+#ifdef TIMEOUT_RESPONSES
+    else
+      this->publate--;
+#endif
+    if(pos >= 0)
+      this->pubsentdel(pos);
+  }
+  this->pubsent[(this->pubsenthead + this->pubsentcount++) % len] = msg - this->pubqueue;
+}
+
+int eseyeETMBase::pubsentfind(int8_t msgstate, uint8_t mark){
+  for(uint8_t i = 0; i < this->pubsentcount; i++){
+    uint8_t slot = this->pubsent[(this->pubsenthead + i) % (2 * this->pubqlen)];
+    if(slot >= PUBSENT_LATEOK ? slot == mark : this->pubqueue[slot].msgstate == msgstate)
+      return i;
+  }
+  return -1;
+}
+
+int eseyeETMBase::pubsentpos(struct pubmsg *msg){
+  for(uint8_t i = 0; i < this->pubsentcount; i++){
+    if(this->pubsent[(this->pubsenthead + i) % (2 * this->pubqlen)] == msg - this->pubqueue)
+      return i;
+  }
+  return -1;
+}
+
+void eseyeETMBase::pubsentdel(uint8_t pos){
+  uint8_t len = 2 * this->pubqlen;
+  for(uint8_t i = pos; i > 0; i--)
+    this->pubsent[(this->pubsenthead + i) % len] = this->pubsent[(this->pubsenthead + i - 1) % len];
+  this->pubsenthead = (this->pubsenthead + 1) % len;
+  this->pubsentcount--;
+}
+
+/* Publishes written to the modem and not yet answered */
+uint8_t eseyeETMBase::pubinflight(void){
+  uint8_t inflight = 0;
+  for(uint8_t i = 0; i < this->pubqcount; i++){
+    int8_t msgstate = this->pubqueue[(this->pubqhead + i) % this->pubqlen].msgstate;
+    if(msgstate == PUB_MSG_SENDING || msgstate == PUB_MSG_WAITSEND)
+      inflight++;
+  }
+  return inflight;
+}
+
+void eseyeETMBase::pubwindow(uint8_t window){
+  if(window < 1)
+    window = 1;
+  if(window > this->pubqlen)
+    window = this->pubqlen;
+  this->pubwin = window;
+}
+
+#ifdef PUB_RETRY
+void eseyeETMBase::pubretry(uint8_t retries, uint16_t backoff, uint16_t maxbackoff){
+  this->retries = retries;
+  this->retrybackoff = backoff;
+  this->retrymaxbackoff = maxbackoff < backoff ? backoff : maxbackoff;
+}
+
+/* Queue an answered publish to be sent again - false if it is complete */
+boolean eseyeETMBase::pubmsgretry(struct pubmsg *msg, boolean ok){
+  if(msg->retain == false || (ok && msg->goback == false))
+    return false;
+  if(msg->goback){
+    /* An earlier message on the topic failed - go again after it, whatever our own result */
+    msg->goback = false;
+    msg->backoff = 0;
+  }else{
+    if(msg->fails >= this->retries)
+      return false;
+    unsigned long backoff = this->retrybackoff;
+    for(uint8_t i = 0; i < msg->fails && backoff < this->retrymaxbackoff; i++)
+      backoff <<= 1;
+    msg->backoff = backoff < this->retrymaxbackoff ? backoff : this->retrymaxbackoff;
+    msg->fails++;
+    STAT_INC(pubretries);
+    /* Later messages on the topic that are already with the modem follow it again */
+    uint8_t pos = (msg - this->pubqueue + this->pubqlen - this->pubqhead) % this->pubqlen;
+    for(uint8_t i = pos + 1; i < this->pubqcount; i++){
+      struct pubmsg *later = &this->pubqueue[(this->pubqhead + i) % this->pubqlen];
+      if(later->tpcidx == msg->tpcidx && later->retain &&
+         (later->msgstate == PUB_MSG_SENDING || later->msgstate == PUB_MSG_WAITSEND))
+        later->goback = true;
+    }
+    UARTDEBUGPRINTF("Publish %d failed, retry in %u ms\n", msg->handle, msg->backoff);
+  }
+#ifdef TIMEOUT_RESPONSES
+  this->deadlinedel(DL_PUBMSG, msg - this->pubqueue);
+#endif
+  int pos = this->pubsentpos(msg);
+  if(pos >= 0)
+    this->pubsentdel(pos);
+  msg->failtime = millis();
+  msg->msgstate = PUB_MSG_QUEUED;
+  return true;
+}
+
+/* A queued message waits out its backoff, and for anything earlier on its topic that is to be sent again */
+boolean eseyeETMBase::pubmsgheld(uint8_t pos){
+  struct pubmsg *msg = &this->pubqueue[(this->pubqhead + pos) % this->pubqlen];
+  if(msg->backoff != 0 && millis() - msg->failtime < msg->backoff)
+    return true;
+  return this->pubtopicheld(msg->tpcidx, pos);
+}
+
+boolean eseyeETMBase::pubtopicheld(uint8_t tpcidx, uint8_t pos){
+  for(uint8_t i = 0; i < pos; i++){
+    struct pubmsg *msg = &this->pubqueue[(this->pubqhead + i) % this->pubqlen];
+    if(msg->tpcidx == tpcidx && (msg->msgstate == PUB_MSG_QUEUED || msg->goback))
+      return true;
+  }
+  return false;
+}
+#endif
+
+/* OK/ERROR response to the publish command sent longest ago */
+void eseyeETMBase::pubcmddone(boolean ok){
+  int pos = this->pubsentfind(PUB_MSG_SENDING, 0);
+  if(pos < 0)
+    return;
+  struct pubmsg *msg = &this->pubqueue[this->pubsent[(this->pubsenthead + pos) % (2 * this->pubqlen)]];
+  if(ok){
+    msg->msgstate = PUB_MSG_WAITSEND;
+#ifdef TIMEOUT_RESPONSES
+    this->deadlineadd(DL_PUBMSG, msg - this->pubqueue, this->publishtimeout);
+#endif
+  }else{
+    this->pubmsgdone(msg, false);
+  }
+}
+
+#ifdef TIMEOUT_RESPONSES
+/* The publish command sent longest ago has timed out - fail it, keeping its
+ * place in the send order for an OK that comes late */
+void eseyeETMBase::pubcmdtimeout(void){
+  int pos = this->pubsentfind(PUB_MSG_SENDING, 0);
+  if(pos < 0)
+    return;
+  uint8_t *slot = &this->pubsent[(this->pubsenthead + pos) % (2 * this->pubqlen)];
+  struct pubmsg *msg = &this->pubqueue[*slot];
+  *slot = PUBSENT_LATEOK;
+  this->pubmsgdone(msg, false);
+}
+#endif
+
+/* :SEND OK/:SEND FAIL completes the accepted publish sent longest ago */
+void eseyeETMBase::pubsenddone(boolean ok){
+  int pos = this->pubsentfind(PUB_MSG_WAITSEND, PUBSENT_LATE);
+  if(pos < 0)
+    return;
+  uint8_t slot = this->pubsent[(this->pubsenthead + pos) % (2 * this->pubqlen)];
+  if(slot == PUBSENT_LATE){
+    /* The answer to one that has already timed out */
+    this->pubsentdel(pos);
+#ifdef TIMEOUT_RESPONSES
+    this->publate--;
+#endif
+    return;
+  }
+  struct pubmsg *msg = &this->pubqueue[slot];
+#ifdef PUB_RETRY
+  if(this->pubmsgretry(msg, ok))
+    return;
+#endif
+  this->pubmsgdone(msg, ok);
+}
+
+/* Complete a publish and account for it in the batch */
+void eseyeETMBase::pubmsgdone(struct pubmsg *msg, boolean ok){
+#ifdef TIMEOUT_RESPONSES
+  if(msg->msgstate == PUB_MSG_WAITSEND)
+    this->deadlinedel(DL_PUBMSG, msg - this->pubqueue);
+#endif
+  int pos = this->pubsentpos(msg);
+  if(pos >= 0)
+    this->pubsentdel(pos);
+#ifdef ETM_STATS
+  if(ok && msg->msgstate == PUB_MSG_WAITSEND)
+    this->histadd(&this->etmstat.publish, msg->senttime);
+#endif
+  msg->msgstate = ok ? PUB_MSG_SENT : PUB_MSG_FAILED;
+#ifdef PUB_RETRY
+  msg->goback = false;
+#endif
+  this->opdone(ETM_CMD_PUBLISH, msg->handle, ok ? msg->handle : -1);
+  if(msg->inbatch == false)
+    return;
+  msg->inbatch = false;
+  this->batchpending--;
+  if(ok)
+    this->batchsent++;
+  else
+    this->batchfailed++;
+  if(this->batchclosed && this->batchpending == 0 && this->batchcallback != NULL){
+    _batchcb callback = this->batchcallback;
+    this->batchcallback = NULL;
+    callback(this->batchsent, this->batchfailed);
+  }
+}
+
+/* Batch publish API */
+
+void eseyeETMBase::batchbegin(void){
+  /* Anything still in flight from an earlier batch completes on its own */
+  for(uint8_t i = 0; i < this->pubqcount; i++)
+    this->pubqueue[(this->pubqhead + i) % this->pubqlen].inbatch = false;
+  this->batching = true;
+  this->batchclosed = false;
+  this->batchpending = 0;
+  this->batchsent = 0;
+  this->batchfailed = 0;
+  this->batchcallback = NULL;
+}
+
+int eseyeETMBase::batchadd(int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen){
+  int handle;
+  if(this->batching == false)
+    return -1;
+  /* A full queue only delays us while there is something outstanding to free a slot */
+  while((handle = this->publish(tpcidx, qos, data, datalen)) == -1 &&
+        tpcidx >= 0 && tpcidx < this->maxpubs && this->pubtopics[tpcidx].pubstate == PUB_TOPIC_REGISTERED &&
+        (this->pubqcount > 0 || this->cmdcount > 0)){
+    yield();
+    this->poll();
+  }
+  if(handle == -1)
+    this->batchfailed++;
+  return handle;
+}
+
+void eseyeETMBase::batchend(_batchcb callback){
+  this->batching = false;
+  this->batchclosed = true;
+  this->batchcallback = NULL;
+  if(this->batchpending == 0){
+    if(callback != NULL)
+      callback(this->batchsent, this->batchfailed);
+  }else{
+    this->batchcallback = callback;
+  }
+}
+
+tpubMsgState eseyeETMBase::batchstate(void){
+  if(this->batchclosed == false || this->batchpending > 0)
+    return PUB_MSG_SENDING;
+  return this->batchfailed > 0 ? PUB_MSG_FAILED : PUB_MSG_SENT;
+}
+
+int eseyeETMBase::batchconfirm(void){
+  if(this->batching)
+    this->batchend();
+  while(this->batchpending > 0){
+    yield();
+    this->poll();
+  }
+  return this->batchfailed > 0 ? -1 : this->batchsent;
+}
+
+tpubMsgState eseyeETMBase::pubmsgstate(int handle){
+  for(uint8_t i = 0; i < this->pubqcount; i++){
+    struct pubmsg *msg = &this->pubqueue[(this->pubqhead + i) % this->pubqlen];
+    if(msg->handle == handle)
+      return (tpubMsgState)msg->msgstate;
+  }
+  return PUB_MSG_UNKNOWN;
+}
+#endif
+
+/* Check if all publishes are complete */
+boolean eseyeETMBase::pubdone(void){
+#ifdef PUB_QUEUE
+  for(uint8_t i = 0; i < this->pubqcount; i++){
+    int8_t msgstate = this->pubqueue[(this->pubqhead + i) % this->pubqlen].msgstate;
+    if(msgstate != PUB_MSG_SENT && msgstate != PUB_MSG_FAILED)
+      return false;
+  }
+#endif
+  return true;
+}
+
+#ifdef FILTER_OK
+int eseyeETMBase::pubregconfirm(char *topic){
+    int op = this->pubregasync(topic);
+    if(op != -1)
+        return this->opwait(op);
+    /* Every request slot is in use - follow the topic state instead */
+    int pubtemp = this->pubreg(topic);
+    tpubTopicState pstate = PUB_TOPIC_REGISTERING;
+    while(pubtemp != -1 && pstate == PUB_TOPIC_REGISTERING){
+        yield();
+        this->poll();
+        pstate = this->pubstate(pubtemp);
+    }
+    if(pstate == PUB_TOPIC_ERROR)
+        pubtemp = -1;
+    return pubtemp;
+}
+#endif
+
+#ifdef FILTER_OK
+int eseyeETMBase::publishconfirm(int tpcidx, uint8_t qos, uint8_t *data, uint8_t datalen){
+    int res = this->publish(tpcidx, qos, data, datalen);
+#ifdef PUB_QUEUE
+    /* Wait for the modem to accept or reject the publish */
+    tpubMsgState msgstate = PUB_MSG_QUEUED;
+    while(res != -1 && (msgstate == PUB_MSG_QUEUED || msgstate == PUB_MSG_SENDING)){
+        yield();
+        this->poll();
+        msgstate = this->pubmsgstate(res);
+    }
+    if(msgstate == PUB_MSG_FAILED)
+        res = -1;
+#else
+    this->waitSync();
+#endif
+    return res;
+}
+#endif
+
+/* Asynchronous request API */
+
+#define OP_FREE    0
+#define OP_PENDING 1
+#define OP_DONE    2
+/* Handles carry a sequence number so a stale one doesn't find a later request */
+#define OP_HANDLE(slot) ((this->ops[slot].seq & 0x7f) * MAX_PENDING_OPS + (slot))
+
+/* Claim a free slot before making a request so it can always be tracked. The
+ * request may poll, and a callback make a request of its own, before opstart() */
+int eseyeETMBase::opclaim(void){
+  for(uint8_t i = 0; i < MAX_PENDING_OPS; i++){
+    struct etmop *op = &this->ops[i];
+    if(op->opstate == OP_FREE){
+      /* Pending on nothing until opstart() - opdone() never matches ETM_CMD_NONE */
+      op->opstate = OP_PENDING;
+      op->kind = ETM_CMD_NONE;
+      op->seq = this->opseq++;
+      op->callback = NULL;
+      return i;
+    }
+  }
+  return -1;
+}
+
+int eseyeETMBase::opstart(int slot, tetmCmd kind, int idx, _opcb done, void *ctx){
+  struct etmop *op = &this->ops[slot];
+  op->kind = kind;
+  op->idx = idx;
+  op->result = ETM_OP_PENDING;
+  op->callback = done;
+  op->ctx = ctx;
+  return OP_HANDLE(slot);
+}
+
+struct etmop *eseyeETMBase::opfind(int op){
+  if(op < 0)
+    return NULL;
+  uint8_t slot = op % MAX_PENDING_OPS;
+  if(this->ops[slot].opstate == OP_FREE || OP_HANDLE(slot) != op)
+    return NULL;
+  return &this->ops[slot];
+}
+
+/* A request has completed - callbacks are left to poll() */
+void eseyeETMBase::opdone(tetmCmd kind, int idx, int result){
+  for(uint8_t i = 0; i < MAX_PENDING_OPS; i++){
+    struct etmop *op = &this->ops[i];
+    if(op->opstate == OP_PENDING && op->kind == kind && op->idx == idx){
+      op->opstate = OP_DONE;
+      op->result = result;
+      if(op->callback != NULL)
+        this->opsdone = true;
+    }
+  }
+}
+
+void eseyeETMBase::opcallbacks(void){
+  this->opsdone = false;
+  for(uint8_t i = 0; i < MAX_PENDING_OPS; i++){
+    struct etmop *op = &this->ops[i];
+    if(op->opstate == OP_DONE && op->callback != NULL){
+      /* Free the slot first so the callback can make another request */
+      op->opstate = OP_FREE;
+      op->callback(op->ctx, OP_HANDLE(i), op->result);
+    }
+  }
+}
+
+int eseyeETMBase::subscribeasync(char *topic, _msgcb callback, _opcb done, void *ctx){
+  int slot = this->opclaim();
+  if(slot == -1)
+    return -1;
+  int idx = this->subscribe(topic, callback);
+  if(idx == -1){
+    this->ops[slot].opstate = OP_FREE;
+    return -1;
+  }
+  return this->opstart(slot, ETM_CMD_SUBSCRIBE, idx, done, ctx);
+}
+
+int eseyeETMBase::pubregasync(char *topic, _opcb done, void *ctx){
+  int slot = this->opclaim();
+  if(slot == -1)
+    return -1;
+  int idx = this->pubreg(topic);
+  if(idx == -1){
+    this->ops[slot].opstate = OP_FREE;
+    return -1;
+  }
+  return this->opstart(slot, ETM_CMD_PUBREG, idx, done, ctx);
+}
+
+#ifdef PUB_QUEUE
+int eseyeETMBase::publishasync(int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen, _opcb done, void *ctx){
+  int slot = this->opclaim();
+  if(slot == -1)
+    return -1;
+  int handle = this->publish(tpcidx, qos, data, datalen);
+  if(handle == -1){
+    this->ops[slot].opstate = OP_FREE;
+    return -1;
+  }
+  int op = this->opstart(slot, ETM_CMD_PUBLISH, handle, done, ctx);
+  /* Stored, or answered before publish() returned */
+  tpubMsgState msgstate = handle < 0 ? PUB_MSG_SENT : this->pubmsgstate(handle);
+  if(msgstate == PUB_MSG_SENT || msgstate == PUB_MSG_FAILED){
+    this->ops[slot].opstate = OP_DONE;
+    this->ops[slot].result = msgstate == PUB_MSG_SENT ? handle : -1;
+    if(done != NULL)
+      this->opsdone = true;
+  }
+  return op;
+}
+#endif
+
+boolean eseyeETMBase::opready(int op){
+  struct etmop *o = this->opfind(op);
+  return o == NULL || o->opstate == OP_DONE;
+}
+
+int eseyeETMBase::opresult(int op){
+  struct etmop *o = this->opfind(op);
+  if(o == NULL)
+    return -1;
+  if(o->opstate != OP_DONE)
+    return ETM_OP_PENDING;
+  o->opstate = OP_FREE;
+  return o->result;
+}
+
+int eseyeETMBase::opwait(int op){
+  while(this->opready(op) == false){
+    yield();
+    this->poll();
+  }
+  return this->opresult(op);
+}
+
+/* Polling loop - the work is done here */
+void eseyeETMBase::poll(void){
+  char nextchar;
+#ifdef TIMEOUT_RESPONSES
+  this->checkTimeout();
+#endif 
+  while (this->atuart->available() > 0) {
+    nextchar = this->atuart->read();
+    STAT_INC(rxbytes);
+
+#ifdef removed
+    char tempstr[2];
+    tempstr[0] = nextchar;
+    tempstr[1] = 0;
+    if(nextchar == 0x0d){
+        UARTDEBUGLN(tempstr);
+    }else{
+        UARTDEBUG(tempstr);
+    }
+#endif
+
+    this->modemrxbuf[this->rxbufidx++] = nextchar;
+    this->modemrxbuf[this->rxbufidx] = 0;
+    if(this->binaryread > 0){
+      this->binaryread--;
+      this->buffered++;
+      /* modemrxbuf contains the next chunk of the binary message */
+      if(this->binaryread == 0 || this->buffered == this->rxbufsize){
+        this->delivermsg();
+        this->rxbufidx = 0;
+      }
+    }else if(this->rxoverflow){
+      /* Drop the rest of an overlong line */
+      this->rxbufidx = 0;
+      if(nextchar == 0x0a){
+        this->rxoverflow = false;
+        UARTDEBUGPRINTF("Discarding overlong line\n");
+      }
+    }else{
+#ifdef BINARY_TRANSFER
+      /* Data prompt - stream the waiting binary payload */
+      if(this->rxbufidx == 1 && nextchar == '>' && this->txbuf != NULL){
+        this->atwrite(this->txbuf, this->txbuflen);
+        this->txbuf = NULL;
+        this->txbuflen = 0;
+        this->rxbufidx = 0;
+        this->skipspace = true;
+        continue;
+      }
+      /* The prompt is followed by a space */
+      if(this->rxbufidx == 1 && nextchar == ' ' && this->skipspace){
+        this->rxbufidx = 0;
+        this->skipspace = false;
+        continue;
+      }
+      this->skipspace = false;
+#endif
+      
+      /* Filter out leading CR/LF - an issue with BG96 */
+      if(this->rxbufidx == 1 && (nextchar == 0x0d || nextchar == 0x0a)){
+          this->rxbufidx = 0;
+          continue;
+      }
+      
+      if(nextchar == 0x0a){
+        /* This is the end of a response */
+        this->processline();
+        this->rxbufidx = 0;
+      }
+    }
+    if(this->rxbufidx >= this->rxbufsize){
+      this->rxbufidx = 0;
+      this->rxoverflow = true;
+      STAT_INC(overflows);
+    }
+  }
+#ifdef PUB_QUEUE
+  this->pubqueuesend();
+#endif
+#ifdef STORE_FORWARD
+  this->storedrain();
+#endif
+#ifdef SESSION_RECOVERY
+  if(this->recoverstate != RECOVER_NONE)
+    this->recoverstep();
+#endif
+  if(this->opsdone)
+    this->opcallbacks();
+}
+
+/* Pass the buffered part of a subscribed message to the application */
+void eseyeETMBase::delivermsg(void){
+  struct subtpc *sub = NULL;
+#ifdef UDP_TRANSFER
+  if(this->readingsub == UDP_READING){
+    if(this->binaryread == 0){
+      if(this->msgoffset == 0){
+        STAT_INC(udprecv);
+        if(this->udpcallback != NULL)
+          this->udpcallback(this->udpctx, this->modemrxbuf, this->buffered);
+      }else{
+        UARTDEBUGPRINTF("Datagram too long (%u)\n", this->msgtotal);
+      }
+      this->readingsub = 0xff;
+    }
+    this->msgoffset += this->buffered;
+    this->buffered = 0;
+    return;
+  }
+#endif
+  if(this->readingsub < this->maxsubs)
+    sub = &this->subtopics[this->readingsub];
+
+  if(sub != NULL && sub->chunkcb != NULL){
+    /* Streaming subscription - every chunk is passed straight out of modemrxbuf */
+    sub->chunkcb(this->modemrxbuf, this->buffered, this->msgoffset, this->msgtotal);
+  }else if(sub != NULL && sub->messagecb != NULL && this->binaryread == 0){
+    if(this->msgoffset == 0 && this->buffered <= 0xff){
+      sub->messagecb(this->modemrxbuf, this->buffered);
+    }else{
+      UARTDEBUGPRINTF("Message too long for idx %d (%u)\n", this->readingsub, this->msgtotal);
+    }
+  }
+  /* Topic handlers get whole messages that fit in the receive buffer */
+  if(sub != NULL && sub->handlers != 0 && this->binaryread == 0 && this->msgoffset == 0){
+    thandlermask mask = sub->handlers;
+    for(uint8_t i = 0; mask != 0; i++, mask >>= 1){
+      if((mask & 1) != 0)
+        this->topichandlers[i].callback(this->topichandlers[i].ctx, this->readingsub, this->modemrxbuf, this->buffered);
+    }
+  }
+  this->msgoffset += this->buffered;
+  this->buffered = 0;
+  if(this->binaryread == 0)
+    this->readingsub = 0xff;
+}
+
+/* Find the table entry whose prefix matches the received line */
+static uint8_t classifyurc(const char *line, uint16_t linelen, uint8_t *prefixlen){
+  for(uint8_t i = 0; i < URC_TABLE_LEN; i++){
+    const struct urcentry *urc = &urctable[i];
+    uint8_t len = pgm_read_byte(&urc->len);
+    if(pgm_read_byte(&urc->prefix[0]) == line[0] && len <= linelen && memcmp_P(line, urc->prefix, len) == 0){
+      *prefixlen = len;
+      return pgm_read_byte(&urc->id);
+    }
+  }
+  *prefixlen = 0;
+  return URC_NONE;
+}
+
+/* Parse "<idx>,<err>" from a PUB/SUB OPEN/CLOSE URC */
+static uint8_t parseidxerr(char *parseptr, int8_t *err){
+  char *errptr;
+  uint8_t idx = strtol(parseptr, &errptr, 10);
+  *err = strtol(errptr + 1, NULL, 10);
+  return idx;
+}
+
+/* Handle a complete line in modemrxbuf */
+void eseyeETMBase::processline(void){
+  char *line = (char *)this->modemrxbuf;
+  boolean handled = true;
+  int8_t err;
+  uint8_t idx;
+  uint8_t prefixlen;
+  uint8_t urcid = classifyurc(line, this->rxbufidx, &prefixlen);
+  STAT_INC(lines);
+  char *parseptr = line + prefixlen;
+
+  switch(urcid){
+    /* Handle module URCs */
+    case URC_ETM_IDLE:
+      this->urcseen |= ETM_IDLE;
+#ifdef STORE_FORWARD
+      this->mqttup = false;
+#endif
+#ifdef SESSION_RECOVERY
+      this->sessionlost(true);
+#endif
+      UARTDEBUGPRINTF("ETM running\n");
+      break;
+    case URC_EMQRDY:
+      this->urcseen |= ETM_MQTT_RDY;
+#ifdef STORE_FORWARD
+      this->mqttup = true;
+      this->storeheld = false;
+#endif
+#ifdef SESSION_RECOVERY
+      this->sessionready();
+#endif
+      UARTDEBUGPRINTF("MQTT ready\n");
+      break;
+    case URC_EURDY:
+      this->urcseen |= ETM_UDP_RDY;
+#ifdef SESSION_RECOVERY
+      this->sessionready();
+#endif
+      UARTDEBUGPRINTF("UDP ready\n");
+      break;
+    case URC_ETMSTATE:
+      this->currentstate = (tetmState)strtol(parseptr, NULL, 10);
+#ifdef STORE_FORWARD
+      this->mqttup = (this->currentstate == ETM_MQTTREADY || this->currentstate == ETM_MQTTSUB);
+      this->storeheld = false;
+#endif
+#ifdef SESSION_RECOVERY
+      if(this->currentstate == ETM_MQTTREADY || this->currentstate == ETM_MQTTSUB || this->currentstate == ETM_UDPACTIVE)
+        this->sessionready();
+      /* ETM_IDLE is also the urcseen bit, so idle is the state before ETM_WAITKEYS */
+      else if(this->sessionup && this->currentstate > ETM_UNKNOWN)
+        this->sessionlost(this->currentstate < ETM_WAITKEYS || this->currentstate == ETM_ERROR);
+#endif
+      if(this->statecallback != NULL)
+        this->statecallback();
+      break;
+    /* Handle MQTT URCs */
+    case URC_SUBOPEN:
+      idx = parseidxerr(parseptr, &err);
+      UARTDEBUGPRINTF("subscribe %d err %d\n", idx, err);
+      if(idx >= this->maxsubs)
+        break;
+#ifdef ETM_STATS
+      if(this->subtopics[idx].substate == SUB_TOPIC_SUBSCRIBING)
+        this->histadd(&this->etmstat.subscribe, this->subtopics[idx].senttime);
+#endif
+#ifdef TIMEOUT_RESPONSES
+      this->deadlinedel(DL_SUBTOPIC, idx);
+#endif
+      /* If we get an already subscribed error assume it was us from before a reboot */
+      if(err == 0 || err == -2)
+        this->subtopics[idx].substate = SUB_TOPIC_SUBSCRIBED;
+      else
+        this->subtopics[idx].substate = SUB_TOPIC_ERROR;
+      this->opdone(ETM_CMD_SUBSCRIBE, idx, (err == 0 || err == -2) ? idx : -1);
+      break;
+    case URC_PUBOPEN:
+      idx = parseidxerr(parseptr, &err);
+      UARTDEBUGPRINTF("pubreg %d err %d\n", idx, err);
+      if(idx >= this->maxpubs)
+        break;
+#ifdef ETM_STATS
+      if(this->pubtopics[idx].pubstate == PUB_TOPIC_REGISTERING)
+        this->histadd(&this->etmstat.pubreg, this->pubtopics[idx].senttime);
+#endif
+#ifdef TIMEOUT_RESPONSES
+      this->deadlinedel(DL_PUBTOPIC, idx);
+#endif
+      /* If we get an already registered error assume it was us from before a reboot */
+      if(err == 0 || err == -2){
+        this->pubtopics[idx].pubstate = PUB_TOPIC_REGISTERED;
+#ifdef STORE_FORWARD
+        this->storeheld = false;
+#endif
+      }else
+        this->pubtopics[idx].pubstate = PUB_TOPIC_ERROR;
+      this->opdone(ETM_CMD_PUBREG, idx, (err == 0 || err == -2) ? idx : -1);
+      break;
+    case URC_SUBCLOSE:
+      idx = parseidxerr(parseptr, &err);
+      UARTDEBUGPRINTF("unsubscribe %d err %d\n", idx, err);
+      if(idx >= this->maxsubs)
+        break;
+#ifdef TIMEOUT_RESPONSES
+      this->deadlinedel(DL_SUBTOPIC, idx);
+#endif
+      this->subtopics[idx].substate = SUB_TOPIC_NOT_IN_USE;
+      break;
+    case URC_PUBCLOSE:
+      idx = parseidxerr(parseptr, &err);
+      UARTDEBUGPRINTF("pubunreg %d err %d\n", idx, err);
+      if(idx >= this->maxpubs)
+        break;
+#ifdef TIMEOUT_RESPONSES
+      this->deadlinedel(DL_PUBTOPIC, idx);
+#endif
+      this->pubtopics[idx].pubstate = PUB_TOPIC_NOT_IN_USE;
+      break;
+    case URC_EMQMSG:{
+      /* This is a published message to which we are subscribed */
+      char *lenptr;
+      /* Read the subindex */
+      this->readingsub = strtol(parseptr, &lenptr, 10);
+      /* Read the length */
+      this->binaryread = strtoul(lenptr + 1, NULL, 10);
+      this->msgtotal = this->binaryread;
+      this->msgoffset = 0;
+      this->buffered = 0;
+      break;
+    }
+#ifdef UDP_TRANSFER
+    case URC_EUDPMSG:
+      /* A received datagram - the data follows like a subscribed message */
+      this->readingsub = UDP_READING;
+      this->binaryread = strtoul(parseptr, NULL, 10);
+      this->msgtotal = this->binaryread;
+      this->msgoffset = 0;
+      this->buffered = 0;
+      break;
+#endif
+    case URC_SENDOK:
+      UARTDEBUGPRINTF("Send OK\n");
+      STAT_INC(sendok);
+#ifdef PUB_QUEUE
+      this->pubsenddone(true);
+#endif
+      break;
+    case URC_SENDFAIL:
+      UARTDEBUGPRINTF("Send Fail\n");
+      STAT_INC(sendfail);
+#ifdef PUB_QUEUE
+      this->pubsenddone(false);
+#endif
+      break;
+    /* Specially for BG96 - AT channel starts with echo true so we turn it off */
+    case URC_APPRDY:
+#ifdef STORE_FORWARD
+      this->mqttup = false;
+#endif
+#ifdef SESSION_RECOVERY
+      this->sessionlost(false);
+#endif
+#ifdef FILTER_OK
+      this->cmdflush();
+#endif
+#ifdef FILTER_OK
+      this->incOKreq(ETM_CMD_ECHO, 0);
+#endif
+      this->writeP(at_echooff);
+      UARTDEBUGPRINTF("BG96 found\n");
+      break;
+#ifdef FILTER_OK
+    case URC_OK:
+    case URC_ERROR:
+      /* Responses to application AT commands are passed on as well */
+      if(this->cmdcount == 0 || this->cmddone(urcid == URC_OK) == ETM_CMD_AT)
+        handled = false;
+      break;
+#endif
+    default:
+      handled = false;
+      break;
+  }
+
+  /* Application registered URC prefixes */
+  for(uint8_t i = 0; handled == false && i < MAX_USER_URCS; i++){
+    struct userurc *uurc = &this->userurcs[i];
+    if(uurc->callback != NULL && uurc->prefix[0] == line[0] && uurc->len <= this->rxbufidx && memcmp(line, uurc->prefix, uurc->len) == 0){
+      uurc->callback(line);
+      handled = true;
+    }
+  }
+
+  if(handled == false){
+    if(this->atcallback != NULL){
+      STAT_INC(forwarded);
+      this->atcallback(line);
+    }else{
+      STAT_INC(discarded);
+      UARTDEBUGPRINTF("Discarding %s\n", line);
+    }
+  }
+}
+
+/* Register a callback for lines starting with prefix. The prefix string must
+ * remain valid while registered. */
+int eseyeETMBase::urcreg(const char *prefix, _atcb callback){
+  size_t len = strlen(prefix);
+  if(callback == NULL || len == 0 || len > 0xff)
+    return -1;
+  for(int i = 0; i < MAX_USER_URCS; i++){
+    if(this->userurcs[i].callback == NULL){
+      this->userurcs[i].prefix = prefix;
+      this->userurcs[i].len = len;
+      this->userurcs[i].callback = callback;
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Remove a registered URC prefix */
+int eseyeETMBase::urcunreg(int idx){
+  if(idx < 0 || idx >= MAX_USER_URCS)
+    return -1;
+  this->userurcs[idx].callback = NULL;
+  return 0;
+}
+
+/* Send an AT command */
+int eseyeETMBase::sendAT(char *atcmd){
+#ifdef TIMEOUT_RESPONSES
+    this->checkTimeout();
+#endif
+    if(this->txbusy())
+        return -1;
+#ifdef FILTER_OK
+    this->incOKreq(ETM_CMD_AT, 0);
+#endif
+    this->atwrite(atcmd);
+    return 0;
+}
+
+int eseyeETMBase::updateState(tetmRequestState streq){
+    if(this->txbusy())
+        return -1;
+#ifdef FILTER_OK
+    this->incOKreq(ETM_CMD_STATE, 0);
+#endif
+    if(streq == ETM_STATE_ONCE){
+        this->currentstate = ETM_UNKNOWN;
+        this->writeP(at_statequery);
+    }else if(streq == ETM_STATE_ON){
+        this->writeP(at_stateon);
+    }else{
+        this->writeP(at_stateoff);
+    }
+    return 0;
+}
+
+#ifdef ETM_STATS
+/* Record a latency from start until now */
+void eseyeETMBase::histadd(struct etmhist *hist, unsigned long start){
+    unsigned long ms = millis() - start;
+    uint8_t bucket = 0;
+    while(bucket < ETM_HIST_BUCKETS - 1 && ms >= (ETM_HIST_BASE << bucket))
+        bucket++;
+    hist->bucket[bucket]++;
+    hist->count++;
+    hist->total += ms;
+    if(ms > hist->max)
+        hist->max = ms;
+}
+
+void eseyeETMBase::stats(struct etmstats *snapshot, boolean reset){
+    if(snapshot != NULL)
+        memcpy(snapshot, &this->etmstat, sizeof(this->etmstat));
+    if(reset)
+        memset(&this->etmstat, 0, sizeof(this->etmstat));
+}
+#endif
+
+/* Sleep API */
+
+void eseyeETMBase::sleeppins(uint8_t clkslppin, uint8_t clkslppol, uint8_t hstwkpin, uint8_t hstwkpol){
+    this->clkslppin = clkslppin;
+    this->clkslppol = clkslppol;
+    this->hstwkpin = hstwkpin;
+    this->hstwkpol = hstwkpol;
+    if(clkslppin != ETM_NO_PIN){
+        pinMode(clkslppin, OUTPUT);
+        digitalWrite(clkslppin, clkslppol == HIGH ? LOW : HIGH);
+    }
+    if(hstwkpin != ETM_NO_PIN)
+        pinMode(hstwkpin, INPUT);
+}
+
+boolean eseyeETMBase::quiescent(void){
+    /* Partly received line or message, or unread input */
+    if(this->rxbufidx != 0 || this->binaryread != 0 || this->rxoverflow || this->atuart->available() > 0)
+        return false;
+#ifdef FILTER_OK
+    if(this->cmdcount != 0)
+        return false;
+#endif
+#ifdef BINARY_TRANSFER
+    if(this->txbuf != NULL)
+        return false;
+#endif
+#ifdef PUB_RETRY
+    /* Publishes held for a retry only need waking for when it is due (nextdeadline()) */
+    for(uint8_t i = 0; i < this->pubqcount; i++){
+        int8_t msgstate = this->pubqueue[(this->pubqhead + i) % this->pubqlen].msgstate;
+        if(msgstate != PUB_MSG_SENT && msgstate != PUB_MSG_FAILED && (msgstate != PUB_MSG_QUEUED || this->pubmsgheld(i) == false))
+            return false;
+    }
+#else
+    if(this->pubdone() == false)
+        return false;
+#endif
+    /* Waiting for +EMQSUBOPEN/+EMQPUBOPEN etc. */
+    for(uint8_t i = 0; i < this->maxsubs; i++){
+        if(this->subtopics[i].substate == SUB_TOPIC_SUBSCRIBING || this->subtopics[i].substate == SUB_TOPIC_UNSUBSCRIBING)
+            return false;
+    }
+    for(uint8_t i = 0; i < this->maxpubs; i++){
+        if(this->pubtopics[i].pubstate == PUB_TOPIC_REGISTERING || this->pubtopics[i].pubstate == PUB_TOPIC_UNREGISTERING)
+            return false;
+    }
+    return this->nextdeadline() != 0;
+}
+
+unsigned long eseyeETMBase::nextdeadline(void){
+    unsigned long deadline = ETM_NO_DEADLINE;
+#ifdef STORE_FORWARD
+    /* Stored publishes ready to drain - none of them are while all wait for their topics */
+    if(this->store != NULL && this->storecount > this->storesent && this->mqttup && this->storeheld == false){
+        unsigned long elapsed = millis() - this->lastdrain;
+        deadline = elapsed >= this->drainms ? 0 : this->drainms - elapsed;
+    }
+#endif
+#ifdef PUB_RETRY
+    /* Publishes waiting out a retry backoff */
+    if(this->cmdcount < CMD_FIFO_LEN && this->pubinflight() < this->pubwin){
+        for(uint8_t i = 0; i < this->pubqcount; i++){
+            struct pubmsg *msg = &this->pubqueue[(this->pubqhead + i) % this->pubqlen];
+            if(msg->msgstate != PUB_MSG_QUEUED || msg->backoff == 0 || this->pubtopicheld(msg->tpcidx, i))
+                continue;
+            unsigned long elapsed = millis() - msg->failtime;
+            if(elapsed >= msg->backoff)
+                deadline = 0;
+            else if(msg->backoff - elapsed < deadline)
+                deadline = msg->backoff - elapsed;
+        }
+    }
+#endif
+#ifdef SESSION_RECOVERY
+    /* Recovery commands to send */
+    if(this->recoverstate == RECOVER_START || this->recoverstate == RECOVER_OPEN){
+#ifdef FILTER_OK
+      if(this->cmdcount < CMD_FIFO_LEN)
+#endif
+        deadline = 0;
+    }
+#endif
+#ifdef TIMEOUT_RESPONSES
+    /* A request due to time out */
+    if(this->dlcount > 0){
+        long remaining = (long)(this->deadlines[0].due - millis());
+        if(remaining <= 0)
+            deadline = 0;
+        else if((unsigned long)remaining < deadline)
+            deadline = remaining;
+    }
+#ifdef FILTER_OK
+    unsigned long cmddue = this->cmdnextdue(millis());
+    if(cmddue < deadline)
+        deadline = cmddue;
+#endif
+#endif
+    return deadline;
+}
+
+twakeReason eseyeETMBase::sleep(unsigned long ms, _idlecb idle){
+    unsigned long start, elapsed, deadline;
+    twakeReason reason = WAKE_TIMER;
+
+    if(this->quiescent() == false)
+        return TRY_AGAIN_SHORTLY;
+    deadline = this->nextdeadline();
+    if(deadline < ms)
+        ms = deadline;
+
+    if(this->clkslppin != ETM_NO_PIN)
+        digitalWrite(this->clkslppin, this->clkslppol);
+    start = millis();
+    while((elapsed = millis() - start) < ms){
+        if(this->wakeflag){
+            reason = WAKE_INT;
+            break;
+        }
+        if(this->atuart->available() > 0 || (this->hstwkpin != ETM_NO_PIN && digitalRead(this->hstwkpin) == this->hstwkpol)){
+            reason = WAKE_CLICK;
+            break;
+        }
+        if(idle != NULL)
+            idle(ms - elapsed);
+        else
+            delay(1);
+    }
+    if(this->clkslppin != ETM_NO_PIN)
+        digitalWrite(this->clkslppin, this->clkslppol == HIGH ? LOW : HIGH);
+    this->wakeflag = false;
+    UARTDEBUGPRINTF("Woke %d after %lu ms\n", reason, millis() - start);
+    return reason;
+}
+
+void eseyeETMBase::wake(void){
+    this->wakeflag = true;
+}
+
 /* Create and initialise API */
 
-eseyeETM::eseyeETM(Stream *uart){
-    if(this->atuart == NULL)
-        this->atuart = uart;
+eseyeETMBase::eseyeETMBase(Stream *uart, struct subtpc *subs, uint8_t numsubs, struct pubtpc *pubs, uint8_t numpubs,
+                           uint8_t *rxbuf, uint16_t rxbuflen, struct pubmsg *pubq, uint8_t pubqlen, uint8_t *pubqdata,
+                           uint8_t *pubsent, struct etmdeadline *deadlines, uint8_t features){
+    this->atuart = uart;
+    this->dbguart = NULL;
+    this->clkslppin = ETM_NO_PIN;
+    this->clkslppol = HIGH;
+    this->hstwkpin = ETM_NO_PIN;
+    this->hstwkpol = HIGH;
+    this->wakeflag = false;
+    this->subtopics = subs;
+    this->maxsubs = numsubs;
+    this->pubtopics = pubs;
+    this->maxpubs = numpubs;
+    this->modemrxbuf = rxbuf;
+    this->rxbufsize = rxbuflen;
+#ifdef PUB_QUEUE
+    this->pubqueue = pubq;
+    this->pubqlen = pubqlen;
+    this->pubqdata = pubqdata;
+    this->pubsent = pubsent;
+#endif
+#ifdef TIMEOUT_RESPONSES
+    this->deadlines = deadlines;
+#endif
+    this->features = features;
 }
 
-void eseyeETM::statecb(_statecb stateupdatecb){
+void eseyeETMBase::statecb(_statecb stateupdatecb){
     this->statecallback = stateupdatecb;
 }
 
-void eseyeETM::init(_atcb urccallback, Stream *trcuart) {
+void eseyeETMBase::init(_atcb urccallback, Stream *trcuart) {
     int i;
-    for(i = 0; i < MAX_SUB_TOPICS; i++){
+    for(i = 0; i < this->maxsubs; i++){
         this->subtopics[i].messagecb = NULL;
+        this->subtopics[i].chunkcb = NULL;
         this->subtopics[i].substate = SUB_TOPIC_NOT_IN_USE;
+        this->subtopics[i].topic = NULL;
+        this->subtopics[i].handlers = 0;
     }
-    for(i = 0; i < MAX_PUB_TOPICS; i++){
+    for(i = 0; i < this->maxpubs; i++){
         this->pubtopics[i].pubstate = PUB_TOPIC_NOT_IN_USE;
+#ifdef ETM_STATS
+        this->pubtopics[i].senttime = 0;
+#endif
+#ifdef SESSION_RECOVERY
+        this->pubtopics[i].topic = NULL;
+#endif
+#ifdef PUB_FILTER
+        this->pubtopics[i].filtered = false;
+        this->pubtopics[i].hassent = false;
+        this->pubtopics[i].suppressed = 0;
+#endif
+    }
+
+    for(i = 0; i < MAX_TOPIC_HANDLERS; i++){
+        this->topichandlers[i].callback = NULL;
+    }
+    for(i = 0; i < MAX_PENDING_OPS; i++){
+        this->ops[i].opstate = OP_FREE;
+    }
+    this->opseq = 0;
+    this->opsdone = false;
+    for(i = 0; i < MAX_USER_URCS; i++){
+        this->userurcs[i].callback = NULL;
     }
 
     this->atcallback = urccallback;
-    this->dbguart = trcuart;
+    this->dbguart = (this->features & ETM_FEAT_DEBUG) ? trcuart : NULL;
 #ifdef BINARY_TRANSFER
+    this->txbuf = NULL;
     this->txbuflen = 0;
+    this->skipspace = false;
+    this->encoding = ETM_ENC_HEX;
+#endif
+#ifdef UDP_TRANSFER
+    this->udpcallback = NULL;
+    this->udpctx = NULL;
 #endif
     this->rxbufidx = 0;
     this->binaryread = 0;
     this->buffered = 0;
+    this->msgtotal = 0;
+    this->msgoffset = 0;
+    this->rxoverflow = false;
     this->readingsub = 0xff;
+#ifdef FILTER_OK
+    this->cmdhead = 0;
+    this->cmdcount = 0;
+    this->cmdlate = 0;
+    this->cmdcallback = NULL;
+#endif
+#ifdef PUB_QUEUE
+    for(i = 0; i < this->pubqlen; i++){
+        this->pubqueue[i].msgstate = PUB_MSG_FREE;
+    }
+    this->pubqhead = 0;
+    this->pubqcount = 0;
+    this->pubseq = 0;
+    this->pubsenthead = 0;
+    this->pubsentcount = 0;
+    this->pubwin = this->pubqlen;
+    this->batching = false;
+    this->batchclosed = false;
+    this->batchpending = 0;
+    this->batchsent = 0;
+    this->batchfailed = 0;
+    this->batchcallback = NULL;
+#endif
+#ifdef PUB_RETRY
+    this->retries = 0;
+    this->retrybackoff = PUB_RETRY_BACKOFF;
+    this->retrymaxbackoff = PUB_RETRY_MAXBACKOFF;
+#endif
+#ifdef ETM_STATS
+    memset(&this->etmstat, 0, sizeof(this->etmstat));
+#endif
+#ifdef TIMEOUT_RESPONSES
+    this->dlcount = 0;
+    this->subtimeout = SUB_TIMEOUT;
+    this->pubtimeout = PUB_TIMEOUT;
+    this->publishtimeout = PUBLISH_TIMEOUT;
+#ifdef PUB_QUEUE
+    this->publate = 0;
+#endif
+    this->cmdtimeout = CMD_TIMEOUT;
+#endif
+#ifdef STORE_FORWARD
+    this->store = NULL;
+    this->storehead = 0;
+    this->storecount = 0;
+    this->storesent = 0;
+    this->storeheld = false;
+    this->storedrops = 0;
+    this->lastdrain = 0;
+    this->mqttup = false;
+#endif
+#ifdef SESSION_RECOVERY
+    this->recoverenable = false;
+    this->sessionup = false;
+    this->sessionproto = ETM_MQTT;
+    this->recoverstate = RECOVER_NONE;
+    this->recovernext = 0;
+    this->recoverstart = 0;
+    this->recoverms = 0;
+#endif
     this->urcseen = 0;
     this->currentstate = ETM_UNKNOWN;
     this->statecallback = NULL;
 }
 
-int eseyeETM::startproto(tetmProto proto){
+int eseyeETMBase::startproto(tetmProto proto){
+    if((proto != ETM_MQTT && proto != ETM_UDP) || this->txbusy())
+        return -1;
+#ifdef FILTER_OK
+    this->incOKreq(ETM_CMD_STARTPROTO, proto);
+#endif
     if(proto == ETM_MQTT){
-        this->atuart->write("AT+ETMSTATE=startmqtt\r\n");
-    }else if (proto == ETM_UDP){
-        this->atuart->write("AT+ETMSTATE=startudp\r\n");
+        this->writeP(at_startmqtt);
     }else{
-        return -1;
+        this->writeP(at_startudp);
     }
-#ifdef FILTER_OK
-    this->incOKreq();
+#ifdef SESSION_RECOVERY
+    this->sessionproto = proto;
 #endif
     return 0;
 }
 
+#ifdef SESSION_RECOVERY
+void eseyeETMBase::autorecover(boolean enable){
+    this->recoverenable = enable;
+    if(enable == false)
+        this->recoverstate = RECOVER_NONE;
+}
+
+boolean eseyeETMBase::recovering(void){
+    return this->recoverstate != RECOVER_NONE;
+}
+
+unsigned long eseyeETMBase::recoverytime(void){
+    return this->recoverms;
+}
+
+/* The protocol is up - re-open the topics if it was lost */
+void eseyeETMBase::sessionready(void){
+    this->sessionup = true;
+    if(RECOVER_LOST(this->recoverstate)){
+        this->recoverstate = RECOVER_OPEN;
+        this->recovernext = 0;
+    }
+}
+
+/* The session has gone with the topics opened on it. idle is true if ETM is
+ * idle and needs the protocol starting again, false to wait for it */
+void eseyeETMBase::sessionlost(boolean idle){
+    uint8_t i;
+    if(this->recoverenable == false || (this->sessionup == false && this->recoverstate == RECOVER_NONE))
+        return;
+    if(this->recoverstate == RECOVER_NONE){
+        this->recoverstart = millis();
+        UARTDEBUGPRINTF("Session lost\n");
+    }
+    this->sessionup = false;
+    this->urcseen &= ~(ETM_MQTT_RDY | ETM_UDP_RDY);
+    /* Topics in use go back to opening on the same index and closes are complete.
+     * Opens in flight wait for the re-open rather than time out */
+    for(i = 0; i < this->maxsubs; i++){
+        struct subtpc *sub = &this->subtopics[i];
+        if(sub->substate == SUB_TOPIC_SUBSCRIBED)
+            sub->substate = SUB_TOPIC_SUBSCRIBING;
+        else if(sub->substate == SUB_TOPIC_UNSUBSCRIBING)
+            sub->substate = SUB_TOPIC_NOT_IN_USE;
+        else if(sub->substate != SUB_TOPIC_SUBSCRIBING)
+            continue;
+#ifdef TIMEOUT_RESPONSES
+        this->deadlinedel(DL_SUBTOPIC, i);
+#endif
+    }
+    for(i = 0; i < this->maxpubs; i++){
+        struct pubtpc *pub = &this->pubtopics[i];
+        if(pub->pubstate == PUB_TOPIC_REGISTERED)
+            pub->pubstate = PUB_TOPIC_REGISTERING;
+        else if(pub->pubstate == PUB_TOPIC_UNREGISTERING)
+            pub->pubstate = PUB_TOPIC_NOT_IN_USE;
+        else if(pub->pubstate != PUB_TOPIC_REGISTERING)
+            continue;
+#ifdef TIMEOUT_RESPONSES
+        this->deadlinedel(DL_PUBTOPIC, i);
+#endif
+    }
+    this->recoverstate = idle ? RECOVER_START : RECOVER_WAIT;
+}
+
+/* Send the recovery's commands from poll() - pipelined while there is room
+ * for their responses - and note when every topic is open again */
+void eseyeETMBase::recoverstep(void){
+    uint16_t i;
+    /* Run from the poll while a binary payload waits for its prompt - carry on later */
+    if(this->txbusy())
+      return;
+    switch(this->recoverstate){
+      case RECOVER_START:
+#ifdef FILTER_OK
+        if(this->cmdcount == CMD_FIFO_LEN)
+          return;
+#endif
+        this->recoverstate = RECOVER_WAITREADY;
+        this->startproto((tetmProto)this->sessionproto);
+        return;
+      case RECOVER_OPEN:
+        while(this->recovernext < this->maxsubs + this->maxpubs){
+#ifdef FILTER_OK
+          if(this->cmdcount == CMD_FIFO_LEN)
+            return;
+#endif
+          i = this->recovernext++;
+          if(i < this->maxsubs){
+            if(this->subtopics[i].substate == SUB_TOPIC_SUBSCRIBING)
+              this->subopen(i, this->subtopics[i].topic);
+          }else{
+            i -= this->maxsubs;
+            if(this->pubtopics[i].pubstate == PUB_TOPIC_REGISTERING)
+              this->pubopen(i, this->pubtopics[i].topic);
+          }
+        }
+        this->recoverstate = RECOVER_WAITOPEN;
+        /* Fall through */
+      case RECOVER_WAITOPEN:
+        for(i = 0; i < this->maxsubs; i++){
+          if(this->subtopics[i].substate == SUB_TOPIC_SUBSCRIBING)
+            return;
+        }
+        for(i = 0; i < this->maxpubs; i++){
+          if(this->pubtopics[i].pubstate == PUB_TOPIC_REGISTERING)
+            return;
+        }
+        this->recoverms = millis() - this->recoverstart;
+        this->recoverstate = RECOVER_NONE;
+#ifdef ETM_STATS
+        this->etmstat.recoveries++;
+        this->histadd(&this->etmstat.recovery, this->recoverstart);
+#endif
+        UARTDEBUGPRINTF("Session recovered in %lu ms\n", this->recoverms);
+        return;
+      default:
+        return;
+    }
+}
+#endif
+
 #ifdef TIMEOUT_RESPONSES
-boolean eseyeETM::checkTimeout(void){
-    /* Check pending pub/sub requests etc. */
-    int topiccount = 0;
-    boolean waiting = false;
-    unsigned long now = millis(), diff;
-    while(topiccount < MAX_PUB_TOPICS){
-        diff = now - this->pubtopics[topiccount].senttime;
-        if(this->pubtopics[topiccount].pubstate == PUB_TOPIC_REGISTERING || this->pubtopics[topiccount].pubstate == PUB_TOPIC_UNREGISTERING){
-            if(diff >= PUB_TIMEOUT){
-                this->pubtopics[topiccount].pubstate = PUB_TOPIC_ERROR;
-                UARTDEBUGPRINTF("Pub idx %d timed out\n", topiccount);
+void eseyeETMBase::settimeout(tetmCmd op, unsigned long ms){
+    switch(op){
+      case ETM_CMD_SUBSCRIBE:
+      case ETM_CMD_UNSUBSCRIBE:
+        this->subtimeout = ms;
+        break;
+      case ETM_CMD_PUBREG:
+      case ETM_CMD_PUBUNREG:
+        this->pubtimeout = ms;
+        break;
+      case ETM_CMD_PUBLISH:
+        this->publishtimeout = ms;
+        break;
+      default:
+        this->cmdtimeout = ms;
+        break;
+    }
+}
+
+/* due times are compared by difference so they survive millis() wrapping */
+#define DL_BEFORE(a, b) ((long)((a).due - (b).due) < 0)
+
+/* Move the deadline at pos up or down the heap to where it belongs */
+void eseyeETMBase::deadlinefix(uint16_t pos){
+    struct etmdeadline dl = this->deadlines[pos];
+    uint16_t child;
+    while(pos > 0 && DL_BEFORE(dl, this->deadlines[(pos - 1) / 2])){
+        this->deadlines[pos] = this->deadlines[(pos - 1) / 2];
+        pos = (pos - 1) / 2;
+    }
+    while((child = 2 * pos + 1) < this->dlcount){
+        if(child + 1 < this->dlcount && DL_BEFORE(this->deadlines[child + 1], this->deadlines[child]))
+            child++;
+        if(!DL_BEFORE(this->deadlines[child], dl))
+            break;
+        this->deadlines[pos] = this->deadlines[child];
+        pos = child;
+    }
+    this->deadlines[pos] = dl;
+}
+
+/* Start the clock on a request - replaces any deadline it already had */
+void eseyeETMBase::deadlineadd(uint8_t kind, uint8_t idx, unsigned long ms){
+    this->deadlinedel(kind, idx);
+    if(ms == 0 || (this->features & ETM_FEAT_TIMEOUTS) == 0)
+        return;
+    struct etmdeadline *dl = &this->deadlines[this->dlcount];
+    dl->due = millis() + ms;
+    dl->kind = kind;
+    dl->idx = idx;
+    this->deadlinefix(this->dlcount++);
+}
+
+/* The request was answered */
+void eseyeETMBase::deadlinedel(uint8_t kind, uint8_t idx){
+    for(uint16_t i = 0; i < this->dlcount; i++){
+        if(this->deadlines[i].kind == kind && this->deadlines[i].idx == idx){
+            this->dlcount--;
+            if(i != this->dlcount){
+                this->deadlines[i] = this->deadlines[this->dlcount];
+                this->deadlinefix(i);
+            }
+            return;
+        }
+    }
+}
+
+void eseyeETMBase::deadlineexpired(uint8_t kind, uint8_t idx){
+    STAT_INC(timeouts);
+    switch(kind){
+      case DL_SUBTOPIC:
+        UARTDEBUGPRINTF("Sub idx %d timed out\n", idx);
+        this->subtopics[idx].substate = SUB_TOPIC_ERROR;
+        this->opdone(ETM_CMD_SUBSCRIBE, idx, -1);
+        break;
+      case DL_PUBTOPIC:
+        UARTDEBUGPRINTF("Pub idx %d timed out\n", idx);
+        this->pubtopics[idx].pubstate = PUB_TOPIC_ERROR;
+        this->opdone(ETM_CMD_PUBREG, idx, -1);
+        break;
+#ifdef PUB_QUEUE
+      case DL_PUBMSG: {
+        /* Its place in the send order takes a late :SEND OK/FAIL - pubsenddone() drops it */
+        UARTDEBUGPRINTF("Publish %d timed out\n", this->pubqueue[idx].handle);
+        int pos = this->pubsentpos(&this->pubqueue[idx]);
+        if(pos >= 0){
+          this->pubsent[(this->pubsenthead + pos) % (2 * this->pubqlen)] = PUBSENT_LATE;
+          this->publate++;
+          this->publatetime = millis();
+        }
+        this->pubmsgdone(&this->pubqueue[idx], false);
+        break;
+      }
+#endif
+      default:
+        break;
+    }
+}
+
+#ifdef FILTER_OK
+/* ms until checkTimeout() fails the oldest command still waiting, or gives up on
+ * the answer to one that has timed out, or ETM_NO_DEADLINE */
+unsigned long eseyeETMBase::cmdnextdue(unsigned long now){
+    unsigned long due = ETM_NO_DEADLINE;
+    for(uint8_t i = 0; i < this->cmdcount && this->cmdtimeout != 0; i++){
+        struct atcmd *cmd = &this->cmdfifo[(this->cmdhead + i) % CMD_FIFO_LEN];
+        unsigned long waited = now - cmd->senttime;
+        unsigned long limit = this->cmdtimeout;
+        if(cmd->cmdtype == ETM_CMD_NONE){
+            if(i > 0)
+                continue;
+            limit *= 2;
+        }
+        if(waited >= limit)
+            return 0;
+        if(limit - waited < due)
+            due = limit - waited;
+        if(cmd->cmdtype != ETM_CMD_NONE)
+            break;
+    }
+    return due;
+}
+#endif
+
+/* Fail requests that have waited too long - returns true if any are still waiting */
+boolean eseyeETMBase::checkTimeout(void){
+    unsigned long now;
+    struct etmdeadline dl;
+    if((this->features & ETM_FEAT_TIMEOUTS) == 0)
+        return false;
+    now = millis();
+#ifdef FILTER_OK
+    /* Responses come in order so commands are overdue oldest first. An overdue
+     * command fails but keeps its place to take its answer if that comes late,
+     * and is only given up on once it has waited twice the timeout */
+    uint8_t i = 0;
+    while(i < this->cmdcount && this->cmdtimeout != 0){
+        struct atcmd *cmd = &this->cmdfifo[(this->cmdhead + i) % CMD_FIFO_LEN];
+        unsigned long waited = now - cmd->senttime;
+        if(waited < this->cmdtimeout)
+            break;
+        if(cmd->cmdtype == ETM_CMD_NONE){
+            if(i == 0 && waited / 2 >= this->cmdtimeout){
+                UARTDEBUGPRINTF("Answer to a timed out command lost\n");
+                this->cmddone(false);
             }else{
-                waiting = true;
+                i++;
             }
+            continue;
         }
-        topiccount++;
+        tetmCmd cmdtype = (tetmCmd)cmd->cmdtype;
+        uint8_t idx = cmd->idx;
+        STAT_INC(timeouts);
+        UARTDEBUGPRINTF("Command %d timed out\n", cmdtype);
+        cmd->cmdtype = ETM_CMD_NONE;
+        cmd->idx = cmdtype;
+        this->cmdlate++;
+#ifdef PUB_QUEUE
+        if(cmdtype == ETM_CMD_PUBLISH)
+            this->pubcmdtimeout();
+#endif
+        this->cmdresult(cmdtype, idx, false);
+        /* The callbacks may have moved the FIFO on - start again */
+        i = 0;
+    }
+#endif
+#ifdef PUB_QUEUE
+    if(this->publate > 0 && now - this->publatetime >= this->publishtimeout){
+        UARTDEBUGPRINTF("%d :SEND answers lost\n", this->publate);
+        int pos;
+        while((pos = this->pubsentfind(PUB_MSG_UNKNOWN, PUBSENT_LATE)) >= 0)
+            this->pubsentdel(pos);
+        this->publate = 0;
+    }
+#endif
+    while(this->dlcount > 0 && (long)(now - this->deadlines[0].due) >= 0){
+        dl = this->deadlines[0];
+        this->dlcount--;
+        if(this->dlcount > 0){
+            this->deadlines[0] = this->deadlines[this->dlcount];
+            this->deadlinefix(0);
+        }
+        this->deadlineexpired(dl.kind, dl.idx);
     }
-    return waiting;
+#ifdef FILTER_OK
+    if(this->cmdcount > 0)
+        return true;
+#endif
+    return this->dlcount > 0;
 }
 #endif
 
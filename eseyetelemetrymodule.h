@@ -25,6 +25,15 @@
 #else
 #include <WProgram.h>
 #endif
+#include "etmcbor.h"
+#include "etmlz.h"
+#include "etmstore.h"
+#include "etmring.h"
+#include "etmtrace.h"
+
+/* The feature defines below are the default configuration. Define ETM_CUSTOM_CONFIG
+ * and pass the wanted FILTER_OK/DEBUG_ESEYETELEMETRYMODULE/... flags to the compiler
+ * instead to trim the library (see extras/host/footprint.sh). */
 
 //#if !defined NEO_SW_SERIAL && !defined SOFTWARE_SERIAL
 /* Software serial uses the software serial library */
@@ -35,73 +44,398 @@
  * while passing through responses to other AT commands from the application.
  * If the application is not using AT commands to the modem do not define 
  * FILTER_OK or set urccb as it will just waste program memory/cpu cycles. */
+#ifndef ETM_CUSTOM_CONFIG
 #define FILTER_OK
+#endif
+#ifdef FILTER_OK
+/* Number of commands that can be awaiting OK/ERROR at once */
+#ifndef CMD_FIFO_LEN
+#define CMD_FIFO_LEN 8
+#endif
+#endif
 
 /* DEBUG_ESEYETELEMETRYMODULE adds debug trace support to the uart selected in the call to 
  * init(). If you are not using this it's best not to define DEBUG_ESEYETELEMETRYMODULE. */
+#ifndef ETM_CUSTOM_CONFIG
 #define DEBUG_ESEYETELEMETRYMODULE
+#endif
 
 /* TIMEOUT_RESPONSES waits for a period of time after sub/pub commands and 
  * marks the index as errored if no response has been seen. You cannot publish to 
- * an errored topic */
+ * an errored topic. Publishes and commands that go unanswered fail the same way,
+ * but keep their place for as long again so a late answer isn't taken for the
+ * next one's. The defaults can be changed at run time with settimeout() */
+#ifndef ETM_CUSTOM_CONFIG
 #define TIMEOUT_RESPONSES
+#endif
 #ifdef TIMEOUT_RESPONSES
+#ifndef PUB_TIMEOUT
 #define PUB_TIMEOUT 3000UL /* 3 second timeout */
-//#define SUB_TIMEOUT 3000UL /* 3 second timeout */
 #endif
+/* The suback only arrives once ETM has connected to the broker, so by default
+ * subscribes wait as long as that takes */
+#ifndef SUB_TIMEOUT
+#define SUB_TIMEOUT 0UL
+#endif
+#ifndef PUBLISH_TIMEOUT
+#define PUBLISH_TIMEOUT 10000UL /* OK to :SEND OK/FAIL */
+#endif
+#ifndef CMD_TIMEOUT
+#define CMD_TIMEOUT 5000UL /* Command to OK/ERROR */
+#endif
+#endif
+
+/* PUB_QUEUE queues publishes that can't be sent straight away and sends them from
+ * poll(). Each publish gets a handle that is completed by the matching :SEND OK or
+ * :SEND FAIL. Messages longer than PUB_QUEUE_MSGLEN can only be published when 
+ * nothing else is queued. Requires FILTER_OK. */
+#ifndef ETM_CUSTOM_CONFIG
+#define PUB_QUEUE
+#endif
+#ifdef PUB_QUEUE
+#ifndef PUB_QUEUE_LEN
+#define PUB_QUEUE_LEN    4
+#endif
+#ifndef PUB_QUEUE_MSGLEN
+#define PUB_QUEUE_MSGLEN 64
+#endif
+#ifndef FILTER_OK
+#error PUB_QUEUE requires FILTER_OK
+#endif
+#endif
+
+/* PUB_RETRY resends QoS 1 publishes that get :SEND FAIL, backing off exponentially
+ * between tries (see pubretry()). Order is kept per topic: nothing later on the topic
+ * is sent until the failed message has been, and later messages that were already
+ * sent go again after it. Messages longer than PUB_QUEUE_MSGLEN aren't retried.
+ * Requires PUB_QUEUE. */
+#ifndef ETM_CUSTOM_CONFIG
+#define PUB_RETRY
+#endif
+#ifdef PUB_RETRY
+#ifndef PUB_RETRY_BACKOFF
+#define PUB_RETRY_BACKOFF    500 /* ms before the first resend */
+#endif
+#ifndef PUB_RETRY_MAXBACKOFF
+#define PUB_RETRY_MAXBACKOFF 8000
+#endif
+#ifndef PUB_QUEUE
+#error PUB_RETRY requires PUB_QUEUE
+#endif
+#endif
+
+/* BINARY_TRANSFER allows publish payloads to be sent as raw bytes after the modem's
+ * '>' data prompt instead of ascii-hex, halving the uart time for each message.
+ * Select it with txencoding(ETM_ENC_BINARY). */
+#ifndef ETM_CUSTOM_CONFIG
+#define BINARY_TRANSFER
+#endif
+#ifdef BINARY_TRANSFER
+#ifndef PROMPT_TIMEOUT
+#define PROMPT_TIMEOUT 500UL /* Wait up to 500ms for the data prompt */
+#endif
+#endif
+
+/* PUB_FILTER lets each publish topic drop readings that haven't changed enough
+ * (publishvalue()), with a minimum interval between sends and a heartbeat after
+ * a maximum silence. Costs 26 bytes of RAM per publish topic. */
+#ifndef ETM_CUSTOM_CONFIG
+#define PUB_FILTER
+#endif
+/* publishvalue() return when the filter drops the reading */
+#define ETM_PUB_SUPPRESSED -2
+
+/* STORE_FORWARD keeps publishes made while MQTT is down in an eseyeStore
+ * (see etmstore.h) and sends them once it is back up. */
+#ifndef ETM_CUSTOM_CONFIG
+#define STORE_FORWARD
+#endif
+#ifdef STORE_FORWARD
+/* Largest store record - a drained record is read onto the stack */
+#ifndef STORE_RECSIZE_MAX
+#define STORE_RECSIZE_MAX (STORE_REC_HDRLEN + 64)
+#endif
+#endif
+/* UDP_TRANSFER adds sendDatagram() and datagramcb() for ETM's UDP protocol
+ * (startproto(ETM_UDP)) - datagrams have no per-message acknowledgement. */
+#ifndef ETM_CUSTOM_CONFIG
+#define UDP_TRANSFER
+#endif
+/* SESSION_RECOVERY keeps each topic's string and callback so that, with
+ * autorecover() on, the library restarts the protocol and re-opens every topic
+ * on its old index after the modem or ETM restarts or MQTT drops. */
+#ifndef ETM_CUSTOM_CONFIG
+#define SESSION_RECOVERY
+#endif
+/* ETM_STATS counts uart traffic, parsed lines and errors and keeps latency
+ * histograms for topic registration and publishes, read with stats(). If you
+ * are not using them it's best not to define ETM_STATS. */
+#ifndef ETM_CUSTOM_CONFIG
+#define ETM_STATS
+#endif
+#ifdef ETM_STATS
+/* Histogram bucket n counts latencies below ETM_HIST_BASE << n ms, the last bucket the rest */
+#define ETM_HIST_BUCKETS 8
+#define ETM_HIST_BASE    16UL
+#endif
+/* publish() return when the message was stored for later */
+#define ETM_PUB_STORED -3
+/* opresult() while the operation is still in progress */
+#define ETM_OP_PENDING -4
 
 #define ESEYETELEMETRYMODULELIB_VERSION "0.8"
 
+/* Default sizes - an application can choose its own with eseyeETMSized<> */
+#ifndef MAX_SUB_TOPICS
 #define MAX_SUB_TOPICS 8
+#endif
+#ifndef MAX_PUB_TOPICS
 #define MAX_PUB_TOPICS 8		
+#endif
+#ifndef MODEM_RX_BUFSIZE
+#define MODEM_RX_BUFSIZE 100
+#endif
+
+/* Per-instance features selected with the FEATURES template parameter */
+#define ETM_FEAT_TIMEOUTS  (0x01 << 0) /* Time out pub/sub requests (needs TIMEOUT_RESPONSES) */
+#define ETM_FEAT_DEBUG     (0x01 << 1) /* Trace to the debug uart (needs DEBUG_ESEYETELEMETRYMODULE) */
+#define ETM_FEAT_PUBQUEUE  (0x01 << 2) /* Queue publishes (needs PUB_QUEUE) - without it only one publish is tracked at a time */
+#define ETM_FEATURES_DEFAULT (ETM_FEAT_TIMEOUTS | ETM_FEAT_DEBUG | ETM_FEAT_PUBQUEUE)
+/* Size of the ascii-hex staging block used by publish() - each uart write carries HEX_STAGE_LEN / 2 payload bytes */
+#ifndef HEX_STAGE_LEN
+#define HEX_STAGE_LEN 64
+#endif
+/* Number of application URC prefixes that can be registered with urcreg() */
+#ifndef MAX_USER_URCS
+#define MAX_USER_URCS 4
+#endif
+
+/* Number of topic handlers that can be registered with topicreg() */
+#ifndef MAX_TOPIC_HANDLERS
+#define MAX_TOPIC_HANDLERS 8
+#endif
+/* Number of asynchronous requests that can be outstanding - see subscribeasync() */
+#ifndef MAX_PENDING_OPS
+#define MAX_PENDING_OPS 8
+#endif
+#if MAX_TOPIC_HANDLERS <= 8
+typedef uint8_t thandlermask;
+#elif MAX_TOPIC_HANDLERS <= 16
+typedef uint16_t thandlermask;
+#else
+#error MAX_TOPIC_HANDLERS must be 16 or less
+#endif
 
 /* Prototype for the AT command response callback function */
 typedef void (*_atcb)(char *data);
 /* Prototype for the message callback function */	
 typedef void (*_msgcb)(uint8_t *data, uint8_t length);
+/* Prototype for the streamed message callback - called for each chunk of a message */
+typedef void (*_chunkcb)(uint8_t *data, uint16_t length, uint16_t offset, uint16_t total);
+/* Prototype for a topic handler - idx is the subscription the message arrived on */
+typedef void (*_topiccb)(void *ctx, int idx, uint8_t *data, uint16_t length);
+/* Prototype for an asynchronous request completion callback - result as for opresult() */
+typedef void (*_opcb)(void *ctx, int op, int result);
+/* Prototype for the batch completion callback */
+typedef void (*_batchcb)(uint8_t sent, uint8_t failed);
+/* What to do with a publish when the store is full */
+typedef enum {STORE_DROP_NEWEST = 0, STORE_OVERWRITE_OLDEST} tstorePolicy;
 /* Publish topic state */
 typedef enum {PUB_TOPIC_ERROR = -1, PUB_TOPIC_NOT_IN_USE = 0, PUB_TOPIC_REGISTERING, PUB_TOPIC_REGISTERED, PUB_TOPIC_UNREGISTERING} tpubTopicState;
 /* Subscribe topic state */
 typedef enum {SUB_TOPIC_ERROR = -1, SUB_TOPIC_NOT_IN_USE = 0, SUB_TOPIC_SUBSCRIBING, SUB_TOPIC_SUBSCRIBED, SUB_TOPIC_UNSUBSCRIBING} tsubTopicState;
+/* Queued publish message state */
+typedef enum {PUB_MSG_UNKNOWN = -1, PUB_MSG_FREE = 0, PUB_MSG_QUEUED, PUB_MSG_SENDING, PUB_MSG_WAITSEND, PUB_MSG_SENT, PUB_MSG_FAILED} tpubMsgState;
+/* Application low power wait used by sleep() - return within ms or on any interrupt */
+typedef void (*_idlecb)(unsigned long ms);
+/* No sleep/wake pin connected */
+#define ETM_NO_PIN 0xff
+/* nextdeadline() when nothing is scheduled */
+#define ETM_NO_DEADLINE 0xffffffffUL
 /* Reason for waking up/not sleeping (unable to sleep currently, timer, message from click board or external interrupt) */
 typedef enum {TRY_AGAIN_SHORTLY, WAKE_TIMER, WAKE_CLICK, WAKE_INT} twakeReason;
 /* Current state of connectivity */
 typedef enum {ETM_UNKNOWN = -1, ETM_IDLE = 0, ETM_WAITKEYS, ETM_NETWORKSTART, ETM_SSLSTART, ETM_SSLCONN, ETM_MQTTSTART, ETM_MQTTREADY, ETM_MQTTSUB, ETM_UDPACTIVE, ETM_ERROR} tetmState;
 /* Current state callback */
 typedef void (*_statecb)(void);
+/* Prototype for the received datagram callback */
+typedef void (*_udpcb)(void *ctx, uint8_t *data, uint16_t length);
 /* Request state type */
 typedef enum {ETM_STATE_ONCE = 0, ETM_STATE_ON, ETM_STATE_OFF} tetmRequestState;
 typedef enum {ETM_MQTT, ETM_UDP} tetmProto;
+/* Payload encoding on the uart */
+typedef enum {ETM_ENC_HEX = 0, ETM_ENC_BINARY} tetmEncoding;
+/* Commands answered by OK/ERROR */
+typedef enum {ETM_CMD_NONE = 0, ETM_CMD_SUBSCRIBE, ETM_CMD_UNSUBSCRIBE, ETM_CMD_PUBREG, ETM_CMD_PUBUNREG, ETM_CMD_PUBLISH, ETM_CMD_STATE, ETM_CMD_STARTPROTO, ETM_CMD_AT, ETM_CMD_ECHO, ETM_CMD_UDPSEND} tetmCmd;
+/* Command completion callback - idx is the topic index or protocol where relevant */
+typedef void (*_cmdcb)(tetmCmd cmd, int idx, boolean ok);
 
 /* Subscribed topic array element */	
 struct subtpc{
   _msgcb messagecb;
-  tsubTopicState substate;
+  _chunkcb chunkcb;
+  int8_t substate;          /* tsubTopicState */
+  /* Subscribed topic - the string must remain valid while subscribed */
+  const char *topic;
+  uint16_t topichash;
+  /* Handlers matching this topic, resolved when subscribing/registering */
+  thandlermask handlers;
+#ifdef ETM_STATS
+  unsigned long senttime;
+#endif
+};
+
+/* Publish queue element */
+struct pubmsg{
+  int8_t msgstate;          /* tpubMsgState */
+  uint8_t handle;
+  uint8_t tpcidx;
+  uint8_t qos;
+  boolean inbatch;
+  uint16_t datalen;
+#ifdef ETM_STATS
+  unsigned long senttime;
+#endif
+#ifdef PUB_RETRY
+  boolean retain;           /* data holds a copy to resend */
+  boolean goback;           /* Send again once answered - an earlier message on the topic failed */
+  uint8_t fails;            /* :SEND FAILs so far */
+  uint16_t backoff;         /* ms after failtime before the next try */
+  unsigned long failtime;
+#endif
+};
+
+#ifdef FILTER_OK
+/* Outstanding command FIFO element */
+struct atcmd{
+  uint8_t cmdtype;
+  uint8_t idx;
+  unsigned long senttime;
+};
+#endif
+
+/* Application URC array element */
+struct userurc{
+  const char *prefix;
+  uint8_t len;
+  _atcb callback;
+};
+
+#ifdef ETM_STATS
+/* Latency histogram in ms */
+struct etmhist{
+  uint16_t bucket[ETM_HIST_BUCKETS];
+  uint16_t count;
+  uint32_t total;
+  uint32_t max;
+};
+
+/* Library statistics - see stats() */
+struct etmstats{
+  uint32_t rxbytes;
+  uint32_t txbytes;
+  uint32_t lines;           /* Complete lines parsed by poll() */
+  uint16_t forwarded;       /* Lines passed to the urc callback */
+  uint16_t discarded;       /* Lines nobody wanted */
+  uint16_t overflows;       /* Lines longer than the receive buffer */
+  uint16_t timeouts;        /* Topic requests, publishes and commands timed out */
+  uint16_t sendok;
+  uint16_t sendfail;
+#ifdef PUB_RETRY
+  uint16_t pubretries;      /* Publishes queued to be sent again after :SEND FAIL */
+#endif
+#ifdef UDP_TRANSFER
+  uint16_t udpsent;         /* Datagrams handed to the modem */
+  uint16_t udprecv;
+#endif
+  struct etmhist pubreg;    /* pubreg() to +EMQPUBOPEN */
+  struct etmhist subscribe; /* subscribe() to +EMQSUBOPEN */
+  struct etmhist publish;   /* publish() to :SEND OK (OK without PUB_QUEUE) */
+#ifdef SESSION_RECOVERY
+  uint16_t recoveries;
+  struct etmhist recovery;  /* Session lost to every topic re-opened */
+#endif
+};
+#endif
+
+/* Pending response deadline - kept in a min-heap ordered by due time */
+struct etmdeadline{
+  unsigned long due;
+  uint8_t kind;
+  uint8_t idx;
+};
+
+/* Asynchronous request array element */
+struct etmop{
+  int8_t opstate;
+  uint8_t kind;             /* tetmCmd */
+  uint8_t idx;              /* Topic index or message handle */
+  uint8_t seq;
+  int16_t result;
+  _opcb callback;
+  void *ctx;
+};
+
+/* Topic handler array element */
+struct topichandler{
+  const char *filter;
+  _topiccb callback;
+  void *ctx;
 };
 
 /* Publish topic array element */
 struct pubtpc{
-  tpubTopicState pubstate;
-#ifdef TIMEOUT_RESPONSES
-  /* Include a senttime for each pub to enable timeout */
+  int8_t pubstate;          /* tpubTopicState */
+#ifdef SESSION_RECOVERY
+  /* Registered topic - the string must remain valid while registered */
+  const char *topic;
+#endif
+#ifdef STORE_FORWARD
+  uint16_t topichash;       /* Identifies the topic's stored publishes */
+#endif
+#ifdef ETM_STATS
   unsigned long senttime;
 #endif
+#ifdef PUB_FILTER
+  /* Last reading sent and when */
+  int32_t lastvalue;
+  unsigned long lastsent;
+  /* Filter settings - 0 disables each part */
+  uint32_t deadband;
+  uint32_t mininterval;
+  uint32_t maxsilence;
+  uint16_t relband;         /* 1/1000ths of the last value sent */
+  uint16_t suppressed;
+  boolean filtered;
+  boolean hassent;
+#endif
 };
 				
-class eseyeETM
+/* The library implementation. Topic tables and buffers are supplied by
+ * eseyeETMSized so the code is shared between differently sized instances. */
+class eseyeETMBase
 {
 public:
-	eseyeETM(Stream *uart);
     
     void init(_atcb urccallback = NULL, Stream *trcuart = NULL);
     int startproto(tetmProto proto = ETM_MQTT);
     /* Subscribe topic API */
     int subscribe(char *topic, _msgcb callback);
+    int subscribestream(char *topic, _chunkcb callback);
     tsubTopicState substate(int idx);
     int unsubscribe(int idx);
 #ifdef FILTER_OK
     int subscribeconfirm(char *topic, _msgcb callback);
 #endif
+    /* Find the subscription index for a topic, or -1 */
+    int subindex(const char *topic);
+    /* The topic subscribed on an index, or NULL */
+    const char *subtopic(int idx);
+    /* Call callback with ctx for messages on subscriptions matching filter.
+     * filter may use the MQTT '+' and '#' wildcards and must remain valid
+     * while registered. Returns a handler id or -1 */
+    int topicreg(const char *filter, _topiccb callback, void *ctx = NULL);
+    int topicunreg(int handler);
     
     /* Publish topic API */
     int pubreg(char *topic);
@@ -112,23 +446,124 @@ public:
 #endif
     
     /* Publish API */
-    /* Non-atomic publish */
+    /* Non-atomic publish - returns a message handle or -1 */
     int publish(int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen);
+    /* Publish an encoded message - -1 if it overflowed its buffer */
+    int publish(int tpcidx, uint8_t qos, eseyeCBOR *msg);
+    /* Finish and publish a compressed message - -1 if it overflowed its buffer */
+    int publish(int tpcidx, uint8_t qos, eseyeLZBase *msg);
+#ifdef PUB_FILTER
+    /* Filter readings published with publishvalue() - a reading is dropped if it is within
+     * deadband, or relband 1/1000ths, of the last one sent, or within mininterval ms of the
+     * last send. One is always sent after maxsilence ms. */
+    int pubfilter(int tpcidx, uint32_t deadband, uint16_t relband = 0, uint32_t mininterval = 0, uint32_t maxsilence = 0);
+    /* Publish a reading (in whatever fixed-point units the application uses) through the
+     * topic's filter. data is the payload, or NULL to send value as decimal text.
+     * Returns a message handle, -1 or ETM_PUB_SUPPRESSED */
+    int publishvalue(int tpcidx, uint8_t qos, int32_t value, uint8_t *data = NULL, uint16_t datalen = 0);
+    /* Number of readings dropped by the filter since the topic was registered */
+    uint16_t pubsuppressed(int tpcidx);
+#endif
+#ifdef STORE_FORWARD
+    /* Store publishes to registered topics while MQTT is down or the topic is being
+     * registered (again), and send them from poll() no more often than every drainms
+     * once it is back. Stored publishes are matched to their topic by name, so they
+     * go out on the right topic after a reset. Returns false if the store's records
+     * are larger than STORE_RECSIZE_MAX */
+    boolean storeforward(eseyeStore *store, tstorePolicy policy = STORE_DROP_NEWEST, uint16_t drainms = 0);
+    /* Publishes waiting in the store and publishes lost because it was full */
+    uint16_t storedcount(void);
+    uint16_t storedropped(void);
+#endif
+    /* Check all publishes are complete */
     boolean pubdone(void);
+#ifdef BINARY_TRANSFER
+    /* Send publish payloads as ascii-hex (default) or raw binary. While a binary
+     * payload waits for its prompt, publishes from callbacks are queued (or refused
+     * without PUB_QUEUE) and every other request from a callback returns -1 */
+    void txencoding(tetmEncoding enc);
+#endif
+#ifdef UDP_TRANSFER
+    /* Send a datagram once UDP is ready (ETM_UDP_RDY), encoded as set by txencoding().
+     * Never waits for the modem to answer - returns 0, or -1 if UDP isn't ready or the
+     * command FIFO is full. A binary send still waits for the data prompt */
+    int sendDatagram(uint8_t *data, uint16_t datalen);
+    int sendDatagram(eseyeCBOR *msg);
+    /* Call callback(ctx, data, length) from poll() for each datagram received.
+     * Datagrams longer than the receive buffer are dropped */
+    void datagramcb(_udpcb callback, void *ctx = NULL);
+#endif
+#ifdef PUB_QUEUE
+    /* Check the progress of a publish by handle */
+    tpubMsgState pubmsgstate(int handle);
+    /* Most publishes sent and not yet answered by :SEND OK/FAIL - 1 to the queue length */
+    void pubwindow(uint8_t window);
+#endif
+#ifdef PUB_RETRY
+    /* Send a QoS 1 publish up to retries more times after :SEND FAIL. The first resend
+     * waits backoff ms and each one after that waits twice as long, up to maxbackoff.
+     * The publish stays PUB_MSG_QUEUED in between. 0 retries turns this off. */
+    void pubretry(uint8_t retries, uint16_t backoff = PUB_RETRY_BACKOFF, uint16_t maxbackoff = PUB_RETRY_MAXBACKOFF);
+#endif
+#ifdef PUB_QUEUE
+    /* Batch publish - publishes added between batchbegin() and batchend() are
+     * pipelined without waiting for each other and complete together */
+    void batchbegin(void);
+    /* Returns a message handle or -1, waits only if the publish queue is full */
+    int batchadd(int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen);
+    /* Close the batch - callback is called once every publish in it has completed */
+    void batchend(_batchcb callback = NULL);
+    /* PUB_MSG_SENDING until the closed batch completes, then PUB_MSG_SENT or PUB_MSG_FAILED */
+    tpubMsgState batchstate(void);
+    /* Close the batch and wait for it - returns the number sent or -1 if any failed */
+    int batchconfirm(void);
+#endif
 #ifdef FILTER_OK
     /* Atomic publish */
     int publishconfirm(int tpcidx, uint8_t qos, uint8_t *data, uint8_t datalen);
 #endif
+
+    /* Asynchronous requests - each returns an operation handle straight away, or -1 if
+     * the request couldn't be made. done(ctx, op, result) is called from poll() once the
+     * request completes and the operation is then freed. Without a callback check it
+     * with opready() and free it by reading opresult(). */
+    /* Completes on +EMQSUBOPEN with the subscription index */
+    int subscribeasync(char *topic, _msgcb callback, _opcb done = NULL, void *ctx = NULL);
+    /* Completes on +EMQPUBOPEN with the publish topic index */
+    int pubregasync(char *topic, _opcb done = NULL, void *ctx = NULL);
+#ifdef PUB_QUEUE
+    /* Completes on :SEND OK with the message handle (or ETM_PUB_STORED) */
+    int publishasync(int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen, _opcb done = NULL, void *ctx = NULL);
+#endif
+    boolean opready(int op);
+    /* The request's result, -1 if it failed or ETM_OP_PENDING */
+    int opresult(int op);
+    /* Wait for an operation without a callback and return its result */
+    int opwait(int op);
     
     /* Polling loop */
     void poll(void);
 
-    /* Send AT command */
-    void sendAT(char *atcmd);
+    /* Send AT command - a single command answered by OK, ERROR, +CME ERROR or +CMS ERROR.
+     * Returns 0, or -1 if a binary payload is waiting for its prompt */
+    int sendAT(char *atcmd);
+    /* Route lines starting with prefix to callback instead of urccallback */
+    int urcreg(const char *prefix, _atcb callback);
+    int urcunreg(int idx);
     
 #ifdef FILTER_OK
     bool inSync(void);
     void waitSync(void);
+    /* Register for command completion callback */
+    void cmdcb(_cmdcb cmdcallback = NULL);
+#endif
+#ifdef TIMEOUT_RESPONSES
+    /* Time allowed in ms before a request is failed, 0 to wait forever.
+     * ETM_CMD_SUBSCRIBE/UNSUBSCRIBE: +EMQSUBOPEN/+EMQSUBCLOSE (SUB_TOPIC_ERROR)
+     * ETM_CMD_PUBREG/PUBUNREG: +EMQPUBOPEN/+EMQPUBCLOSE (PUB_TOPIC_ERROR)
+     * ETM_CMD_PUBLISH: :SEND OK after the publish was accepted (PUB_MSG_FAILED)
+     * Anything else: OK/ERROR to any command */
+    void settimeout(tetmCmd op, unsigned long ms);
 #endif
     
 #define MODEM_SEEN    (0x01 << 0)
@@ -139,40 +574,243 @@ public:
     
     unsigned int urcseen;
     
-    /* Request the current anynet-secure connectivity state */
-    void updateState(tetmRequestState streq);
+    /* Request the current anynet-secure connectivity state - 0, or -1 as for sendAT() */
+    int updateState(tetmRequestState streq);
     /* Updated when required with the current anynet-secure state */
     tetmState currentstate;
     /* Register for state change callback */
     void statecb(_statecb statecb = NULL);
+
+#ifdef SESSION_RECOVERY
+    /* After APP RDY, +ETM:IDLE or +ETMSTATE dropping out of ready, restart the protocol
+     * last started with startproto() and re-open every subscription and publish topic on
+     * the index it had. Requests made before the restart complete once it is done */
+    void autorecover(boolean enable = true);
+    boolean recovering(void);
+    /* ms from the session being lost to every topic being re-opened, for the last recovery */
+    unsigned long recoverytime(void);
+#endif
+
+#ifdef ETM_STATS
+    /* Copy the statistics to snapshot (if not NULL) and optionally start them again */
+    void stats(struct etmstats *snapshot, boolean reset = false);
+#endif
+
+    /* Sleep API */
+    /* clkslppin is driven to clkslppol while sleeping to let the modem sleep, and the
+     * modem drives hstwkpin to hstwkpol to wake the host. ETM_NO_PIN if not connected */
+    void sleeppins(uint8_t clkslppin, uint8_t clkslppol, uint8_t hstwkpin = ETM_NO_PIN, uint8_t hstwkpol = HIGH);
+    /* Nothing is outstanding with the modem or half received */
+    boolean quiescent(void);
+    /* ms until poll() has scheduled work to do, or ETM_NO_DEADLINE */
+    unsigned long nextdeadline(void);
+    /* Sleep for up to ms (less if work is scheduled sooner), calling idle to wait in a
+     * low power mode. Returns TRY_AGAIN_SHORTLY without sleeping if the library is busy */
+    twakeReason sleep(unsigned long ms, _idlecb idle = NULL);
+    /* End a sleep() with WAKE_INT - safe to call from an interrupt handler */
+    void wake(void);
+protected:
+    eseyeETMBase(Stream *uart, struct subtpc *subs, uint8_t numsubs, struct pubtpc *pubs, uint8_t numpubs,
+                 uint8_t *rxbuf, uint16_t rxbuflen, struct pubmsg *pubq, uint8_t pubqlen, uint8_t *pubqdata,
+                 uint8_t *pubsent, struct etmdeadline *deadlines, uint8_t features);
 private:
     /* Callback function for unhandled URCs */
     _atcb atcallback;
     _statecb statecallback;
   
-    struct subtpc subtopics[MAX_SUB_TOPICS];
-    struct pubtpc pubtopics[MAX_PUB_TOPICS];
+    struct subtpc *subtopics;
+    struct pubtpc *pubtopics;
+    uint8_t maxsubs;
+    uint8_t maxpubs;
+    uint8_t features;
+    struct userurc userurcs[MAX_USER_URCS];
+    struct topichandler topichandlers[MAX_TOPIC_HANDLERS];
+    thandlermask topicmatches(const char *topic);
+    /* Asynchronous requests */
+    struct etmop ops[MAX_PENDING_OPS];
+    uint8_t opseq;
+    boolean opsdone;
+    int opclaim(void);
+    int opstart(int slot, tetmCmd kind, int idx, _opcb done, void *ctx);
+    struct etmop *opfind(int op);
+    void opdone(tetmCmd kind, int idx, int result);
+    void opcallbacks(void);
 
     Stream *atuart;
     Stream *dbguart;
 
-    #define MODEM_RX_BUFSIZE 100
-    uint8_t modemrxbuf[MODEM_RX_BUFSIZE];
-    unsigned char rxbufidx;
-    unsigned char binaryread;
-    unsigned char buffered;
+    uint8_t *modemrxbuf;
+    uint16_t rxbufsize;
+    uint16_t rxbufidx;
+    boolean rxoverflow;
+    /* Subscribed message being received */
+    uint16_t binaryread;
+    uint16_t buffered;
+    uint16_t msgtotal;
+    uint16_t msgoffset;
     uint8_t readingsub;
+    void processline(void);
+    void delivermsg(void);
+    int subscribetopic(char *topic, _msgcb callback, _chunkcb chunkcallback);
+    /* A binary payload waits for its prompt - nothing else can be written */
+    boolean txbusy(void);
+    /* Send the SUBOPEN/PUBOPEN for a topic index */
+    void subopen(uint8_t idx, const char *topic);
+    void pubopen(uint8_t idx, const char *topic);
 #ifdef FILTER_OK
-    uint8_t outstanding_ok;
-    void incOKreq(void);
+    /* Commands awaiting OK/ERROR in the order they were sent */
+    struct atcmd cmdfifo[CMD_FIFO_LEN];
+    uint8_t cmdhead;
+    uint8_t cmdcount;
+    /* Timed out commands (ETM_CMD_NONE) kept in the FIFO to take their late answer */
+    uint8_t cmdlate;
+    _cmdcb cmdcallback;
+    void incOKreq(tetmCmd cmdtype, uint8_t idx);
+    tetmCmd cmddone(boolean ok);
+    void cmdresult(tetmCmd cmdtype, uint8_t idx, boolean ok);
+    void cmdflush(void);
+#endif
+#ifdef PUB_QUEUE
+    struct pubmsg *pubqueue;
+    uint8_t pubqlen;
+    /* PUB_QUEUE_MSGLEN bytes of payload per pubqueue entry, NULL without ETM_FEAT_PUBQUEUE */
+    uint8_t *pubqdata;
+    uint8_t *pubmsgdata(struct pubmsg *msg);
+    /* Oldest entry and number of entries in the pubqueue ring */
+    uint8_t pubqhead;
+    uint8_t pubqcount;
+    uint8_t pubseq;
+    struct pubmsg *pubmsgalloc(void);
+    /* The oldest queued message that can be sent now */
+    struct pubmsg *pubmsgnext(void);
+    uint8_t pubinflight(void);
+    uint8_t pubwin;
+    void pubmsgsend(struct pubmsg *msg, uint8_t *data);
+    void pubqueuesend(void);
+    /* pubqueue entries in the order they were written to the modem, which is the
+     * order of their OKs and :SEND OK/FAILs, or a PUBSENT_ mark holding the place
+     * of one that timed out. Twice pubqlen long */
+    uint8_t *pubsent;
+    uint8_t pubsenthead;
+    uint8_t pubsentcount;
+    void pubsentadd(struct pubmsg *msg);
+    /* Position of the oldest entry for a message in msgstate, or holding mark */
+    int pubsentfind(int8_t msgstate, uint8_t mark);
+    int pubsentpos(struct pubmsg *msg);
+    void pubsentdel(uint8_t pos);
+    void pubcmddone(boolean ok);
+#ifdef TIMEOUT_RESPONSES
+    void pubcmdtimeout(void);
+#endif
+    void pubsenddone(boolean ok);
+    void pubmsgdone(struct pubmsg *msg, boolean ok);
+#ifdef PUB_RETRY
+    uint8_t retries;
+    uint16_t retrybackoff;
+    uint16_t retrymaxbackoff;
+    boolean pubmsgretry(struct pubmsg *msg, boolean ok);
+    boolean pubmsgheld(uint8_t pos);
+    /* Something before pos in the queue on the topic is still to be sent again */
+    boolean pubtopicheld(uint8_t tpcidx, uint8_t pos);
+#endif
+    /* Current batch */
+    boolean batching;
+    boolean batchclosed;
+    uint8_t batchpending;
+    uint8_t batchsent;
+    uint8_t batchfailed;
+    _batchcb batchcallback;
+#endif
+#ifdef STORE_FORWARD
+    eseyeStore *store;
+    tstorePolicy storepolicy;
+    uint16_t storehead;
+    uint16_t storecount;
+    /* Records sent out of order, still taking a place in the ring */
+    uint16_t storesent;
+    /* Every stored publish waits for its topic - no need to look again until one registers */
+    boolean storeheld;
+    uint16_t storedrops;
+    uint16_t drainms;
+    unsigned long lastdrain;
+    /* MQTT has reported ready and the modem hasn't restarted since */
+    boolean mqttup;
+    int storeput(int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen);
+    void storedrain(void);
+    boolean storefind(uint16_t topichash);
+    int storetopic(uint16_t topichash);
+    void storeremove(uint16_t pos, uint8_t *rec);
+    void storeskip(void);
+    void storecompact(void);
+#endif
+#ifdef SESSION_RECOVERY
+    boolean recoverenable;
+    /* The protocol has reported ready since it was last lost */
+    boolean sessionup;
+    uint8_t sessionproto;     /* tetmProto */
+    uint8_t recoverstate;
+    /* Next topic to re-open - subscriptions then publish topics */
+    uint16_t recovernext;
+    unsigned long recoverstart;
+    unsigned long recoverms;
+    void sessionready(void);
+    void sessionlost(boolean idle);
+    void recoverstep(void);
+#endif
+    void writepublish(int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen);
+    /* Write a payload as ascii-hex with the closing quote and CRLF */
+    void writehex(uint8_t *data, uint16_t datalen);
+#ifdef UDP_TRANSFER
+    _udpcb udpcallback;
+    void *udpctx;
+#endif
+#ifdef BINARY_TRANSFER
+    /* Payload waiting for the data prompt */
+    uint8_t *txbuf;
+    uint16_t txbuflen;
+    boolean skipspace;
+    tetmEncoding encoding;
+    void writebinary(uint8_t *data, uint16_t datalen);
+#endif
+
+    /* Write a PROGMEM string to the modem */
+    void writeP(const char *pstr);
+    /* All uart output goes through these */
+    void atwrite(const uint8_t *buf, size_t len);
+    void atwrite(const char *str);
+    void atwrite(char c);
+    void atprint(long val);
+#ifdef ETM_STATS
+    struct etmstats etmstat;
+    void histadd(struct etmhist *hist, unsigned long start);
 #endif
 
     uint8_t clkslppin;
     uint8_t clkslppol;
     uint8_t hstwkpin;
     uint8_t hstwkpol;
+    volatile boolean wakeflag;
 
 #ifdef TIMEOUT_RESPONSES
+    /* One deadline at most per topic and publish queue entry */
+    struct etmdeadline *deadlines;
+    uint16_t dlcount;
+    unsigned long subtimeout;
+    unsigned long pubtimeout;
+    unsigned long publishtimeout;
+    unsigned long cmdtimeout;
+#ifdef PUB_QUEUE
+    /* Timed out publishes whose :SEND OK/FAIL may still come, and when the last timed out */
+    uint8_t publate;
+    unsigned long publatetime;
+#endif
+#ifdef FILTER_OK
+    unsigned long cmdnextdue(unsigned long now);
+#endif
+    void deadlineadd(uint8_t kind, uint8_t idx, unsigned long ms);
+    void deadlinedel(uint8_t kind, uint8_t idx);
+    void deadlinefix(uint16_t pos);
+    void deadlineexpired(uint8_t kind, uint8_t idx);
     boolean checkTimeout(void);
 #endif
 #ifdef DEBUG_ESEYETELEMETRYMODULE
@@ -180,5 +818,75 @@ private:
 #endif
 
 };
+
+/* An eseyeETM instance with its own topic table and receive buffer sizes.
+ * Small nodes can trim RAM, e.g. eseyeETMSized<1, 2, 64> myAWS(&Serial1);
+ * messages larger than RXBUF are still available with subscribestream(). */
+/* Storage for N items, taking no space when N is 0 (as an empty base class) */
+template <typename T, uint16_t N>
+class etmStorage
+{
+protected:
+    T *items(void) { return this->store; }
+private:
+    T store[N];
+};
+
+template <typename T>
+class etmStorage<T, 0>
+{
+protected:
+    T *items(void) { return NULL; }
+};
+
+/* Sizes below are worked out before the storage bases that use them */
+template <uint8_t SUBS, uint8_t PUBS, uint8_t FEATURES>
+struct etmSizes
+{
+#ifdef PUB_QUEUE
+    /* Without ETM_FEAT_PUBQUEUE a single entry tracks the publish in flight, and
+     * there is no payload to hold as it is written straight to the modem */
+    static constexpr uint8_t PUBQLEN = (FEATURES & ETM_FEAT_PUBQUEUE) ? PUB_QUEUE_LEN : 1;
+    static constexpr uint16_t PUBQDATA = (FEATURES & ETM_FEAT_PUBQUEUE) ? PUB_QUEUE_LEN * PUB_QUEUE_MSGLEN : 0;
+#else
+    static constexpr uint8_t PUBQLEN = 1;
+    static constexpr uint16_t PUBQDATA = 0;
+#endif
+#ifdef TIMEOUT_RESPONSES
+    static constexpr uint16_t DEADLINES = (FEATURES & ETM_FEAT_TIMEOUTS) ? SUBS + PUBS + PUBQLEN : 0;
+#else
+    static constexpr uint16_t DEADLINES = 0;
+#endif
+};
+
+template <uint8_t SUBS = MAX_SUB_TOPICS, uint8_t PUBS = MAX_PUB_TOPICS, uint16_t RXBUF = MODEM_RX_BUFSIZE, uint8_t FEATURES = ETM_FEATURES_DEFAULT>
+class eseyeETMSized : private etmStorage<uint8_t, etmSizes<SUBS, PUBS, FEATURES>::PUBQDATA>,
+                      private etmStorage<struct etmdeadline, etmSizes<SUBS, PUBS, FEATURES>::DEADLINES>,
+                      public eseyeETMBase
+{
+public:
+    eseyeETMSized(Stream *uart) : eseyeETMBase(uart, subs, SUBS, pubs, PUBS, rxbuf, RXBUF, pubq, PUBQLEN,
+                                               etmStorage<uint8_t, PUBQDATA>::items(), pubsent,
+                                               etmStorage<struct etmdeadline, DEADLINES>::items(), FEATURES) {}
+private:
+    static_assert(SUBS > 0 && SUBS < 0xff, "SUBS must be 1..254");
+    static_assert(PUBS > 0 && PUBS < 0xff, "PUBS must be 1..254");
+    static_assert(RXBUF >= 16 && RXBUF < 0xffff, "RXBUF must be 16..65534");
+    static constexpr uint8_t PUBQLEN = etmSizes<SUBS, PUBS, FEATURES>::PUBQLEN;
+    static constexpr uint16_t PUBQDATA = etmSizes<SUBS, PUBS, FEATURES>::PUBQDATA;
+    static constexpr uint16_t DEADLINES = etmSizes<SUBS, PUBS, FEATURES>::DEADLINES;
+    /* The send order ring is twice as long, below the marks it holds */
+    static_assert(PUBQLEN <= 126, "PUB_QUEUE_LEN must be 1..126");
+
+    struct subtpc subs[SUBS];
+    struct pubtpc pubs[PUBS];
+    uint8_t rxbuf[RXBUF + 1];
+    struct pubmsg pubq[PUBQLEN];
+    uint8_t pubsent[2 * PUBQLEN];
+};
+
+/* Default sized instance */
+typedef eseyeETMSized<> eseyeETM;
+
 #endif // ESEYETELEMETRYMODULE_H
 
@@ -0,0 +1,183 @@
+/***************************************************************************
+  eseyetelemetrymodule library - compact telemetry encoder
+
+  CBOR encoding into a fixed buffer, see etmcbor.h.
+
+ ***************************************************************************/
+
+#include <math.h>
+#include "etmcbor.h"
+
+eseyeCBOR::eseyeCBOR(uint8_t *buf, uint16_t buflen){
+    this->buf = buf;
+    this->buflen = buflen;
+    this->reset();
+}
+
+void eseyeCBOR::reset(void){
+    this->len = 0;
+    this->full = false;
+}
+
+/* Append raw bytes - all or nothing */
+boolean eseyeCBOR::put(const uint8_t *data, uint16_t datalen){
+    if(this->full || datalen > this->buflen - this->len){
+        this->full = true;
+        return false;
+    }
+    memcpy(&this->buf[this->len], data, datalen);
+    this->len += datalen;
+    return true;
+}
+
+/* Initial byte and argument in the shortest form */
+boolean eseyeCBOR::head(uint8_t major, uint32_t val){
+    uint8_t hdr[5];
+    uint8_t hdrlen;
+    major <<= 5;
+    if(val < 24){
+        hdr[0] = major | val;
+        hdrlen = 1;
+    }else if(val <= 0xff){
+        hdr[0] = major | 24;
+        hdr[1] = val;
+        hdrlen = 2;
+    }else if(val <= 0xffff){
+        hdr[0] = major | 25;
+        hdr[1] = val >> 8;
+        hdr[2] = val;
+        hdrlen = 3;
+    }else{
+        hdr[0] = major | 26;
+        hdr[1] = val >> 24;
+        hdr[2] = val >> 16;
+        hdr[3] = val >> 8;
+        hdr[4] = val;
+        hdrlen = 5;
+    }
+    return this->put(hdr, hdrlen);
+}
+
+boolean eseyeCBOR::map(uint16_t count){
+    return this->head(CBOR_MAP, count);
+}
+
+boolean eseyeCBOR::array(uint16_t count){
+    return this->head(CBOR_ARRAY, count);
+}
+
+/* Check a whole string item fits so a partial one is never left behind */
+static boolean stringfits(uint16_t used, uint16_t buflen, uint16_t strl){
+    uint32_t itemlen = (uint32_t)strl + (strl < 24 ? 1 : strl <= 0xff ? 2 : 3);
+    return used + itemlen <= buflen;
+}
+
+boolean eseyeCBOR::text(const char *str){
+    uint16_t strl = strlen(str);
+    if(stringfits(this->len, this->buflen, strl) == false)
+        this->full = true;
+    return this->head(CBOR_TEXT, strl) && this->put((const uint8_t *)str, strl);
+}
+
+boolean eseyeCBOR::bytes(const uint8_t *data, uint16_t datalen){
+    if(stringfits(this->len, this->buflen, datalen) == false)
+        this->full = true;
+    return this->head(CBOR_BYTES, datalen) && this->put(data, datalen);
+}
+
+boolean eseyeCBOR::uint(uint32_t val){
+    return this->head(CBOR_UINT, val);
+}
+
+boolean eseyeCBOR::sint(int32_t val){
+    if(val >= 0)
+        return this->head(CBOR_UINT, val);
+    /* -1 - val without overflowing INT32_MIN */
+    return this->head(CBOR_NEGINT, (uint32_t)(-(val + 1)));
+}
+
+boolean eseyeCBOR::real(float val){
+    uint16_t h;
+    if(tofloat16(val, &h)){
+        uint8_t enc[3] = {(CBOR_SIMPLE << 5) | 25, (uint8_t)(h >> 8), (uint8_t)h};
+        return this->put(enc, sizeof(enc));
+    }
+    return this->single(val);
+}
+
+boolean eseyeCBOR::half(float val){
+    uint16_t h = roundfloat16(val);
+    uint8_t enc[3] = {(CBOR_SIMPLE << 5) | 25, (uint8_t)(h >> 8), (uint8_t)h};
+    return this->put(enc, sizeof(enc));
+}
+
+boolean eseyeCBOR::single(float val){
+    uint32_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    uint8_t enc[5] = {(CBOR_SIMPLE << 5) | 26, (uint8_t)(bits >> 24), (uint8_t)(bits >> 16), (uint8_t)(bits >> 8), (uint8_t)bits};
+    return this->put(enc, sizeof(enc));
+}
+
+boolean eseyeCBOR::boolval(boolean val){
+    uint8_t enc = (CBOR_SIMPLE << 5) | (val ? 21 : 20);
+    return this->put(&enc, 1);
+}
+
+boolean eseyeCBOR::null(void){
+    uint8_t enc = (CBOR_SIMPLE << 5) | 22;
+    return this->put(&enc, 1);
+}
+
+/* IEEE 754 single to half, round to nearest even */
+uint16_t roundfloat16(float val){
+    uint32_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    int16_t exp = (bits >> 23) & 0xff;
+    uint32_t mant = bits & 0x7fffff;
+    uint32_t h, rem, halfway;
+    uint8_t shift;
+
+    if(exp == 0xff)
+        return sign | 0x7c00 | (mant != 0 ? 0x200 : 0);
+    exp -= 127;
+    if(exp > 15)
+        return sign | 0x7c00;
+    if(exp >= -14){
+        shift = 13;
+        h = ((uint32_t)(exp + 15) << 10) | (mant >> shift);
+    }else if(exp >= -25){
+        /* Subnormal half - the implicit bit becomes part of the mantissa */
+        mant |= 0x800000;
+        shift = -exp - 1;
+        h = mant >> shift;
+    }else{
+        return sign;
+    }
+    rem = mant & ((1UL << shift) - 1);
+    halfway = 1UL << (shift - 1);
+    /* A carry out of the mantissa correctly bumps the exponent (or reaches infinity) */
+    if(rem > halfway || (rem == halfway && (h & 1) != 0))
+        h++;
+    return sign | h;
+}
+
+float fromfloat16(uint16_t half){
+    uint8_t exp = (half >> 10) & 0x1f;
+    uint16_t mant = half & 0x3ff;
+    float val;
+    if(exp == 0)
+        val = ldexp(mant, -24);
+    else if(exp == 31)
+        val = mant == 0 ? INFINITY : NAN;
+    else
+        val = ldexp(mant + 1024, exp - 25);
+    return (half & 0x8000) ? -val : val;
+}
+
+boolean tofloat16(float val, uint16_t *half){
+    *half = roundfloat16(val);
+    if(val != val)
+        return true;
+    return fromfloat16(*half) == val;
+}
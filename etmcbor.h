@@ -0,0 +1,84 @@
+/***************************************************************************
+  eseyetelemetrymodule library - compact telemetry encoder
+
+  Encodes readings as CBOR (RFC 7049) into a caller supplied buffer, with
+  no heap use. Integers take the shortest CBOR form and floats are sent as
+  16-bit half floats when that loses nothing, so a typical reading is 1-5
+  bytes instead of 5-12 ascii characters. The result can be passed
+  straight to eseyeETM::publish().
+
+    uint8_t buf[32];
+    eseyeCBOR msg(buf, sizeof(buf));
+    msg.map(2);
+    msg.key("t"); msg.real(temp);
+    msg.key("h"); msg.real(hum);
+    myAWS.publish(pubidx, 1, &msg);
+
+  Writes that don't fit set overflow() and are dropped, so the calls can be
+  chained and checked once at the end.
+
+ ***************************************************************************/
+
+#ifndef ETMCBOR_H__
+#define ETMCBOR_H__
+
+#if defined(ARDUINO) && (ARDUINO >= 100)
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+/* CBOR major types */
+#define CBOR_UINT   0
+#define CBOR_NEGINT 1
+#define CBOR_BYTES  2
+#define CBOR_TEXT   3
+#define CBOR_ARRAY  4
+#define CBOR_MAP    5
+#define CBOR_TAG    6
+#define CBOR_SIMPLE 7
+
+class eseyeCBOR
+{
+public:
+    eseyeCBOR(uint8_t *buf, uint16_t buflen);
+    /* Start again at the beginning of the buffer */
+    void reset(void);
+
+    /* Containers - followed by count items (map: count key/value pairs) */
+    boolean map(uint16_t count);
+    boolean array(uint16_t count);
+
+    boolean key(const char *name) { return this->text(name); }
+    boolean text(const char *str);
+    boolean bytes(const uint8_t *data, uint16_t len);
+    boolean uint(uint32_t val);
+    boolean sint(int32_t val);
+    /* Half float if exact, otherwise single */
+    boolean real(float val);
+    /* Always a half float, rounded to 11 significant bits */
+    boolean half(float val);
+    boolean single(float val);
+    boolean boolval(boolean val);
+    boolean null(void);
+
+    uint8_t *data(void) { return this->buf; }
+    uint16_t length(void) { return this->len; }
+    boolean overflow(void) { return this->full; }
+
+private:
+    uint8_t *buf;
+    uint16_t buflen;
+    uint16_t len;
+    boolean full;
+
+    boolean head(uint8_t major, uint32_t val);
+    boolean put(const uint8_t *data, uint16_t datalen);
+};
+
+/* Half float conversion - tofloat16() returns false if the value isn't exact */
+boolean tofloat16(float val, uint16_t *half);
+uint16_t roundfloat16(float val);
+float fromfloat16(uint16_t half);
+
+#endif // ETMCBOR_H__
@@ -0,0 +1,236 @@
+/***************************************************************************
+  eseyetelemetrymodule library - payload compression
+
+  LZSS with a fixed window, see etmlz.h.
+
+ ***************************************************************************/
+
+#include "etmlz.h"
+
+eseyeLZBase::eseyeLZBase(uint8_t *buf, uint16_t buflen, uint8_t *window, uint8_t wbits){
+    this->buf = buf;
+    this->buflen = buflen;
+    this->window = window;
+    this->wbits = wbits;
+    this->mask = (1 << wbits) - 1;
+    this->reset();
+}
+
+void eseyeLZBase::reset(void){
+    this->len = 0;
+    this->rawlen = 0;
+    this->full = false;
+    this->head = 0;
+    this->ahead = 0;
+    this->hist = 0;
+    this->flagbit = 8;
+    this->put(LZ_MARK);
+    this->put(this->wbits);
+}
+
+void eseyeLZBase::put(uint8_t c){
+    if(this->len == this->buflen){
+        this->full = true;
+        return;
+    }
+    this->buf[this->len++] = c;
+}
+
+/* Flag the next item as a literal (1) or a match (0), starting a new flag byte every eight */
+void eseyeLZBase::item(boolean literal){
+    if(this->flagbit == 8){
+        this->flagpos = this->len;
+        this->flagbit = 0;
+        this->put(0);
+    }
+    if(literal && this->full == false)
+        this->buf[this->flagpos] |= 1 << this->flagbit;
+    this->flagbit++;
+}
+
+/* Emit the longest match for the bytes at head, or a literal */
+void eseyeLZBase::encode(void){
+    uint8_t best = 0;
+    uint16_t bestdist = 0;
+    uint8_t *w = this->window;
+    uint16_t mask = this->mask;
+
+    for(uint16_t dist = 1; dist <= this->hist; dist++){
+        uint16_t from = this->head - dist;
+        /* Only a match that beats the best so far is worth comparing */
+        if(w[(from + best) & mask] != w[(this->head + best) & mask])
+            continue;
+        uint8_t n = 0;
+        while(n < this->ahead && w[(from + n) & mask] == w[(this->head + n) & mask])
+            n++;
+        if(n > best){
+            best = n;
+            bestdist = dist;
+            if(n == this->ahead)
+                break;
+        }
+    }
+
+    if(best >= LZ_MINMATCH){
+        uint16_t token = ((bestdist - 1) << 4) | (best - LZ_MINMATCH);
+        this->item(false);
+        this->put(token >> 8);
+        this->put(token & 0xff);
+    }else{
+        best = 1;
+        this->item(true);
+        this->put(w[this->head]);
+    }
+    this->head = (this->head + best) & mask;
+    this->ahead -= best;
+    /* Keep the history clear of the bytes still to come */
+    this->hist += best;
+    if(this->hist > mask + 1 - LZ_MAXMATCH)
+        this->hist = mask + 1 - LZ_MAXMATCH;
+}
+
+size_t eseyeLZBase::write(uint8_t c){
+    if(this->full)
+        return 0;
+    this->window[(this->head + this->ahead) & this->mask] = c;
+    this->ahead++;
+    this->rawlen++;
+    if(this->ahead == LZ_MAXMATCH)
+        this->encode();
+    return 1;
+}
+
+boolean eseyeLZBase::finish(void){
+    while(this->ahead > 0 && this->full == false)
+        this->encode();
+    return this->full == false;
+}
+
+/* Decoder states */
+#define UNLZ_START  0
+#define UNLZ_WBITS  1
+#define UNLZ_FLAGS  2
+#define UNLZ_ITEM   3
+#define UNLZ_MATCH  4
+#define UNLZ_PLAIN  5
+#define UNLZ_BAD    6
+
+eseyeUnLZBase::eseyeUnLZBase(uint8_t *window, uint8_t wbits){
+    this->window = window;
+    this->wbits = wbits;
+    this->reset();
+}
+
+void eseyeUnLZBase::reset(void){
+    this->produced = 0;
+    this->state = UNLZ_START;
+}
+
+void eseyeUnLZBase::emit(uint8_t c, Print *out){
+    this->window[this->produced & ((1 << this->wbits) - 1)] = c;
+    this->produced++;
+    out->write(c);
+}
+
+boolean eseyeUnLZBase::feed(const uint8_t *data, uint16_t datalen, Print *out){
+    uint16_t mask = (1 << this->wbits) - 1;
+
+    for(uint16_t i = 0; i < datalen && this->state != UNLZ_BAD; i++){
+        uint8_t c = data[i];
+        switch(this->state){
+          case UNLZ_START:
+            if(c == LZ_MARK){
+                this->state = UNLZ_WBITS;
+            }else{
+                this->state = UNLZ_PLAIN;
+                this->emit(c, out);
+            }
+            break;
+          case UNLZ_WBITS:
+            this->state = (c >= LZ_MINBITS && c <= this->wbits) ? UNLZ_FLAGS : UNLZ_BAD;
+            break;
+          case UNLZ_FLAGS:
+            this->flags = c;
+            this->flagbits = 8;
+            this->state = UNLZ_ITEM;
+            break;
+          case UNLZ_ITEM:
+            if((this->flags & 1) == 0){
+                this->hi = c;
+                this->state = UNLZ_MATCH;
+                break;
+            }
+            this->emit(c, out);
+            this->flags >>= 1;
+            this->state = --this->flagbits == 0 ? UNLZ_FLAGS : UNLZ_ITEM;
+            break;
+          case UNLZ_MATCH: {
+            uint16_t token = (this->hi << 8) | c;
+            uint16_t dist = (token >> 4) + 1;
+            uint8_t n = (token & 0x0f) + LZ_MINMATCH;
+            if(dist > this->produced || dist > mask + 1){
+                this->state = UNLZ_BAD;
+                break;
+            }
+            while(n-- > 0)
+                this->emit(this->window[(this->produced - dist) & mask], out);
+            this->flags >>= 1;
+            this->state = --this->flagbits == 0 ? UNLZ_FLAGS : UNLZ_ITEM;
+            break;
+          }
+          case UNLZ_PLAIN:
+            this->emit(c, out);
+            break;
+        }
+    }
+    return this->state != UNLZ_BAD;
+}
+
+boolean lzpacked(const uint8_t *data, uint16_t datalen){
+    return datalen >= LZ_HDRLEN && data[0] == LZ_MARK;
+}
+
+int lzunpack(const uint8_t *data, uint16_t datalen, uint8_t *out, uint16_t outlen){
+    uint16_t len = 0;
+    uint16_t i;
+    uint8_t flags = 0;
+    uint8_t flagbits = 0;
+
+    if(lzpacked(data, datalen) == false){
+        if(datalen > outlen)
+            return -1;
+        memcpy(out, data, datalen);
+        return datalen;
+    }
+    if(data[1] < LZ_MINBITS || data[1] > LZ_MAXBITS)
+        return -1;
+    /* The output is the history, so any window size expands */
+    for(i = LZ_HDRLEN; i < datalen; ){
+        if(flagbits == 0){
+            flags = data[i++];
+            flagbits = 8;
+            continue;
+        }
+        if((flags & 1) != 0){
+            if(len == outlen)
+                return -1;
+            out[len++] = data[i++];
+        }else{
+            if(i + 1 >= datalen)
+                return -1;
+            uint16_t token = (data[i] << 8) | data[i + 1];
+            uint16_t dist = (token >> 4) + 1;
+            uint8_t n = (token & 0x0f) + LZ_MINMATCH;
+            i += 2;
+            if(dist > len || n > outlen - len)
+                return -1;
+            while(n-- > 0){
+                out[len] = out[len - dist];
+                len++;
+            }
+        }
+        flags >>= 1;
+        flagbits--;
+    }
+    return len;
+}
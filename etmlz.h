@@ -0,0 +1,143 @@
+/***************************************************************************
+  eseyetelemetrymodule library - payload compression
+
+  LZSS compression of publish payloads with a fixed window, for the larger
+  JSON status messages that repeat their key names. eseyeLZ<WBITS> is a
+  Print, so a payload can be printed (or written) into it a piece at a
+  time, and it compresses into a caller supplied buffer as it goes. Memory
+  use is fixed at compile time: the buffer plus a window of 1 << WBITS
+  bytes (8 to 12 bits, 256 to 4096 bytes).
+
+    uint8_t buf[128];
+    eseyeLZ<8> msg(buf, sizeof(buf));
+    msg.print("{\"uptime\":");
+    msg.print(millis());
+    ...
+    myAWS.publish(pubidx, 1, &msg);
+
+  A compressed payload starts with LZ_MARK and the window bits, which is
+  never the start of JSON text or a well formed CBOR item, so receivers
+  can tell compressed and plain payloads apart. Data that doesn't compress
+  grows by at most one byte in eight plus the header.
+
+  For inbound messages, lzunpack() expands a whole message into a buffer
+  and eseyeUnLZ<WBITS> expands one a chunk at a time (e.g. from a
+  subscribestream() callback) to a Print. Both pass plain payloads
+  through unchanged. eseyeUnLZ needs a window at least as large as the
+  sender's.
+
+ ***************************************************************************/
+
+#ifndef ETMLZ_H__
+#define ETMLZ_H__
+
+#if defined(ARDUINO) && (ARDUINO >= 100)
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+/* Compressed payload header - LZ_MARK then the window bits */
+#define LZ_MARK       0x1f
+#define LZ_HDRLEN     2
+#define LZ_MINBITS    8
+#define LZ_MAXBITS    12
+
+/* A match is 2 bytes: 12 bits of distance - 1, 4 bits of length - LZ_MINMATCH */
+#define LZ_MINMATCH   3
+#define LZ_MAXMATCH   18
+
+class eseyeLZBase : public Print
+{
+public:
+    /* Start a new payload */
+    void reset(void);
+    size_t write(uint8_t c);
+    using Print::write;
+    /* Compress what is still buffered - data() and length() are complete after this */
+    boolean finish(void);
+
+    uint8_t *data(void) { return this->buf; }
+    uint16_t length(void) { return this->len; }
+    /* Bytes written in */
+    uint16_t rawlength(void) { return this->rawlen; }
+    boolean overflow(void) { return this->full; }
+
+protected:
+    eseyeLZBase(uint8_t *buf, uint16_t buflen, uint8_t *window, uint8_t wbits);
+
+private:
+    uint8_t *buf;
+    uint16_t buflen;
+    uint16_t len;
+    uint16_t rawlen;
+    boolean full;
+    uint8_t *window;
+    uint8_t wbits;
+    uint16_t mask;
+    /* Ring position of the first byte not yet compressed, how many there
+     * are, and how many compressed bytes before it can be matched */
+    uint16_t head;
+    uint8_t ahead;
+    uint16_t hist;
+    /* Flag byte for the current group of eight items */
+    uint16_t flagpos;
+    uint8_t flagbit;
+
+    void encode(void);
+    void put(uint8_t c);
+    void item(boolean literal);
+};
+
+template <uint8_t WBITS = 8>
+class eseyeLZ : public eseyeLZBase
+{
+public:
+    eseyeLZ(uint8_t *buf, uint16_t buflen) : eseyeLZBase(buf, buflen, this->ring, WBITS) {}
+private:
+    static_assert(WBITS >= LZ_MINBITS && WBITS <= LZ_MAXBITS, "WBITS must be 8 to 12");
+    uint8_t ring[1 << WBITS];
+};
+
+class eseyeUnLZBase
+{
+public:
+    /* Start a new payload */
+    void reset(void);
+    /* Expand the next piece of a payload to out - false once the data is bad */
+    boolean feed(const uint8_t *data, uint16_t datalen, Print *out);
+    /* Bytes written out so far */
+    uint16_t length(void) { return this->produced; }
+
+protected:
+    eseyeUnLZBase(uint8_t *window, uint8_t wbits);
+
+private:
+    uint8_t *window;
+    uint8_t wbits;
+    uint16_t produced;
+    uint8_t state;
+    uint8_t flags;
+    uint8_t flagbits;
+    uint8_t hi;
+
+    void emit(uint8_t c, Print *out);
+};
+
+template <uint8_t WBITS = 8>
+class eseyeUnLZ : public eseyeUnLZBase
+{
+public:
+    eseyeUnLZ() : eseyeUnLZBase(this->ring, WBITS) {}
+private:
+    static_assert(WBITS >= LZ_MINBITS && WBITS <= LZ_MAXBITS, "WBITS must be 8 to 12");
+    uint8_t ring[1 << WBITS];
+};
+
+/* True if the payload is compressed */
+boolean lzpacked(const uint8_t *data, uint16_t datalen);
+/* Expand a whole payload into out (plain payloads are copied) - returns the
+ * length, or -1 if the data is bad or doesn't fit */
+int lzunpack(const uint8_t *data, uint16_t datalen, uint8_t *out, uint16_t outlen);
+
+#endif // ETMLZ_H__
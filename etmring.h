@@ -0,0 +1,136 @@
+/***************************************************************************
+  eseyetelemetrymodule library - interrupt fed receive ring
+
+  poll() only reads the uart when the sketch calls it, so a long sensor
+  read or display update can overrun the uart's own buffer and lose URCs.
+  eseyeRxRing is a Stream that sits between the uart and eseyeETM: bytes
+  are put into a lock-free single producer/single consumer ring from an
+  interrupt (or DMA half/full callback) and parsed later by poll().
+  Writes go straight through to the uart.
+
+    eseyeRxRing<512> modemrx(&modemtx);   // modemtx: the Stream commands go out on
+    eseyeETM myAWS(&modemrx);
+
+    // STM32 HAL: HAL_UARTEx_ReceiveToIdle_DMA(&huart1, dmabuf, sizeof(dmabuf))
+    // in circular mode calls this at half, full and line idle with the fill
+    // position, so a short URC isn't left sitting in dmabuf
+    uint8_t dmabuf[64];
+    uint16_t dmapos;
+    void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t pos){
+      modemrx.put(&dmabuf[dmapos], pos - dmapos);
+      dmapos = pos == sizeof(dmabuf) ? 0 : pos;
+    }
+
+  serialEvent1() is no substitute: it only runs between loop() calls,
+  which is when poll() could have read the uart anyway.
+
+  Only one context may put() and only one may read(). highwater() is the
+  most the ring has held and overruns() the bytes dropped because it was
+  full - size the ring from these.
+
+ ***************************************************************************/
+
+#ifndef ETMRING_H__
+#define ETMRING_H__
+
+#if defined(ARDUINO) && (ARDUINO >= 100)
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+/* Ring index - a single byte where it will do so AVR reads it atomically */
+template <bool SMALL> struct etmringindex { typedef uint16_t type; };
+template <> struct etmringindex<true> { typedef uint8_t type; };
+
+template <uint16_t SIZE>
+class eseyeRxRing : public Stream
+{
+public:
+    eseyeRxRing(Stream *uart) : uart(uart), head(0), tail(0), maxused(0), dropped(0) {}
+
+    /* Producer side - returns false (and counts an overrun) if the ring is full */
+    boolean put(uint8_t c){
+        index_t h = this->head;
+        index_t t = __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE);
+        index_t next = (h + 1) & (SIZE - 1);
+        if(next == t){
+            this->dropped++;
+            return false;
+        }
+        this->buf[h] = c;
+        __atomic_store_n(&this->head, next, __ATOMIC_RELEASE);
+        index_t used = (next - t) & (SIZE - 1);
+        if(used > this->maxused)
+            this->maxused = used;
+        return true;
+    }
+    /* Bytes that can be put without an overrun */
+    uint16_t space(void){
+        return (__atomic_load_n(&this->tail, __ATOMIC_ACQUIRE) - this->head - 1) & (SIZE - 1);
+    }
+    /* Returns the number of bytes taken */
+    uint16_t put(const uint8_t *data, uint16_t len){
+        uint16_t i;
+        for(i = 0; i < len; i++){
+            if(this->put(data[i]) == false)
+                break;
+        }
+        return i;
+    }
+    /* Move whatever the uart has into the ring */
+    void pump(void){
+        while(this->uart->available() > 0){
+            if(this->put((uint8_t)this->uart->read()) == false)
+                break;
+        }
+    }
+
+    /* Consumer side (Stream) */
+    int available(){
+        return (__atomic_load_n(&this->head, __ATOMIC_ACQUIRE) - this->tail) & (SIZE - 1);
+    }
+    int peek(){
+        if(this->available() == 0)
+            return -1;
+        return this->buf[this->tail];
+    }
+    int read(){
+        index_t t = this->tail;
+        if(t == __atomic_load_n(&this->head, __ATOMIC_ACQUIRE))
+            return -1;
+        uint8_t c = this->buf[t];
+        __atomic_store_n(&this->tail, (index_t)((t + 1) & (SIZE - 1)), __ATOMIC_RELEASE);
+        return c;
+    }
+
+    /* Output goes straight to the uart */
+    size_t write(uint8_t c){ return this->uart->write(c); }
+    size_t write(const uint8_t *buffer, size_t size){ return this->uart->write(buffer, size); }
+    using Print::write;
+    void flush(){ this->uart->flush(); }
+
+    /* The ring holds SIZE - 1 bytes */
+    uint16_t capacity(void){ return SIZE - 1; }
+    uint16_t highwater(void){ return this->maxused; }
+    uint16_t overruns(void){ return this->dropped; }
+    /* Call from the producer's context, or with it stopped */
+    void resetstats(void){ this->maxused = 0; this->dropped = 0; }
+
+private:
+    static_assert(SIZE >= 2 && (SIZE & (SIZE - 1)) == 0, "SIZE must be a power of two");
+#ifdef __AVR__
+    static_assert(SIZE <= 256, "SIZE must be 256 or less on AVR");
+#endif
+    typedef typename etmringindex<(SIZE <= 256)>::type index_t;
+
+    Stream *uart;
+    uint8_t buf[SIZE];
+    /* head is only written by the producer and tail by the consumer */
+    volatile index_t head;
+    volatile index_t tail;
+    volatile index_t maxused;
+    volatile uint16_t dropped;
+};
+
+#endif // ETMRING_H__
@@ -0,0 +1,58 @@
+/***************************************************************************
+  eseyetelemetrymodule library - store-and-forward backends
+
+  Non-volatile record store, see etmstore.h.
+
+ ***************************************************************************/
+
+#include "etmstore.h"
+
+#define PAGESTORE_HDRLEN 8
+#define PAGESTORE_MAGIC0 'E'
+#define PAGESTORE_MAGIC1 'S'
+
+eseyePageStore::eseyePageStore(_storeread rd, _storewrite wr, uint32_t base, uint16_t records, uint16_t recsize){
+    this->rd = rd;
+    this->wr = wr;
+    this->base = base;
+    this->records = records;
+    this->size = recsize;
+}
+
+boolean eseyePageStore::readrec(uint16_t slot, uint8_t *rec){
+    return this->rd(this->base + PAGESTORE_HDRLEN + (uint32_t)slot * this->size, rec, this->size);
+}
+
+boolean eseyePageStore::writerec(uint16_t slot, const uint8_t *rec){
+    return this->wr(this->base + PAGESTORE_HDRLEN + (uint32_t)slot * this->size, rec, this->size);
+}
+
+/* Header: magic, record size, head, count and a check byte */
+boolean eseyePageStore::load(uint16_t *head, uint16_t *count){
+    uint8_t hdr[PAGESTORE_HDRLEN];
+    if(this->rd(this->base, hdr, sizeof(hdr)) == false)
+        return false;
+    if(hdr[0] != PAGESTORE_MAGIC0 || hdr[1] != PAGESTORE_MAGIC1 || hdr[2] != (uint8_t)this->size)
+        return false;
+    if((uint8_t)(hdr[3] ^ hdr[4] ^ hdr[5] ^ hdr[6]) != hdr[7])
+        return false;
+    *head = hdr[3] | (hdr[4] << 8);
+    *count = hdr[5] | (hdr[6] << 8);
+    /* A different layout from an earlier sketch - start again */
+    if(*head >= this->records || *count > this->records)
+        return false;
+    return true;
+}
+
+void eseyePageStore::save(uint16_t head, uint16_t count){
+    uint8_t hdr[PAGESTORE_HDRLEN];
+    hdr[0] = PAGESTORE_MAGIC0;
+    hdr[1] = PAGESTORE_MAGIC1;
+    hdr[2] = (uint8_t)this->size;
+    hdr[3] = head;
+    hdr[4] = head >> 8;
+    hdr[5] = count;
+    hdr[6] = count >> 8;
+    hdr[7] = hdr[3] ^ hdr[4] ^ hdr[5] ^ hdr[6];
+    this->wr(this->base, hdr, sizeof(hdr));
+}
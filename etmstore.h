@@ -0,0 +1,85 @@
+/***************************************************************************
+  eseyetelemetrymodule library - store-and-forward backends
+
+  Publishes made while MQTT is down are kept in a ring of fixed-size
+  records and sent once it is back (see eseyeETM::storeforward()). The
+  ring itself is managed by the library, a backend only has to read and
+  write numbered records:
+
+    eseyeRamStore<16, 37>  - 16 records of up to 32 payload bytes in RAM
+    eseyePageStore         - records in EEPROM or a flash page through
+                             application read/write functions, with the
+                             ring position kept alongside so stored
+                             messages survive a reset
+
+  A host build can add its own, e.g. a file (extras/host/hoststore.h).
+
+ ***************************************************************************/
+
+#ifndef ETMSTORE_H__
+#define ETMSTORE_H__
+
+#if defined(ARDUINO) && (ARDUINO >= 100)
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+/* Each record starts with the qos, a hash of the publish topic name and the payload length */
+#define STORE_REC_HDRLEN 5
+
+class eseyeStore
+{
+public:
+    /* Number of records and bytes per record (including STORE_REC_HDRLEN) */
+    virtual uint16_t capacity(void) = 0;
+    virtual uint16_t recsize(void) = 0;
+    virtual boolean readrec(uint16_t slot, uint8_t *rec) = 0;
+    virtual boolean writerec(uint16_t slot, const uint8_t *rec) = 0;
+    /* Persistent backends keep the ring position - load returns false if there is none */
+    virtual boolean load(uint16_t *head, uint16_t *count) { return false; }
+    virtual void save(uint16_t head, uint16_t count) {}
+};
+
+/* Records in RAM - lost on reset */
+template <uint16_t RECORDS, uint16_t RECSIZE>
+class eseyeRamStore : public eseyeStore
+{
+public:
+    uint16_t capacity(void) { return RECORDS; }
+    uint16_t recsize(void) { return RECSIZE; }
+    boolean readrec(uint16_t slot, uint8_t *rec) { memcpy(rec, this->recs[slot], RECSIZE); return true; }
+    boolean writerec(uint16_t slot, const uint8_t *rec) { memcpy(this->recs[slot], rec, RECSIZE); return true; }
+private:
+    static_assert(RECORDS > 0, "RECORDS must be at least 1");
+    static_assert(RECSIZE > STORE_REC_HDRLEN, "RECSIZE must leave room for a payload");
+    uint8_t recs[RECORDS][RECSIZE];
+};
+
+/* Application supplied EEPROM/flash access - return false on failure */
+typedef boolean (*_storeread)(uint32_t addr, uint8_t *buf, uint16_t len);
+typedef boolean (*_storewrite)(uint32_t addr, const uint8_t *buf, uint16_t len);
+
+/* Records in non-volatile memory from base. An 8 byte header holding the ring
+ * position is followed by the records, so the area needs 8 + records * recsize
+ * bytes. The header is rewritten on every change - size the area with the
+ * part's write endurance in mind. */
+class eseyePageStore : public eseyeStore
+{
+public:
+    eseyePageStore(_storeread rd, _storewrite wr, uint32_t base, uint16_t records, uint16_t recsize);
+    uint16_t capacity(void) { return this->records; }
+    uint16_t recsize(void) { return this->size; }
+    boolean readrec(uint16_t slot, uint8_t *rec);
+    boolean writerec(uint16_t slot, const uint8_t *rec);
+    boolean load(uint16_t *head, uint16_t *count);
+    void save(uint16_t head, uint16_t count);
+private:
+    _storeread rd;
+    _storewrite wr;
+    uint32_t base;
+    uint16_t records;
+    uint16_t size;
+};
+
+#endif // ETMSTORE_H__
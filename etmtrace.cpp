@@ -0,0 +1,165 @@
+/***************************************************************************
+  eseyetelemetrymodule library - uart trace capture
+
+  Timestamped record of the modem uart, see etmtrace.h.
+
+ ***************************************************************************/
+
+#include "etmtrace.h"
+
+#define TRACE_NONE 0xffff
+
+eseyeTrace::eseyeTrace(Stream *uart, uint8_t *buf, uint16_t buflen){
+    this->uart = uart;
+    this->buf = buf;
+    this->size = buflen;
+    this->capturing = buflen >= 2 * TRACE_MAXREC;
+    this->clear();
+}
+
+void eseyeTrace::capture(boolean on){
+    this->capturing = on && this->size >= 2 * TRACE_MAXREC;
+    /* Start a new record when recording resumes */
+    this->cur = TRACE_NONE;
+}
+
+void eseyeTrace::clear(void){
+    this->head = 0;
+    this->tail = 0;
+    this->used = 0;
+    this->drops = 0;
+    this->cur = TRACE_NONE;
+    this->basetime = millis();
+    this->lasttime = this->basetime;
+}
+
+uint16_t eseyeTrace::length(void){
+    return this->used;
+}
+
+uint16_t eseyeTrace::dropped(void){
+    return this->drops;
+}
+
+/* Stream - everything passes straight through */
+
+int eseyeTrace::available(){
+    return this->uart->available();
+}
+
+int eseyeTrace::peek(){
+    return this->uart->peek();
+}
+
+int eseyeTrace::read(){
+    int c = this->uart->read();
+    if(c >= 0 && this->capturing){
+        uint8_t b = c;
+        this->record(0, &b, 1);
+    }
+    return c;
+}
+
+size_t eseyeTrace::write(uint8_t c){
+    size_t n = this->uart->write(c);
+    if(n > 0 && this->capturing)
+        this->record(TRACE_TX, &c, 1);
+    return n;
+}
+
+size_t eseyeTrace::write(const uint8_t *buffer, size_t size){
+    size_t n = this->uart->write(buffer, size);
+    if(n > 0 && this->capturing)
+        this->record(TRACE_TX, buffer, n);
+    return n;
+}
+
+void eseyeTrace::flush(){
+    this->uart->flush();
+}
+
+/* Ring */
+
+/* Remove the oldest record, moving the base time on by its delta */
+void eseyeTrace::droprecord(void){
+    uint8_t tag = this->buf[this->tail];
+    uint16_t pos = this->tail, len = 1;
+    unsigned long delta = 0;
+    uint8_t shift = 0, b;
+    do{
+        pos = (pos + 1) % this->size;
+        b = this->buf[pos];
+        delta |= (unsigned long)(b & 0x7f) << shift;
+        shift += 7;
+        len++;
+    }while(b & 0x80);
+    len += (tag & 0x7f) + 1;
+    this->basetime += delta;
+    this->tail = (this->tail + len) % this->size;
+    this->used -= len;
+    this->drops++;
+}
+
+void eseyeTrace::put(uint8_t b){
+    /* The ring holds at least two records so this is never the one being added to */
+    while(this->used == this->size)
+        this->droprecord();
+    this->buf[this->head] = b;
+    this->head = (this->head + 1) % this->size;
+    this->used++;
+}
+
+void eseyeTrace::record(uint8_t dir, const uint8_t *data, uint16_t len){
+    unsigned long now = millis();
+    uint8_t count;
+    while(len > 0){
+        if(this->cur == TRACE_NONE || (this->curtag & TRACE_TX) != dir || now != this->lasttime ||
+           (this->curtag & 0x7f) == TRACE_MAXRUN - 1){
+            /* Start a new record */
+            unsigned long delta = now - this->lasttime;
+            this->lasttime = now;
+            this->cur = this->head;
+            this->curtag = dir;
+            this->put(dir);
+            do{
+                this->put((delta & 0x7f) | (delta > 0x7f ? 0x80 : 0));
+                delta >>= 7;
+            }while(delta > 0);
+            this->put(*data++);
+            len--;
+        }
+        /* Add to the current record */
+        count = TRACE_MAXRUN - 1 - (this->curtag & 0x7f);
+        if(count > len)
+            count = len;
+        for(uint8_t i = 0; i < count; i++)
+            this->put(*data++);
+        len -= count;
+        this->curtag += count;
+        this->buf[this->cur] = this->curtag;
+    }
+}
+
+uint32_t eseyeTrace::dump(Print *out){
+    uint8_t hdr[TRACE_HDRLEN];
+    uint32_t total;
+    uint16_t pos = this->tail, left = this->used, chunk;
+    hdr[0] = 'E';
+    hdr[1] = 'T';
+    hdr[2] = TRACE_VERSION;
+    hdr[3] = this->basetime;
+    hdr[4] = this->basetime >> 8;
+    hdr[5] = this->basetime >> 16;
+    hdr[6] = this->basetime >> 24;
+    total = out->write(hdr, sizeof(hdr));
+    /* At most two contiguous runs */
+    while(left > 0){
+        chunk = this->size - pos;
+        if(chunk > left)
+            chunk = left;
+        total += out->write(&this->buf[pos], chunk);
+        pos = (pos + chunk) % this->size;
+        left -= chunk;
+    }
+    return total;
+}
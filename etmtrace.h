@@ -0,0 +1,89 @@
+/***************************************************************************
+  eseyetelemetrymodule library - uart trace capture
+
+  eseyeTrace is a Stream that sits between the uart and eseyeETM and
+  records every byte read and written, with a timestamp, into a caller
+  supplied ring. Once the ring is full the oldest records are dropped, so
+  it always holds the most recent part of the session. dump() writes it
+  out and extras/host/etm_replay feeds it back through poll().
+
+    uint8_t tracebuf[2048];
+    eseyeTrace modemtrace(&Serial1, tracebuf, sizeof(tracebuf));
+    eseyeETM myAWS(&modemtrace);
+    ...
+    modemtrace.dump(&SD_file);
+
+  Trace format (as written by dump(), multi-byte values little endian):
+    'E' 'T' 1      magic and version
+    uint32         millis() the first record's delta is counted from
+    records, oldest first:
+      tag          bit 7 set for bytes written to the modem, bits 0-6 length - 1
+      delta        ms since the previous record, LEB128
+      data         1 to 128 bytes
+  Bytes moving the same way in the same millisecond share a record, so a
+  typical line costs 2-3 bytes on top of its own length.
+
+ ***************************************************************************/
+
+#ifndef ETMTRACE_H__
+#define ETMTRACE_H__
+
+#if defined(ARDUINO) && (ARDUINO >= 100)
+#include <Arduino.h>
+#else
+#include <WProgram.h>
+#endif
+
+#define TRACE_VERSION 1
+#define TRACE_HDRLEN  7
+#define TRACE_TX      0x80
+#define TRACE_MAXRUN  128
+/* Largest record - tag, 5 byte delta and data. The ring needs room for two */
+#define TRACE_MAXREC  (1 + 5 + TRACE_MAXRUN)
+
+class eseyeTrace : public Stream
+{
+public:
+    /* Capture is off if buflen is less than 2 * TRACE_MAXREC */
+    eseyeTrace(Stream *uart, uint8_t *buf, uint16_t buflen);
+
+    int available();
+    int read();
+    int peek();
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+    void flush();
+
+    /* Pause and resume recording */
+    void capture(boolean on);
+    /* Forget everything recorded so far */
+    void clear(void);
+    /* Bytes of records held */
+    uint16_t length(void);
+    /* Records dropped to make room since the last clear() */
+    uint16_t dropped(void);
+    /* Write the trace - returns the number of bytes written */
+    uint32_t dump(Print *out);
+
+private:
+    Stream *uart;
+    uint8_t *buf;
+    uint16_t size;
+    uint16_t head;
+    uint16_t tail;
+    uint16_t used;
+    uint16_t drops;
+    boolean capturing;
+    /* Record being added to */
+    uint16_t cur;
+    uint8_t curtag;
+    unsigned long basetime;
+    unsigned long lasttime;
+
+    void record(uint8_t dir, const uint8_t *data, uint16_t len);
+    void put(uint8_t b);
+    void droprecord(void);
+};
+
+#endif // ETMTRACE_H__
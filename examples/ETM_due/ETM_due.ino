@@ -28,7 +28,8 @@
 #define MODEM_PWRKEY 49 
 #define MODEM_STAT   A0
 
-eseyeETM myAWS(&ATSERIAL);
+/* This sketch uses one subscribe and one publish topic so only size the library for those */
+eseyeETMSized<1, 1> myAWS(&ATSERIAL);
 
 /* Ensure ETM is reset. Initialise uarts and ETM library. */
 void setup() {
@@ -59,6 +60,8 @@ void setup() {
 #else  
   myAWS.init();
 #endif
+  /* Restart MQTT and re-open the topics if the modem restarts or loses the broker */
+  myAWS.autorecover();
 }
 
 /* Default 5 minutes between polls */
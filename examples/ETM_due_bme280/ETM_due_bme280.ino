@@ -73,6 +73,8 @@ void setup() {
 #else  
   myAWS.init();
 #endif
+  /* Restart MQTT and re-open the topics if the modem restarts or loses the broker */
+  myAWS.autorecover();
 
   if(!bme.begin()){
     DEBUGSERIAL.println("Error - no BME!");
@@ -105,24 +107,29 @@ void readBMEData(){
     BME280::PresUnit presUnit(BME280::PresUnit_hPa);
     bme.read(pres, temp, hum, tempUnit, presUnit);  
 
+    /* Send the three readings as one batch - the publishes are pipelined to the
+     * modem instead of each waiting for the previous one to be confirmed */
     char opbuf[10];
+    myAWS.batchbegin();
     if(pubtemp != -1){
       floattostring(opbuf, temp, 10);
       DEBUGSERIAL.print("Pushtemp ");
       DEBUGSERIAL.print(opbuf);
       DEBUGSERIAL.println("C");
-      myAWS.publishconfirm(pubtemp, 1, (uint8_t *)opbuf, strlen(opbuf));
+      myAWS.batchadd(pubtemp, 1, (uint8_t *)opbuf, strlen(opbuf));
     }
     if(pubhum != -1){
       floattostring(opbuf, hum, 10);
       DEBUGSERIAL.println("Pushhum");
-      myAWS.publishconfirm(pubhum, 1, (uint8_t *)opbuf, strlen(opbuf));
+      myAWS.batchadd(pubhum, 1, (uint8_t *)opbuf, strlen(opbuf));
     }
     if(pubpres != -1){
       floattostring(opbuf, pres, 100);
       DEBUGSERIAL.println("Pushpressure");
-      myAWS.publishconfirm(pubpres, 1, (uint8_t *)opbuf, strlen(opbuf));
+      myAWS.batchadd(pubpres, 1, (uint8_t *)opbuf, strlen(opbuf));
     }
+    if(myAWS.batchconfirm() == -1)
+      DEBUGSERIAL.println("Publish failed");
 }
 
 /* Accept commands from debug uart - currently allows AT commands to be sent using 'send ....' */
@@ -194,9 +201,13 @@ void loop() {
     }
     if(mqttready == false && isdone(myAWS.urcseen, ETM_MQTT_RDY)){
       mqttready = true;
-      pubtemp = myAWS.pubregconfirm((char *)"Temperature");
-      pubhum = myAWS.pubregconfirm((char *)"Humidity");
-      pubpres = myAWS.pubregconfirm((char *)"Pressure");
+      /* Register all three together rather than one round trip after another */
+      pubtemp = myAWS.pubregasync((char *)"Temperature");
+      pubhum = myAWS.pubregasync((char *)"Humidity");
+      pubpres = myAWS.pubregasync((char *)"Pressure");
+      pubtemp = pubtemp == -1 ? -1 : myAWS.opwait(pubtemp);
+      pubhum = pubhum == -1 ? -1 : myAWS.opwait(pubhum);
+      pubpres = pubpres == -1 ? -1 : myAWS.opwait(pubpres);
       if(pubtemp == -1 || pubhum == -1 || pubpres == -1){
           DEBUGSERIAL.println("Failed to register pubtopic");
       }
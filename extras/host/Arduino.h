@@ -0,0 +1,107 @@
+/***************************************************************************
+  Minimal Arduino core shim for building the eseyetelemetrymodule library
+  on a Linux host.
+
+  Only the parts of Print/Stream and the timing API that the library and
+  the host tools use are provided. millis() can run from the real clock
+  or from a virtual clock that the host tools step explicitly.
+ ***************************************************************************/
+
+#ifndef HOST_ARDUINO_H__
+#define HOST_ARDUINO_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 0x1
+#define LOW  0x0
+#define INPUT  0x0
+#define OUTPUT 0x1
+
+#define DEC 10
+#define HEX 16
+
+/* Timing */
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void yield(void);
+
+/* Select the virtual clock (true) or the monotonic host clock (false) */
+void host_clock_virtual(bool enable);
+/* Set/advance the virtual clock */
+void host_clock_set(unsigned long ms);
+void host_clock_advance(unsigned long ms);
+/* Milliseconds the virtual clock moves on each yield() (default 1) */
+void host_clock_yieldstep(unsigned long ms);
+/* Hook called from yield() - the emulator uses it to make progress */
+void host_yield_hook(void (*hook)(void *ctx), void *ctx);
+
+/* Pins are recorded so host tools can inspect/drive them */
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size){
+        size_t n = 0;
+        while(size--)
+            n += write(*buffer++);
+        return n;
+    }
+    size_t write(const char *str){
+        if(str == NULL)
+            return 0;
+        return write((const uint8_t *)str, strlen(str));
+    }
+    size_t write(const char *buffer, size_t size){
+        return write((const uint8_t *)buffer, size);
+    }
+
+    size_t print(const char *str){ return write(str); }
+    size_t print(char c){ return write((uint8_t)c); }
+    size_t print(unsigned char n, int base = DEC){ return print((unsigned long)n, base); }
+    size_t print(int n, int base = DEC){ return print((long)n, base); }
+    size_t print(unsigned int n, int base = DEC){ return print((unsigned long)n, base); }
+    size_t print(long n, int base = DEC){
+        char tmp[24];
+        snprintf(tmp, sizeof(tmp), base == HEX ? "%lX" : "%ld", n);
+        return write(tmp);
+    }
+    size_t print(unsigned long n, int base = DEC){
+        char tmp[24];
+        snprintf(tmp, sizeof(tmp), base == HEX ? "%lX" : "%lu", n);
+        return write(tmp);
+    }
+    size_t print(double n, int digits = 2){
+        char tmp[32];
+        snprintf(tmp, sizeof(tmp), "%.*f", digits, n);
+        return write(tmp);
+    }
+
+    size_t println(void){ return write("\r\n"); }
+    template <typename T> size_t println(T v){ size_t n = print(v); return n + println(); }
+    template <typename T> size_t println(T v, int base){ size_t n = print(v, base); return n + println(); }
+};
+
+class Stream : public Print
+{
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() {}
+};
+
+#endif // HOST_ARDUINO_H__
@@ -0,0 +1,120 @@
+/***************************************************************************
+  Host-side decoder for payloads built with eseyeCBOR.
+ ***************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "cbor_decode.h"
+#include "etmcbor.h"
+
+/* Render a float the way CBOR diagnostic notation does */
+static void diagfloat(double val, std::string &out){
+    char num[32];
+    if(isnan(val)){
+        out += "NaN";
+    }else if(isinf(val)){
+        out += val < 0 ? "-Infinity" : "Infinity";
+    }else{
+        snprintf(num, sizeof(num), "%.9g", val);
+        out += num;
+        if(strpbrk(num, ".e") == NULL)
+            out += ".0";
+    }
+}
+
+static long decodeitem(const uint8_t *data, size_t len, std::string &out, int depth){
+    char num[24];
+    if(len < 1 || depth > 16)
+        return -1;
+    uint8_t major = data[0] >> 5;
+    uint8_t info = data[0] & 0x1f;
+    size_t used = 1;
+    uint32_t arg;
+
+    if(info < 24){
+        arg = info;
+    }else if(info <= 26){
+        size_t arglen = 1 << (info - 24);
+        if(len < 1 + arglen)
+            return -1;
+        arg = 0;
+        for(size_t i = 0; i < arglen; i++)
+            arg = (arg << 8) | data[1 + i];
+        used += arglen;
+    }else{
+        return -1;
+    }
+
+    switch(major){
+      case 0:
+        snprintf(num, sizeof(num), "%lu", (unsigned long)arg);
+        out += num;
+        break;
+      case 1:
+        snprintf(num, sizeof(num), "-%llu", (unsigned long long)arg + 1);
+        out += num;
+        break;
+      case 2:
+      case 3:
+        if(len - used < arg)
+            return -1;
+        if(major == 2){
+            out += "h'";
+            for(uint32_t i = 0; i < arg; i++){
+                snprintf(num, sizeof(num), "%02x", data[used + i]);
+                out += num;
+            }
+            out += "'";
+        }else{
+            out += '"';
+            out.append((const char *)&data[used], arg);
+            out += '"';
+        }
+        used += arg;
+        break;
+      case 4:
+      case 5:
+        out += major == 4 ? "[" : "{";
+        for(uint32_t i = 0; i < arg; i++){
+            if(i > 0)
+                out += ", ";
+            long n = decodeitem(&data[used], len - used, out, depth + 1);
+            if(n < 0)
+                return -1;
+            used += n;
+            if(major == 5){
+                out += ": ";
+                n = decodeitem(&data[used], len - used, out, depth + 1);
+                if(n < 0)
+                    return -1;
+                used += n;
+            }
+        }
+        out += major == 4 ? "]" : "}";
+        break;
+      case 7:
+        if(info == 20)
+            out += "false";
+        else if(info == 21)
+            out += "true";
+        else if(info == 22)
+            out += "null";
+        else if(info == 25)
+            diagfloat(fromfloat16(arg), out);
+        else if(info == 26){
+            float val;
+            memcpy(&val, &arg, sizeof(val));
+            diagfloat(val, out);
+        }else
+            return -1;
+        break;
+      default:
+        return -1;
+    }
+    return used;
+}
+
+long cbordiag(const uint8_t *data, size_t len, std::string &out){
+    return decodeitem(data, len, out, 0);
+}
@@ -0,0 +1,21 @@
+/***************************************************************************
+  Host-side decoder for payloads built with eseyeCBOR.
+
+  cbordiag() renders one CBOR item as RFC 7049 diagnostic notation, e.g.
+  {"t": 21.5, "n": 3}, so tests can compare what was encoded against the
+  expected text and tools can show what went over the air. Only the subset
+  eseyeCBOR produces is understood: definite lengths, 32-bit arguments,
+  half/single floats and the simple values false/true/null.
+ ***************************************************************************/
+
+#ifndef CBOR_DECODE_H__
+#define CBOR_DECODE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/* Returns the number of bytes used, or -1 if the data is truncated or unsupported */
+long cbordiag(const uint8_t *data, size_t len, std::string &out);
+
+#endif // CBOR_DECODE_H__
@@ -0,0 +1,1492 @@
+/***************************************************************************
+  Host benchmark for the eseyetelemetrymodule library.
+
+  Runs the library against the emulated ETM modem and reports:
+    poll.parse       - inbound URC/message parse rate in poll()
+    poll.urcmix      - the same for URCs only, against the original strncmp()
+                       cascade for reference, checking that a prefix
+                       registered with urcreg() goes to its own callback and
+                       not the urc callback
+    publish.encode   - publish() payload encode rate into the UART (with the
+                       OK/:SEND OK handling in poll()), and the same for the
+                       original per-byte encoder for reference, and the ratio
+    rtt.pubregconfirm/publishconfirm - command round trip through the
+                       library and emulator with zero modem latency
+    wire.hex/binary  - uart bytes and publishconfirm() time for a 200 byte
+                       payload with ascii-hex and binary encoding
+    wire.reentry     - a publish made from a subscription callback while a
+                       binary publish waits for its > prompt, checked to reach
+                       the modem intact after it, and a topic registration
+                       from the callback and a datagram sent from a datagram
+                       callback checked to be refused without touching it
+    cbor             - size of a BME280 sample as JSON and as eseyeCBOR,
+                       checked against the host decoder, and encode rate
+    filter           - publishvalue() cost when the dead-band drops the reading
+    batch            - modem time per three-reading sample with 50ms modem
+                       latency, three publishconfirm() calls against one
+                       batchadd() batch, and the library's own stats()
+    udp              - 32 byte messages as MQTT publishes and as UDP
+                       datagrams: host cost and uart bytes per message, and
+                       message rate with 20ms modem latency
+    lz               - a JSON status message compressed with eseyeLZ: size,
+                       uart bytes when published, and compress/expand rates
+    qos1             - QoS 1 publishes on two topics through a broker that takes
+                       100ms to ack and fails one in seven, each waited for and
+                       resent by the application against the library's window
+                       with pubretry(), checking that per-topic order holds,
+                       that each message ends as the broker last answered it,
+                       and that a message in backoff holds up only its topic
+                       while answers are matched to it in the order sent
+    topics           - topic handlers registered before and after the
+                       subscriptions, checking which subscriptions "a/+/c" and
+                       "a/#" are called for, that topicunreg() stops one, that
+                       subindex() finds each topic, and that no handler sees a
+                       message larger than the receive buffer
+    stream           - a 5000 byte message on a subscribestream() topic, checking
+                       each chunk's offset, length and total and that it
+                       reassembles byte for byte, and that a message too large
+                       for a subscribe() callback is dropped without upsetting
+                       the message and command answer that follow
+    timeout          - a command whose answer the emulator withholds until after
+                       it has timed out, one whose answer never comes, and a
+                       publish whose :SEND FAIL comes after it has timed out,
+                       checking that the next command and publish get their
+                       own answers
+    store            - publishes stored in a HostFileStore while MQTT is down,
+                       drained after a reset that registers the topics on new
+                       indices and leaves one topic out, checking that each
+                       message goes to its own topic, in order, and that the
+                       missing topic holds up nothing but its own messages
+                       and doesn't keep the library from sleeping
+    recover          - ETM restarted under autorecover() with two subscriptions
+                       and two publish topics open, checking that each is
+                       re-opened on its index and carries messages again, that
+                       a QoS 1 publish the restart cut off is sent again, and
+                       the time the recovery took with 20ms modem latency
+    sleep            - sleep() on the virtual clock: refused while a command or
+                       part of a line is outstanding, cut short to a publish's
+                       retry backoff, and ended by uart input and by wake()
+
+  Usage: etm_bench [scale]    (scale multiplies the iteration counts)
+ ***************************************************************************/
+
+#include <time.h>
+#include <unistd.h>
+#include "etm_emulator.h"
+#include "eseyetelemetrymodule.h"
+#include "cbor_decode.h"
+#include "hoststore.h"
+
+static double now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void report(const char *name, double value, const char *unit){
+    printf("%-28s %14.2f %s\n", name, value, unit);
+}
+
+static unsigned long msgbytes;
+static void countmsg(uint8_t *data, uint8_t length){
+    (void)data;
+    msgbytes += length;
+}
+
+/* Bring the library up to MQTT (or UDP) ready against the emulator */
+static void startsession(eseyeETM *etm, EtmEmulator *emu, tetmProto proto = ETM_MQTT, _atcb urccallback = NULL){
+    emu->boot();
+    etm->init(urccallback);
+    while(!isdone(etm->urcseen, ETM_IDLE))
+        etm->poll();
+    etm->startproto(proto);
+    etm->waitSync();
+    unsigned int ready = proto == ETM_UDP ? ETM_UDP_RDY : ETM_MQTT_RDY;
+    while(!isdone(etm->urcseen, ready))
+        etm->poll();
+}
+
+static void bench_poll(unsigned long scale){
+    EtmEmulator emu;
+    eseyeETM etm(&emu);
+    uint8_t payload[32];
+    unsigned long lines = 0;
+
+    startsession(&etm, &emu);
+    etm.subscribeconfirm((char *)"bench", countmsg);
+    memset(payload, 'x', sizeof(payload));
+
+    /* A burst of the traffic an MQTT node sees */
+    std::string burst;
+    char hdr[24];
+    for(unsigned long i = 0; i < 20000 * scale; i++){
+        switch(i % 5){
+        case 0:
+            snprintf(hdr, sizeof(hdr), "+EMQ:0,%u\r\n", (unsigned)sizeof(payload));
+            burst += hdr;
+            burst.append((const char *)payload, sizeof(payload));
+            break;
+        case 1:
+            burst += ":SEND OK\r\n";
+            break;
+        case 2:
+            burst += "+ETMSTATE: 6\r\n";
+            break;
+        case 3:
+            burst += "+ETM:EMQRDY\r\n";
+            break;
+        default:
+            burst += "+CSQ: 20,99\r\n";
+            break;
+        }
+        lines++;
+    }
+    emu.injectraw((const uint8_t *)burst.data(), burst.size());
+
+    msgbytes = 0;
+    double start = now_us();
+    while(emu.available() > 0)
+        etm.poll();
+    double elapsed = now_us() - start;
+
+    report("poll.parse", burst.size() / elapsed, "MB/s");
+    report("poll.lines", lines / elapsed * 1e6, "lines/s");
+    report("poll.ns_per_line", elapsed * 1e3 / lines, "ns");
+}
+
+/* The original poll() line handling - a strncmp() cascade run on each line
+ * received. Kept to show what the URC table saves. */
+static unsigned long legacyhandled, legacyforwarded;
+static int legacystate;
+static void legacyline(char *line){
+    char *parseptr;
+    bool handled = false;
+    if(strncmp(line, "+ETM", strlen("+ETM")) == 0){
+        parseptr = line + strlen("+ETM");
+        if(*parseptr == ':'){
+            parseptr++;
+            if(strncmp(parseptr, "IDLE", strlen("IDLE")) == 0 || strncmp(parseptr, "EMQRDY", strlen("EMQRDY")) == 0 ||
+               strncmp(parseptr, "EURDY", strlen("EURDY")) == 0)
+                handled = true;
+        }else if(strncmp(parseptr, "STATE", strlen("STATE")) == 0){
+            legacystate = strtol(parseptr + 7, NULL, 10);
+            handled = true;
+        }
+    }else if(strncmp(line, "+EMQ", strlen("+EMQ")) == 0){
+        parseptr = line + strlen("+EMQ");
+        if(strncmp(parseptr + 3, "OPEN", strlen("OPEN")) == 0 || strncmp(parseptr + 3, "CLOSE", strlen("CLOSE")) == 0 || *parseptr == ':')
+            handled = true;
+    }else if(strncmp(line, ":SEND OK", strlen(":SEND OK")) == 0 || strncmp(line, ":SEND FAIL", strlen(":SEND FAIL")) == 0 ||
+             strncmp(line, "APP RDY", strlen("APP RDY")) == 0){
+        handled = true;
+    }else if(strncmp(line, "OK", strlen("OK")) == 0 || strncmp(line, "ERROR", strlen("ERROR")) == 0 ||
+             strncmp(line, "\r\n", strlen("\r\n")) == 0){
+        handled = true;
+    }
+    if(handled)
+        legacyhandled++;
+    else
+        legacyforwarded++;
+}
+
+static void legacypoll(Stream *uart){
+    static char line[MODEM_RX_BUFSIZE + 1];
+    static uint16_t idx;
+    while(uart->available() > 0){
+        char nextchar = uart->read();
+        line[idx++] = nextchar;
+        line[idx] = 0;
+        if(idx == 1 && (nextchar == 0x0d || nextchar == 0x0a)){
+            idx = 0;
+            continue;
+        }
+        if(nextchar == 0x0a){
+            legacyline(line);
+            idx = 0;
+        }
+        if(idx >= MODEM_RX_BUFSIZE)
+            idx = 0;
+    }
+}
+
+/* An application URC registered with urcreg() and everything else not handled */
+static unsigned long urcuser, urcforward;
+static void urcusercb(char *line){
+    if(strncmp(line, "+QIURC:", 7) == 0)
+        urcuser++;
+}
+static void urcforwardcb(char *line){
+    if(strncmp(line, "+QIURC:", 7) == 0){
+        fprintf(stderr, "poll: registered URC passed to the urc callback\n");
+        exit(1);
+    }
+    urcforward++;
+}
+
+/* URCs only, no messages - each line is classified and dispatched */
+static void bench_urcmix(unsigned long scale){
+    EtmEmulator emu;
+    eseyeETM etm(&emu);
+    unsigned long lines = 0;
+    static const char *mix[] = {":SEND OK\r\n", "+ETMSTATE: 6\r\n", "+ETM:EMQRDY\r\n", "+CSQ: 20,99\r\n",
+                                "OK\r\n", "+QIURC: \"recv\",0\r\n", "+QIND: \"csq\",20,99\r\n", "+CREG: 1\r\n"};
+
+    startsession(&etm, &emu, ETM_MQTT, urcforwardcb);
+    etm.urcreg("+QIURC:", urcusercb);
+    std::string burst;
+    for(unsigned long i = 0; i < 20000 * scale; i++){
+        burst += mix[i % 8];
+        lines++;
+    }
+
+    emu.injectraw((const uint8_t *)burst.data(), burst.size());
+    double start = now_us();
+    while(emu.available() > 0)
+        etm.poll();
+    double elapsed = now_us() - start;
+    if(urcuser != lines / 8 || urcforward != lines / 8 * 4){
+        fprintf(stderr, "poll: %lu lines to the urcreg() callback and %lu to the urc callback\n", urcuser, urcforward);
+        exit(1);
+    }
+    report("poll.urcmix", burst.size() / elapsed, "MB/s");
+    report("poll.urcmix.ns_per_line", elapsed * 1e3 / lines, "ns");
+
+    emu.injectraw((const uint8_t *)burst.data(), burst.size());
+    start = now_us();
+    legacypoll(&emu);
+    double legacy = now_us() - start;
+    report("poll.urcmix.cascade", burst.size() / legacy, "MB/s");
+    report("poll.urcmix.speedup", legacy / elapsed, "x");
+}
+
+/* The original publish() encoder - one nibble-branching conversion and one
+ * Stream write per payload byte. Kept to show the bulk encoder's gain. */
+static void legacypublish(Stream *uart, int tpcidx, uint8_t qos, uint8_t *data, uint16_t datalen){
+    char hexbyte[3];
+    uart->write("AT+EMQ");
+    uart->write("PUBLISH=");
+    uart->print(tpcidx);
+    uart->write(",");
+    uart->print(qos);
+    uart->write(",\"");
+    for(uint16_t countlen = 0; countlen < datalen; countlen++){
+        for(int n = 0; n < 2; n++){
+            uint8_t nibble = (data[countlen] >> (n == 0 ? 4 : 0)) & 0x0f;
+            if(nibble < 10)
+                hexbyte[n] = '0' + nibble;
+            else
+                hexbyte[n] = 'A' + (nibble - 10);
+        }
+        hexbyte[2] = 0;
+        uart->write(hexbyte);
+    }
+    uart->write("\"\r\n");
+}
+
+static void bench_publish(unsigned long scale){
+    EtmEmulator emu;
+    eseyeETM etm(&emu);
+    uint8_t payload[200];
+    unsigned long count = 20000 * scale;
+
+    startsession(&etm, &emu);
+    int idx = etm.pubregconfirm((char *)"bench");
+    for(unsigned i = 0; i < sizeof(payload); i++)
+        payload[i] = (uint8_t)(i * 37);
+
+    /* Only measure the library - the emulator just counts bytes and acks */
+    emu.setdiscard(true);
+    unsigned long writes = emu.stats.writecalls;
+    double start = now_us();
+    for(unsigned long i = 0; i < count; i++){
+        etm.publish(idx, 1, payload, sizeof(payload));
+        etm.poll();
+    }
+    double elapsed = now_us() - start;
+    writes = emu.stats.writecalls - writes;
+
+    double rate = count * sizeof(payload) / elapsed;
+    report("publish.encode", rate, "MB/s");
+    report("publish.us_per_200B", elapsed / count, "us");
+    report("publish.writes_per_msg", (double)writes / count, "calls");
+
+    writes = emu.stats.writecalls;
+    start = now_us();
+    for(unsigned long i = 0; i < count; i++){
+        legacypublish(&emu, idx, 1, payload, sizeof(payload));
+        etm.poll();
+    }
+    elapsed = now_us() - start;
+    writes = emu.stats.writecalls - writes;
+
+    report("publish.encode.legacy", count * sizeof(payload) / elapsed, "MB/s");
+    report("publish.encode.speedup", rate / (count * sizeof(payload) / elapsed), "x");
+    report("publish.us_per_200B.legacy", elapsed / count, "us");
+    report("publish.writes_per_msg.legacy", (double)writes / count, "calls");
+}
+
+static void bench_rtt(unsigned long scale){
+    EtmEmulator emu;
+    eseyeETM etm(&emu);
+    uint8_t payload[16];
+    unsigned long count = 2000 * scale;
+    double start, elapsed, total = 0, worst = 0;
+
+    startsession(&etm, &emu);
+    memset(payload, 0x55, sizeof(payload));
+
+    for(unsigned long i = 0; i < count; i++){
+        start = now_us();
+        int idx = etm.pubregconfirm((char *)"rtt");
+        elapsed = now_us() - start;
+        total += elapsed;
+        if(elapsed > worst)
+            worst = elapsed;
+        /* Release the index again */
+        etm.pubunreg(idx);
+        while(etm.pubstate(idx) != PUB_TOPIC_NOT_IN_USE)
+            etm.poll();
+    }
+    report("rtt.pubregconfirm.avg", total / count, "us");
+    report("rtt.pubregconfirm.max", worst, "us");
+
+    int idx = etm.pubregconfirm((char *)"rtt");
+    total = worst = 0;
+    for(unsigned long i = 0; i < count; i++){
+        start = now_us();
+        etm.publishconfirm(idx, 1, payload, sizeof(payload));
+        elapsed = now_us() - start;
+        total += elapsed;
+        if(elapsed > worst)
+            worst = elapsed;
+    }
+    report("rtt.publishconfirm.avg", total / count, "us");
+    report("rtt.publishconfirm.max", worst, "us");
+}
+
+static void bench_encoding(unsigned long scale, tetmEncoding enc, const char *name){
+    EtmEmulator emu;
+    eseyeETM etm(&emu);
+    uint8_t payload[200];
+    unsigned long count = 2000 * scale;
+    char label[40];
+
+    startsession(&etm, &emu);
+    etm.txencoding(enc);
+    int idx = etm.pubregconfirm((char *)"wire");
+    for(unsigned i = 0; i < sizeof(payload); i++)
+        payload[i] = (uint8_t)i;
+
+    unsigned long rxbytes = emu.stats.rxbytes;
+    double start = now_us();
+    for(unsigned long i = 0; i < count; i++)
+        etm.publishconfirm(idx, 1, payload, sizeof(payload));
+    double elapsed = now_us() - start;
+    rxbytes = emu.stats.rxbytes - rxbytes;
+
+    snprintf(label, sizeof(label), "wire.%s.bytes_per_200B", name);
+    report(label, (double)rxbytes / count, "bytes");
+    snprintf(label, sizeof(label), "wire.%s.publishconfirm", name);
+    report(label, elapsed / count, "us");
+}
+
+/* The subscription callback publishes while the first binary publish waits for its prompt */
+static eseyeETM *reentryetm;
+static int reentryidx;
+static void reentrymsg(uint8_t *data, uint8_t length){
+    reentryetm->publish(reentryidx, 1, data, length);
+}
+
+/* The same for a topic registration */
+static int reentrynew;
+static void reentryreg(uint8_t *data, uint8_t length){
+    reentrynew = reentryetm->pubreg((char *)"reentry/new");
+}
+
+static bool reentryhook(EtmEmulator *emu, const char *cmd, void *ctx){
+    int *subidx = (int *)ctx;
+    /* Deliver ahead of the prompt for the first publish only */
+    if(*subidx >= 0 && strcmp(cmd, "AT+EMQPUBLISH=0,1,5") == 0){
+        emu->deliver(*subidx, (const uint8_t *)"inner", 5);
+        *subidx = -1;
+    }
+    return false;
+}
+
+static void reentrylog(void *ctx, int idx, const uint8_t *payload, size_t len, bool ok){
+    ((std::vector<std::string> *)ctx)->push_back(std::string((const char *)payload, len));
+}
+
+static void reentrydatagram(void *ctx, uint8_t *data, uint16_t length){
+    *(int *)ctx = reentryetm->sendDatagram(data, length);
+}
+
+static bool reentryudphook(EtmEmulator *emu, const char *cmd, void *ctx){
+    if(strcmp(cmd, "AT+EUDPSEND=5") == 0)
+        emu->deliverdatagram((const uint8_t *)"inner", 5);
+    return false;
+}
+
+static void bench_reentry(void){
+    EtmEmulator emu;
+    eseyeETM etm(&emu);
+    std::vector<std::string> sent;
+
+    startsession(&etm, &emu);
+    etm.txencoding(ETM_ENC_BINARY);
+    int subidx = etm.subscribeconfirm((char *)"reentry/in", reentrymsg);
+    int idx = etm.pubregconfirm((char *)"reentry/out");
+    reentryetm = &etm;
+    reentryidx = idx;
+    emu.commandhook(reentryhook, &subidx);
+    emu.publishcb(reentrylog, &sent);
+
+    etm.publish(idx, 1, (uint8_t *)"outer", 5);
+    while(!etm.pubdone()){
+        yield();
+        etm.poll();
+    }
+    if(subidx != -1 || sent.size() != 2 || sent[0] != "outer" || sent[1] != "inner" || emu.stats.errors != 0){
+        fprintf(stderr, "reentry: publish from a callback corrupted the binary publish\n");
+        exit(1);
+    }
+    report("wire.reentry.publishes", sent.size(), "msgs");
+
+    /* Any other request is refused until the payload has gone */
+    subidx = etm.subscribeconfirm((char *)"reentry/reg", reentryreg);
+    sent.clear();
+    etm.publish(idx, 1, (uint8_t *)"outer", 5);
+    while(!etm.pubdone() || !etm.inSync()){
+        yield();
+        etm.poll();
+    }
+    if(subidx != -1 || reentrynew != -1 || sent.size() != 1 || sent[0] != "outer" || emu.stats.errors != 0){
+        fprintf(stderr, "reentry: topic registered from a callback corrupted the binary publish\n");
+        exit(1);
+    }
+    emu.commandhook(NULL, NULL);
+    emu.publishcb(NULL, NULL);
+
+    /* A datagram can't be queued, so the one from the callback is refused without
+     * touching the line */
+    EtmEmulator udpemu;
+    eseyeETM udp(&udpemu);
+    int inner = 0;
+    startsession(&udp, &udpemu, ETM_UDP);
+    udp.txencoding(ETM_ENC_BINARY);
+    udp.datagramcb(reentrydatagram, &inner);
+    reentryetm = &udp;
+    udpemu.commandhook(reentryudphook, NULL);
+    udp.sendDatagram((uint8_t *)"outer", 5);
+    udp.waitSync();
+    if(inner != -1 || udpemu.stats.datagrams != 1 || udpemu.stats.errors != 0 ||
+       std::string(udpemu.lastpayload.begin(), udpemu.lastpayload.end()) != "outer"){
+        fprintf(stderr, "reentry: datagram from a callback corrupted the binary datagram\n");
+        exit(1);
+    }
+    udpemu.commandhook(NULL, NULL);
+}
+
+/* Encoded items must decode to the expected diagnostic notation */
+static void checkcbor(eseyeCBOR *msg, const char *expect){
+    std::string out;
+    long used = cbordiag(msg->data(), msg->length(), out);
+    if(used != (long)msg->length() || out != expect){
+        fprintf(stderr, "cbor mismatch: got %s expected %s\n", out.c_str(), expect);
+        exit(1);
+    }
+}
+
+static void bench_cbor(unsigned long scale){
+    uint8_t buf[64];
+    eseyeCBOR msg(buf, sizeof(buf));
+    unsigned long count = 200000 * scale;
+
+    /* The three readings the BME280 examples publish, as JSON text and as a CBOR map */
+    const char *json = "{\"t\":21.5,\"h\":45.3,\"p\":1013.25}";
+    msg.map(3);
+    msg.key("t"); msg.real(21.5f);
+    msg.key("h"); msg.half(45.3f);
+    msg.key("p"); msg.real(1013.25f);
+    checkcbor(&msg, "{\"t\": 21.5, \"h\": 45.3125, \"p\": 1013.25}");
+    report("cbor.json.bytes", strlen(json), "bytes");
+    report("cbor.map.bytes", msg.length(), "bytes");
+    report("cbor.map.hexbytes", msg.length() * 2, "bytes");
+
+    /* Encoding corner cases */
+    msg.reset();
+    msg.array(9);
+    msg.uint(23); msg.uint(24); msg.uint(65536); msg.sint(-1); msg.sint(-500);
+    msg.real(0.1f); msg.half(65520.0f); msg.boolval(true); msg.null();
+    checkcbor(&msg, "[23, 24, 65536, -1, -500, 0.100000001, Infinity, true, null]");
+    msg.reset();
+    msg.array(2);
+    msg.real(5.96046448e-08f); msg.half(-0.0f);
+    checkcbor(&msg, "[5.96046448e-08, -0.0]");
+    uint8_t tiny[4];
+    eseyeCBOR small(tiny, sizeof(tiny));
+    small.text("toolong");
+    if(small.overflow() == false || small.length() != 0){
+        fprintf(stderr, "cbor overflow not detected\n");
+        exit(1);
+    }
+
+    double start = now_us();
+    for(unsigned long i = 0; i < count; i++){
+        msg.reset();
+        msg.map(3);
+        msg.key("t"); msg.real(20.0f + (i & 63) * 0.25f);
+        msg.key("h"); msg.half(45.3f);
+        msg.key("p"); msg.real(1013.25f);
+    }
+    report("cbor.encode.ns_per_sample", (now_us() - start) * 1000 / count, "ns");
+}
+
+static void bench_filter(unsigned long scale){
+    EtmEmulator emu;
+    eseyeETM etm(&emu);
+    unsigned long count = 2000000 * scale;
+    unsigned long suppressed = 0;
+
+    startsession(&etm, &emu);
+    int idx = etm.pubregconfirm((char *)"filter");
+    etm.pubfilter(idx, 50, 5, 0, 3600000UL);
+    etm.publishvalue(idx, 0, 2150);
+    etm.waitSync();
+
+    double start = now_us();
+    for(unsigned long i = 0; i < count; i++){
+        if(etm.publishvalue(idx, 0, 2150 + (i & 31)) == ETM_PUB_SUPPRESSED)
+            suppressed++;
+    }
+    double elapsed = now_us() - start;
+    if(suppressed != count){
+        fprintf(stderr, "filter passed %lu readings\n", count - suppressed);
+        exit(1);
+    }
+    report("filter.ns_per_suppressed", elapsed * 1000 / count, "ns");
+}
+
+/* Three readings per sample against a modem that takes 50ms to answer */
+static void bench_batch(unsigned long scale){
+    EtmEmulator emu;
+    eseyeETM etm(&emu);
+    uint8_t reading[8];
+    unsigned long count = 100 * scale;
+    int idx[3];
+
+    startsession(&etm, &emu);
+    idx[0] = etm.pubregconfirm((char *)"Temperature");
+    idx[1] = etm.pubregconfirm((char *)"Humidity");
+    idx[2] = etm.pubregconfirm((char *)"Pressure");
+    memset(reading, '1', sizeof(reading));
+    host_clock_virtual(true);
+    host_clock_yieldstep(1);
+    emu.setlatency(50);
+
+    unsigned long start = millis();
+    for(unsigned long i = 0; i < count; i++){
+        for(int j = 0; j < 3; j++)
+            etm.publishconfirm(idx[j], 1, reading, sizeof(reading));
+        etm.waitSync();
+    }
+    report("batch.sequential.ms_per_sample", (double)(millis() - start) / count, "ms");
+
+    start = millis();
+    for(unsigned long i = 0; i < count; i++){
+        etm.batchbegin();
+        for(int j = 0; j < 3; j++)
+            etm.batchadd(idx[j], 1, reading, sizeof(reading));
+        etm.batchconfirm();
+        etm.waitSync();
+    }
+    report("batch.batched.ms_per_sample", (double)(millis() - start) / count, "ms");
+
+    /* The library's own view of the same run */
+    struct etmstats st;
+    etm.stats(&st);
+    report("batch.stats.publish.avg", st.publish.count ? (double)st.publish.total / st.publish.count : 0, "ms");
+    report("batch.stats.publish.max", st.publish.max, "ms");
+    report("batch.stats.txbytes", st.txbytes, "bytes");
+    report("batch.stats.lines", st.lines, "lines");
+
+    emu.setlatency(0);
+    host_clock_yieldstep(0);
+    host_clock_virtual(false);
+}
+
+/* Send count 32 byte messages as MQTT publishes or UDP datagrams as fast as the
+ * library accepts them - returns the host time taken in us */
+static double udpsend(eseyeETM *etm, int idx, unsigned long count){
+    uint8_t payload[32];
+    memset(payload, 0x5a, sizeof(payload));
+    double start = now_us();
+    for(unsigned long i = 0; i < count; i++){
+        payload[0] = (uint8_t)i;
+        while((idx < 0 ? etm->sendDatagram(payload, sizeof(payload)) : etm->publish(idx, 1, payload, sizeof(payload))) == -1){
+            yield();
+            etm->poll();
+        }
+        etm->poll();
+    }
+    etm->waitSync();
+    while(!etm->pubdone())
+        etm->poll();
+    return now_us() - start;
+}
+
+static void bench_udp(unsigned long scale){
+    EtmEmulator mqttemu, udpemu;
+    eseyeETM mqtt(&mqttemu), udp(&udpemu);
+    unsigned long count = 20000 * scale;
+    unsigned long slow = 500 * scale;
+
+    startsession(&mqtt, &mqttemu);
+    startsession(&udp, &udpemu, ETM_UDP);
+    int idx = mqtt.pubregconfirm((char *)"udpbench");
+
+    /* Library and uart cost with a modem that answers at once */
+    unsigned long rxbytes = mqttemu.stats.rxbytes;
+    report("udp.mqtt.us_per_msg", udpsend(&mqtt, idx, count) / count, "us");
+    report("udp.mqtt.bytes_per_msg", (double)(mqttemu.stats.rxbytes - rxbytes) / count, "bytes");
+    rxbytes = udpemu.stats.rxbytes;
+    report("udp.datagram.us_per_msg", udpsend(&udp, -1, count) / count, "us");
+    report("udp.datagram.bytes_per_msg", (double)(udpemu.stats.rxbytes - rxbytes) / count, "bytes");
+    if(udpemu.stats.datagrams != count || udpemu.stats.datagrambytes != count * 32){
+        fprintf(stderr, "udp sent %lu datagrams, expected %lu\n", udpemu.stats.datagrams, count);
+        exit(1);
+    }
+
+    /* Message rate through a modem that takes 20ms to answer each command */
+    host_clock_virtual(true);
+    host_clock_yieldstep(1);
+    mqttemu.setlatency(20);
+    udpemu.setlatency(20);
+    unsigned long start = millis();
+    udpsend(&mqtt, idx, slow);
+    report("udp.mqtt.msg_per_s@20ms", slow * 1000.0 / (millis() - start), "msg/s");
+    start = millis();
+    udpsend(&udp, -1, slow);
+    report("udp.datagram.msg_per_s@20ms", slow * 1000.0 / (millis() - start), "msg/s");
+    host_clock_yieldstep(0);
+    host_clock_virtual(false);
+}
+
+/* Print into a fixed buffer, for eseyeUnLZ */
+class BufPrint : public Print
+{
+public:
+    BufPrint(uint8_t *buf, size_t size) : buf(buf), size(size), len(0) {}
+    size_t write(uint8_t c){
+        if(this->len == this->size)
+            return 0;
+        this->buf[this->len++] = c;
+        return 1;
+    }
+    using Print::write;
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+};
+
+static void checklz(const uint8_t *packed, uint16_t len, const char *expect){
+    uint8_t out[512];
+    int n = lzunpack(packed, len, out, sizeof(out));
+    if(n != (int)strlen(expect) || memcmp(out, expect, n) != 0){
+        fprintf(stderr, "lzunpack gave %d bytes, expected %zu\n", n, strlen(expect));
+        exit(1);
+    }
+    /* The streaming decoder, a few bytes at a time */
+    eseyeUnLZ<8> unlz;
+    BufPrint bp(out, sizeof(out));
+    for(uint16_t i = 0; i < len; i += 5){
+        if(!unlz.feed(packed + i, len - i < 5 ? len - i : 5, &bp)){
+            fprintf(stderr, "eseyeUnLZ rejected the payload at %u\n", i);
+            exit(1);
+        }
+    }
+    if(bp.len != strlen(expect) || memcmp(out, expect, bp.len) != 0){
+        fprintf(stderr, "eseyeUnLZ gave %zu bytes, expected %zu\n", bp.len, strlen(expect));
+        exit(1);
+    }
+}
+
+static void bench_lz(unsigned long scale){
+    EtmEmulator emu;
+    eseyeETM etm(&emu);
+    uint8_t buf[512], out[512];
+    eseyeLZ<8> msg(buf, sizeof(buf));
+    unsigned long count = 20000 * scale;
+
+    /* A device status report, the kind of message that is mostly repeated keys */
+    const char *json = "{\"device\":\"etm-0042\",\"fw\":\"1.4.2\",\"uptime\":86400,"
+        "\"sensors\":[{\"name\":\"temperature\",\"value\":21.5,\"unit\":\"C\",\"status\":\"ok\"},"
+        "{\"name\":\"humidity\",\"value\":45.3,\"unit\":\"%\",\"status\":\"ok\"},"
+        "{\"name\":\"pressure\",\"value\":1013.2,\"unit\":\"hPa\",\"status\":\"ok\"}],"
+        "\"network\":{\"rssi\":-71,\"status\":\"ok\"},\"store\":{\"used\":0,\"status\":\"ok\"}}";
+    uint16_t jsonlen = strlen(json);
+
+    msg.print(json);
+    msg.finish();
+    checklz(msg.data(), msg.length(), json);
+    report("lz.json.bytes", jsonlen, "bytes");
+    report("lz.packed.bytes", msg.length(), "bytes");
+
+    /* Plain payloads pass through, data that doesn't compress is bounded, bad data is refused */
+    checklz((const uint8_t *)json, jsonlen, json);
+    msg.reset();
+    for(int i = 0; i < 256; i++)
+        msg.write((uint8_t)(i * 167 + 13));
+    msg.finish();
+    if(msg.length() > LZ_HDRLEN + 256 + 32 || lzunpack(msg.data(), msg.length(), out, 256) != 256){
+        fprintf(stderr, "lz incompressible data gave %u bytes\n", msg.length());
+        exit(1);
+    }
+    const uint8_t bad[] = {LZ_MARK, 8, 0x00, 0x00, 0x10};
+    if(lzunpack(bad, sizeof(bad), out, sizeof(out)) != -1){
+        fprintf(stderr, "lz bad distance not detected\n");
+        exit(1);
+    }
+    uint8_t tiny[16];
+    eseyeLZ<8> small(tiny, sizeof(tiny));
+    small.print(json);
+    if(small.finish() || etm.publish(0, 1, &small) != -1){
+        fprintf(stderr, "lz overflow not detected\n");
+        exit(1);
+    }
+
+    /* What reaches the modem uart */
+    startsession(&etm, &emu);
+    int idx = etm.pubregconfirm((char *)"status");
+    msg.reset();
+    msg.print(json);
+    unsigned long rxbytes = emu.stats.rxbytes;
+    etm.publish(idx, 1, (uint8_t *)json, jsonlen);
+    etm.waitSync();
+    while(!etm.pubdone())
+        etm.poll();
+    report("lz.json.uartbytes", emu.stats.rxbytes - rxbytes, "bytes");
+    rxbytes = emu.stats.rxbytes;
+    etm.publish(idx, 1, &msg);
+    etm.waitSync();
+    while(!etm.pubdone())
+        etm.poll();
+    report("lz.packed.uartbytes", emu.stats.rxbytes - rxbytes, "bytes");
+    checklz(emu.lastpayload.data(), emu.lastpayload.size(), json);
+
+    double start = now_us();
+    for(unsigned long i = 0; i < count; i++){
+        msg.reset();
+        msg.write((const uint8_t *)json, jsonlen);
+        msg.finish();
+    }
+    report("lz.pack.us", (now_us() - start) / count, "us");
+    start = now_us();
+    for(unsigned long i = 0; i < count; i++)
+        lzunpack(msg.data(), msg.length(), out, sizeof(out));
+    report("lz.unpack.us", (now_us() - start) / count, "us");
+}
+
+/* Publishes the emulated broker accepted, per topic, for the order check */
+struct qos1log{
+    std::vector<int> seq[2];
+    /* Per message, whether the broker accepted the last copy it was sent (-1 if none was) */
+    std::vector<int> lastok;
+    /* Per message, whether the library reported it sent */
+    std::vector<int> reported;
+};
+
+static void qos1delivered(void *ctx, int idx, const uint8_t *payload, size_t len, bool ok){
+    struct qos1log *log = (struct qos1log *)ctx;
+    unsigned long m = atoi(std::string((const char *)payload, len).c_str());
+    if(ok && idx >= 0 && idx < 2)
+        log->seq[idx].push_back(m);
+    if(m < log->lastok.size())
+        log->lastok[m] = ok;
+}
+
+/* Every message arrived, each one's last copy arrived after the last copy of the
+ * one before it on the topic, and each was reported sent only if the broker
+ * accepted its last copy - returns the number of duplicates */
+static unsigned long qos1check(struct qos1log *log, unsigned long count, const char *name){
+    unsigned long dups = 0;
+    for(unsigned long m = 0; m < count; m++){
+        if(log->reported[m] != (log->lastok[m] == 1)){
+            fprintf(stderr, "%s: message %lu reported %s but the broker %s it\n", name, m,
+                    log->reported[m] ? "sent" : "failed", log->lastok[m] == 1 ? "accepted" : "didn't accept");
+            exit(1);
+        }
+    }
+    log->lastok.assign(count, -1);
+    log->reported.assign(count, 0);
+    for(int t = 0; t < 2; t++){
+        std::vector<long> last(count, -1);
+        for(size_t i = 0; i < log->seq[t].size(); i++)
+            last[log->seq[t][i]] = i;
+        for(unsigned long m = t; m < count; m += 2){
+            if(last[m] < 0 || (m >= 2 && last[m] < last[m - 2])){
+                fprintf(stderr, "%s: message %lu on topic %d lost or out of order\n", name, m, t);
+                exit(1);
+            }
+        }
+        dups += log->seq[t].size() - (count + 1 - t) / 2;
+        log->seq[t].clear();
+    }
+    return dups;
+}
+
+static unsigned long qos1failed;
+static void qos1done(void *ctx, int op, int result){
+    *(int *)ctx = result >= 0;
+    if(result < 0)
+        qos1failed++;
+}
+
+static void qos1sent(void *ctx, int idx, const uint8_t *payload, size_t len, bool ok){
+    ((std::vector<std::string> *)ctx)->push_back(std::string((const char *)payload, len) + (ok ? "" : "!"));
+}
+
+static void bench_qos1(unsigned long scale){
+    EtmEmulator emu;
+    eseyeETM etm(&emu);
+    struct qos1log log;
+    struct etmstats st;
+    unsigned long count = 200 * scale;
+    char payload[12];
+    int idx[2];
+
+    startsession(&etm, &emu);
+    idx[0] = etm.pubregconfirm((char *)"qos1/a");
+    idx[1] = etm.pubregconfirm((char *)"qos1/b");
+    log.lastok.assign(count, -1);
+    log.reported.assign(count, 0);
+    emu.publishcb(qos1delivered, &log);
+    host_clock_virtual(true);
+    host_clock_yieldstep(1);
+    emu.setlatency(5);
+    emu.setacklatency(100);
+    emu.setsendfailevery(7);
+
+    /* One at a time, waiting for :SEND OK and resending on :SEND FAIL */
+    unsigned long start = millis();
+    for(unsigned long i = 0; i < count; i++){
+        int len = snprintf(payload, sizeof(payload), "%lu", i);
+        tpubMsgState state = PUB_MSG_FAILED;
+        while(state == PUB_MSG_FAILED){
+            int handle = etm.publish(idx[i & 1], 1, (uint8_t *)payload, len);
+            do{
+                yield();
+                etm.poll();
+                state = etm.pubmsgstate(handle);
+            }while(state != PUB_MSG_SENT && state != PUB_MSG_FAILED);
+        }
+        log.reported[i] = 1;
+    }
+    report("qos1.confirm.msg_per_s", count * 1000.0 / (millis() - start), "msg/s");
+    qos1check(&log, count, "confirm");
+
+    /* Windowed, with the library resending */
+    etm.pubretry(5, 50, 800);
+    etm.stats(&st, true);
+    qos1failed = 0;
+    start = millis();
+    for(unsigned long i = 0; i < count; i++){
+        int len = snprintf(payload, sizeof(payload), "%lu", i);
+        while(etm.publishasync(idx[i & 1], 1, (uint8_t *)payload, len, qos1done, &log.reported[i]) == -1){
+            yield();
+            etm.poll();
+        }
+        etm.poll();
+    }
+    while(!etm.pubdone()){
+        yield();
+        etm.poll();
+    }
+    report("qos1.window.msg_per_s", count * 1000.0 / (millis() - start), "msg/s");
+    unsigned long dups = qos1check(&log, count, "window");
+    etm.stats(&st);
+    if(qos1failed != 0){
+        fprintf(stderr, "qos1: %lu publishes failed after retries\n", qos1failed);
+        exit(1);
+    }
+    report("qos1.window.retries", st.pubretries, "sends");
+    report("qos1.window.duplicates", dups, "msgs");
+    emu.setsendfailevery(0);
+
+    /* While a message waits out its backoff, a payload too long to queue still goes
+     * straight out on the other topic but not on its own */
+    uint8_t big[PUB_QUEUE_MSGLEN + 1];
+    memset(big, 'x', sizeof(big));
+    emu.setsendfail(true);
+    int handle = etm.publish(idx[0], 1, (uint8_t *)"backoff", 7);
+    while(etm.pubmsgstate(handle) != PUB_MSG_QUEUED){
+        yield();
+        etm.poll();
+    }
+    emu.setsendfail(false);
+    int other = etm.publish(idx[1], 1, big, sizeof(big));
+    int same = etm.publish(idx[0], 1, big, sizeof(big));
+    while(!etm.pubdone()){
+        yield();
+        etm.poll();
+    }
+    if(other < 0 || same != -1 || etm.pubmsgstate(handle) != PUB_MSG_SENT){
+        fprintf(stderr, "qos1: long publishes behind a backoff returned %d and %d\n", other, same);
+        exit(1);
+    }
+
+    /* A is refused every time. B goes out while A waits out its backoff, and is
+     * answered after A's resend has been written - each answer is still A's or B's */
+    std::vector<std::string> sent;
+    emu.publishcb(qos1sent, &sent);
+    emu.setsendfailtopic(idx[0]);
+    etm.pubretry(2, 50, 50);
+    int a = etm.publish(idx[0], 1, (uint8_t *)"A", 1);
+    while(etm.pubmsgstate(a) != PUB_MSG_QUEUED){
+        yield();
+        etm.poll();
+    }
+    int b = etm.publish(idx[1], 1, (uint8_t *)"B", 1);
+    while(!etm.pubdone()){
+        yield();
+        etm.poll();
+    }
+    std::string expect[] = {"A!", "B", "A!", "A!"};
+    if(etm.pubmsgstate(a) != PUB_MSG_FAILED || etm.pubmsgstate(b) != PUB_MSG_SENT ||
+       sent != std::vector<std::string>(expect, expect + 4)){
+        fprintf(stderr, "qos1: A ended %d and B %d, the broker saw", etm.pubmsgstate(a), etm.pubmsgstate(b));
+        for(size_t i = 0; i < sent.size(); i++)
+            fprintf(stderr, " %s", sent[i].c_str());
+        fprintf(stderr, "\n");
+        exit(1);
+    }
+    emu.setsendfailtopic(-1);
+    emu.publishcb(NULL, NULL);
+    host_clock_yieldstep(0);
+    host_clock_virtual(false);
+}
+
+/* Commands answered, in order, and the command the emulator holds the answer to */
+static std::vector<std::string> cmdlog;
+static void logcmd(tetmCmd cmd, int idx, boolean ok){
+    cmdlog.push_back(std::to_string(cmd) + (ok ? ":ok" : ":fail"));
+}
+
+static bool withhold(EtmEmulator *emu, const char *cmd, void *ctx){
+    return strncmp(cmd, "AT+WITHHOLD", 11) == 0;
+}
+
+static void timeoutwait(eseyeETM *etm, unsigned long ms){
+    unsigned long start = millis();
+    while(millis() - start < ms){
+        yield();
+        etm->poll();
+    }
+}
+
+static void timeoutcheck(const char *name, const std::vector<std::string> &expect){
+    if(cmdlog != expect){
+        fprintf(stderr, "timeout: %s answered", name);
+        for(size_t i = 0; i < cmdlog.size(); i++)
+            fprintf(stderr, " %s", cmdlog[i].c_str());
+        fprintf(stderr, "\n");
+        exit(1);
+    }
+    cmdlog.clear();
+}
+
+/* Handler tag and subscription index of each topic handler call */
+static std::vector<std::string> topiclog;
+static void topichandler(void *ctx, int idx, uint8_t *data, uint16_t length){
+    topiclog.push_back(std::string((const char *)ctx) + ":" + std::to_string(idx));
+}
+
+static void topicdeliver(eseyeETM *etm, EtmEmulator *emu, int idx, uint16_t len){
+    uint8_t payload[2 * MODEM_RX_BUFSIZE];
+    memset(payload, 't', len);
+    emu->deliver(idx, payload, len);
+    while(emu->available() > 0)
+        etm->poll();
+}
+
+static void topiccheck(const char *name, const std::vector<std::string> &expect){
+    if(topiclog != expect){
+        fprintf(stderr, "topics: %s called", name);
+        for(size_t i = 0; i < topiclog.size(); i++)
+            fprintf(stderr, " %s", topiclog[i].c_str());
+        fprintf(stderr, "\n");
+        exit(1);
+    }
+    topiclog.clear();
+}
+
+static void bench_topics(void){
+    EtmEmulator emu;
+    eseyeETM etm(&emu);
+    const char *topics[] = {"a/b/c", "a/x/c", "a/b", "a", "b/b/c", "a/b/c/d"};
+    int subs[6];
+
+    startsession(&etm, &emu);
+    /* One handler registered ahead of the subscriptions and one after */
+    int plus = etm.topicreg("a/+/c", topichandler, (void *)"plus");
+    for(int i = 0; i < 6; i++)
+        subs[i] = etm.subscribeconfirm((char *)topics[i], NULL);
+    int hash = etm.topicreg("a/#", topichandler, (void *)"hash");
+    if(plus < 0 || hash < 0){
+        fprintf(stderr, "topics: handlers registered as %d and %d\n", plus, hash);
+        exit(1);
+    }
+    for(int i = 0; i < 6; i++){
+        if(etm.subindex(topics[i]) != subs[i]){
+            fprintf(stderr, "topics: subindex(%s) is %d not %d\n", topics[i], etm.subindex(topics[i]), subs[i]);
+            exit(1);
+        }
+    }
+    if(etm.subindex("a/+/c") != -1 || etm.subindex("a/b/") != -1){
+        fprintf(stderr, "topics: subindex() found a topic not subscribed\n");
+        exit(1);
+    }
+
+    for(int i = 0; i < 6; i++)
+        topicdeliver(&etm, &emu, subs[i], 8);
+    std::string a = std::to_string(subs[0]), x = std::to_string(subs[1]);
+    topiccheck("for each subscription", {"plus:" + a, "hash:" + a, "plus:" + x, "hash:" + x,
+               "hash:" + std::to_string(subs[2]), "hash:" + std::to_string(subs[3]),
+               "hash:" + std::to_string(subs[5])});
+
+    /* Larger than the receive buffer - arrives in chunks, so no handler sees it */
+    topicdeliver(&etm, &emu, subs[0], MODEM_RX_BUFSIZE + 50);
+    topiccheck("for a message larger than the receive buffer", {});
+    topicdeliver(&etm, &emu, subs[0], 8);
+    topiccheck("after a message larger than the receive buffer", {"plus:" + a, "hash:" + a});
+
+    etm.topicunreg(plus);
+    topicdeliver(&etm, &emu, subs[0], 8);
+    topicdeliver(&etm, &emu, subs[1], 8);
+    topiccheck("after topicunreg()", {"hash:" + a, "hash:" + x});
+    if(etm.topicunreg(MAX_TOPIC_HANDLERS) != -1){
+        fprintf(stderr, "topics: topicunreg() took an id out of range\n");
+        exit(1);
+    }
+    etm.topicunreg(hash);
+}
+
+/* Chunks of a streamed message, put back together */
+static std::vector<uint8_t> streambuf;
+static unsigned long streamchunks;
+static bool streambad;
+static void streamchunk(uint8_t *data, uint16_t length, uint16_t offset, uint16_t total){
+    if(offset != streambuf.size() || total != 5000 || length == 0 || length > MODEM_RX_BUFSIZE)
+        streambad = true;
+    streambuf.insert(streambuf.end(), data, data + length);
+    streamchunks++;
+}
+
+static std::string streamlast;
+static void streammsg(uint8_t *data, uint8_t length){
+    streamlast.assign((const char *)data, length);
+}
+
+static void bench_stream(void){
+    EtmEmulator emu;
+    eseyeETM etm(&emu);
+    uint8_t payload[5000];
+
+    startsession(&etm, &emu);
+    int big = etm.subscribestream((char *)"stream/big", streamchunk);
+    int small = etm.subscribeconfirm((char *)"stream/small", streammsg);
+    for(size_t i = 0; i < sizeof(payload); i++)
+        payload[i] = (uint8_t)(i * 7 + (i >> 8));
+    emu.deliver(big, payload, sizeof(payload));
+    while(emu.available() > 0)
+        etm.poll();
+    if(streambad || streambuf.size() != sizeof(payload) || memcmp(streambuf.data(), payload, sizeof(payload)) != 0){
+        fprintf(stderr, "stream: %zu bytes in %lu chunks did not match what was sent\n", streambuf.size(), streamchunks);
+        exit(1);
+    }
+    report("stream.chunks", streamchunks, "chunks");
+
+    /* Too large for a message callback - dropped, and what follows is read as normal */
+    emu.deliver(small, payload, 300);
+    emu.deliver(small, (const uint8_t *)"after", 5);
+    while(emu.available() > 0)
+        etm.poll();
+    int idx = etm.pubregconfirm((char *)"stream/out");
+    if(streamlast != "after" || idx < 0 || etm.pubstate(idx) != PUB_TOPIC_REGISTERED){
+        fprintf(stderr, "stream: after an oversized message got \"%s\" and topic %d\n", streamlast.c_str(), idx);
+        exit(1);
+    }
+}
+
+static void bench_timeout(void){
+    EtmEmulator emu;
+    eseyeETM etm(&emu);
+    struct etmstats st;
+    std::string at = std::to_string(ETM_CMD_AT), pubreg = std::to_string(ETM_CMD_PUBREG);
+
+    startsession(&etm, &emu);
+    host_clock_virtual(true);
+    host_clock_yieldstep(1);
+    etm.settimeout(ETM_CMD_AT, 100);
+    etm.settimeout(ETM_CMD_PUBLISH, 200);
+    etm.cmdcb(logcmd);
+    emu.commandhook(withhold, NULL);
+    etm.stats(&st, true);
+
+    /* The ERROR comes after the command has timed out, just ahead of the next one's OK */
+    etm.sendAT((char *)"AT+WITHHOLD=late\r\n");
+    timeoutwait(&etm, 150);
+    emu.respond("ERROR");
+    int idx = etm.pubregconfirm((char *)"timeout/late");
+    timeoutcheck("late", {at + ":fail", pubreg + ":ok"});
+
+    /* No answer at all - the next command is only held up until it is given up on */
+    etm.sendAT((char *)"AT+WITHHOLD=lost\r\n");
+    timeoutwait(&etm, 250);
+    etm.pubregconfirm((char *)"timeout/lost");
+    timeoutcheck("lost", {at + ":fail", pubreg + ":ok"});
+    if(!etm.inSync()){
+        fprintf(stderr, "timeout: commands still outstanding\n");
+        exit(1);
+    }
+
+    /* :SEND FAIL after the publish timed out, ahead of the next publish's :SEND OK */
+    etm.cmdcb(NULL);
+    emu.setsendfail(true);
+    emu.setacklatency(300);
+    int first = etm.publish(idx, 1, (uint8_t *)"first", 5);
+    emu.setsendfail(false);
+    emu.setacklatency(0);
+    timeoutwait(&etm, 250);
+    tpubMsgState firststate = etm.pubmsgstate(first);
+    int second = etm.publish(idx, 1, (uint8_t *)"second", 6);
+    while(!etm.pubdone()){
+        yield();
+        etm.poll();
+    }
+    if(firststate != PUB_MSG_FAILED || etm.pubmsgstate(second) != PUB_MSG_SENT){
+        fprintf(stderr, "timeout: publishes ended %d and %d\n", firststate, etm.pubmsgstate(second));
+        exit(1);
+    }
+    etm.stats(&st);
+    report("timeout.stats.timeouts", st.timeouts, "requests");
+    emu.commandhook(NULL, NULL);
+    host_clock_yieldstep(0);
+    host_clock_virtual(false);
+}
+
+/* Topic index and payload of each publish the emulated broker accepted */
+static void storelog(void *ctx, int idx, const uint8_t *payload, size_t len, bool ok){
+    ((std::vector<std::string> *)ctx)->push_back(std::to_string(idx) + ":" + std::string((const char *)payload, len));
+}
+
+static void storepublish(eseyeETM *etm, int idx, const char *payload, int expect){
+    int res = etm->publish(idx, 1, (uint8_t *)payload, strlen(payload));
+    if(res != expect && (expect != 0 || res < 0)){
+        fprintf(stderr, "store: publish %s returned %d\n", payload, res);
+        exit(1);
+    }
+}
+
+static void storewait(eseyeETM *etm, uint16_t left){
+    while(etm->storedcount() != left || !etm->pubdone()){
+        yield();
+        etm->poll();
+    }
+}
+
+static void bench_store(void){
+    EtmEmulator emu;
+    std::vector<std::string> sent;
+    char path[] = "/tmp/etm_bench_storeXXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0){
+        perror("store: mkstemp");
+        exit(1);
+    }
+    close(fd);
+    emu.publishcb(storelog, &sent);
+    host_clock_virtual(true);
+    host_clock_yieldstep(1);
+
+    /* MQTT drops with three topics registered */
+    {
+        HostFileStore file(path, 16, 37);
+        eseyeETM etm(&emu);
+        startsession(&etm, &emu);
+        etm.storeforward(&file, STORE_DROP_NEWEST, 10);
+        int a = etm.pubregconfirm((char *)"store/a");
+        int b = etm.pubregconfirm((char *)"store/b");
+        int c = etm.pubregconfirm((char *)"store/c");
+        emu.inject("+ETM:IDLE");
+        while(emu.available() > 0)
+            etm.poll();
+        storepublish(&etm, a, "a1", ETM_PUB_STORED);
+        storepublish(&etm, b, "b1", ETM_PUB_STORED);
+        storepublish(&etm, c, "c1", ETM_PUB_STORED);
+        storepublish(&etm, a, "a2", ETM_PUB_STORED);
+        storepublish(&etm, c, "c2", ETM_PUB_STORED);
+        storepublish(&etm, b, "b2", ETM_PUB_STORED);
+        /* Never registered - nothing would ever send it */
+        storepublish(&etm, c + 1, "x", -1);
+    }
+
+    /* After a reset the topics come back on other indices, and store/c not at all yet */
+    HostFileStore file(path, 16, 37);
+    eseyeETM etm(&emu);
+    startsession(&etm, &emu);
+    etm.storeforward(&file, STORE_DROP_NEWEST, 10);
+    if(etm.storedcount() != 6){
+        fprintf(stderr, "store: %u publishes survived the reset\n", etm.storedcount());
+        exit(1);
+    }
+    sent.clear();
+    unsigned long start = millis();
+    int b = etm.pubreg((char *)"store/b");
+    int a = etm.pubreg((char *)"store/a");
+    /* Behind its stored publishes while the topic registers */
+    storepublish(&etm, a, "a3", ETM_PUB_STORED);
+    storewait(&etm, 2);
+    report("store.drain.ms", millis() - start, "ms");
+    /* Only store/c's publishes are left, and nothing sends them until it is registered */
+    start = millis();
+    while(millis() - start < 50){
+        yield();
+        etm.poll();
+    }
+    twakeReason reason = etm.sleep(100);
+    if(reason != WAKE_TIMER || millis() - start < 150){
+        fprintf(stderr, "store: sleep() with only held publishes stored returned %d\n", reason);
+        exit(1);
+    }
+    int c = etm.pubregconfirm((char *)"store/c");
+    storewait(&etm, 0);
+    storepublish(&etm, a, "a4", 0);
+    storewait(&etm, 0);
+
+    std::string expect[] = {
+        std::to_string(a) + ":a1", std::to_string(b) + ":b1", std::to_string(a) + ":a2",
+        std::to_string(b) + ":b2", std::to_string(a) + ":a3",
+        std::to_string(c) + ":c1", std::to_string(c) + ":c2", std::to_string(a) + ":a4"};
+    if(sent != std::vector<std::string>(expect, expect + 8)){
+        fprintf(stderr, "store: drained");
+        for(size_t i = 0; i < sent.size(); i++)
+            fprintf(stderr, " %s", sent[i].c_str());
+        fprintf(stderr, "\n");
+        exit(1);
+    }
+    report("store.drain.publishes", sent.size(), "msgs");
+    emu.publishcb(NULL, NULL);
+    host_clock_yieldstep(0);
+    host_clock_virtual(false);
+    unlink(path);
+}
+
+static unsigned long recovermsgs;
+static void recovermsg(uint8_t *data, uint8_t length){
+    recovermsgs++;
+}
+
+static void recoverfail(const char *what, int idx){
+    fprintf(stderr, "recover: %s %d not re-opened\n", what, idx);
+    exit(1);
+}
+
+static void bench_recover(void){
+    EtmEmulator emu;
+    eseyeETM etm(&emu);
+    std::vector<std::string> sent;
+    int subs[2], pubs[2];
+
+    startsession(&etm, &emu);
+    host_clock_virtual(true);
+    host_clock_yieldstep(1);
+    emu.setlatency(20);
+    emu.publishcb(storelog, &sent);
+    etm.autorecover(true);
+    subs[0] = etm.subscribeconfirm((char *)"recover/in/a", recovermsg);
+    subs[1] = etm.subscribeconfirm((char *)"recover/in/b", recovermsg);
+    pubs[0] = etm.pubregconfirm((char *)"recover/out/a");
+    pubs[1] = etm.pubregconfirm((char *)"recover/out/b");
+
+    /* ETM restarts - it comes back idle with nothing open, and a QoS 1 publish it
+     * had accepted never gets its :SEND OK */
+    etm.pubretry(3);
+    emu.setacklatency(500);
+    int held = etm.publish(pubs[0], 1, (uint8_t *)"held", 4);
+    while(etm.pubmsgstate(held) != PUB_MSG_WAITSEND){
+        yield();
+        etm.poll();
+    }
+    emu.setacklatency(0);
+    unsigned long start = millis();
+    emu.boot();
+    while(!etm.recovering())
+        etm.poll();
+    while(etm.recovering() && millis() - start < 1000){
+        yield();
+        etm.poll();
+    }
+    report("recover.ms", millis() - start, "ms");
+    for(int i = 0; i < 2; i++){
+        if(!emu.subopen[subs[i]] || etm.substate(subs[i]) != SUB_TOPIC_SUBSCRIBED)
+            recoverfail("subscription", subs[i]);
+        if(!emu.pubopen[pubs[i]] || etm.pubstate(pubs[i]) != PUB_TOPIC_REGISTERED)
+            recoverfail("publish topic", pubs[i]);
+    }
+    /* The publish goes out again once its topic is back */
+    while(!etm.pubdone()){
+        yield();
+        etm.poll();
+    }
+    if(etm.pubmsgstate(held) != PUB_MSG_SENT){
+        fprintf(stderr, "recover: publish in flight across the restart ended %d\n", etm.pubmsgstate(held));
+        exit(1);
+    }
+
+    for(int i = 0; i < 2; i++){
+        emu.deliver(subs[i], (const uint8_t *)"in", 2);
+        etm.publish(pubs[i], 1, (uint8_t *)"out", 3);
+    }
+    while(recovermsgs < 2 || !etm.pubdone()){
+        yield();
+        etm.poll();
+    }
+    std::string expect[] = {std::to_string(pubs[0]) + ":held", std::to_string(pubs[0]) + ":held",
+                            std::to_string(pubs[0]) + ":out", std::to_string(pubs[1]) + ":out"};
+    if(sent != std::vector<std::string>(expect, expect + 4)){
+        fprintf(stderr, "recover: %zu publishes reached their topics\n", sent.size());
+        exit(1);
+    }
+    report("recover.recoverytime", etm.recoverytime(), "ms");
+    emu.publishcb(NULL, NULL);
+    host_clock_yieldstep(0);
+    host_clock_virtual(false);
+}
+
+/* Stands in for a low power wait that an interrupt ends with wake() */
+static eseyeETM *sleepetm;
+static unsigned long sleepidles;
+static void sleepidle(unsigned long ms){
+    delay(1);
+    if(++sleepidles == 30)
+        sleepetm->wake();
+}
+
+static void sleepcheck(const char *name, twakeReason reason, twakeReason expect, unsigned long slept, unsigned long expectms){
+    if(reason != expect || slept != expectms){
+        fprintf(stderr, "sleep: %s woke %d after %lu ms\n", name, reason, slept);
+        exit(1);
+    }
+}
+
+static void bench_sleep(void){
+    EtmEmulator emu;
+    eseyeETM etm(&emu);
+    unsigned long start;
+    twakeReason reason;
+
+    startsession(&etm, &emu);
+    host_clock_virtual(true);
+    host_clock_yieldstep(1);
+    int idx = etm.pubregconfirm((char *)"sleep/out");
+    if(!etm.quiescent() || etm.nextdeadline() != ETM_NO_DEADLINE){
+        fprintf(stderr, "sleep: busy with nothing outstanding\n");
+        exit(1);
+    }
+
+    /* A command waiting for its OK */
+    emu.setlatency(20);
+    etm.sendAT((char *)"AT\r\n");
+    start = millis();
+    reason = etm.sleep(1000);
+    sleepcheck("with a command outstanding", reason, TRY_AGAIN_SHORTLY, millis() - start, 0);
+    etm.waitSync();
+    emu.setlatency(0);
+
+    /* Half a line received */
+    emu.injectraw((const uint8_t *)"+CSQ: 2", 7);
+    while(emu.available() > 0)
+        etm.poll();
+    start = millis();
+    reason = etm.sleep(1000);
+    sleepcheck("with half a line received", reason, TRY_AGAIN_SHORTLY, millis() - start, 0);
+    emu.inject("0,99");
+    while(emu.available() > 0)
+        etm.poll();
+
+    /* A publish waiting out its retry backoff - the sleep ends when it is due again */
+    etm.pubretry(3, 200);
+    emu.setsendfailtopic(idx);
+    int msg = etm.publish(idx, 1, (uint8_t *)"retry", 5);
+    while(!etm.quiescent()){
+        yield();
+        etm.poll();
+    }
+    emu.setsendfailtopic(-1);
+    unsigned long due = etm.nextdeadline();
+    if(due == 0 || due > 200){
+        fprintf(stderr, "sleep: retry due in %lu ms\n", due);
+        exit(1);
+    }
+    start = millis();
+    reason = etm.sleep(10000);
+    sleepcheck("with a publish in backoff", reason, WAKE_TIMER, millis() - start, due);
+    report("sleep.backoff.ms", millis() - start, "ms");
+    while(!etm.pubdone()){
+        yield();
+        etm.poll();
+    }
+    if(etm.pubmsgstate(msg) != PUB_MSG_SENT){
+        fprintf(stderr, "sleep: publish after the backoff ended %d\n", etm.pubmsgstate(msg));
+        exit(1);
+    }
+
+    /* A URC arrives 30ms in */
+    emu.setlatency(30);
+    emu.respond("+CSQ: 20,99");
+    emu.setlatency(0);
+    start = millis();
+    reason = etm.sleep(1000);
+    sleepcheck("for uart input", reason, WAKE_CLICK, millis() - start, 30);
+    while(emu.available() > 0)
+        etm.poll();
+
+    /* An interrupt 30ms in */
+    sleepetm = &etm;
+    sleepidles = 0;
+    start = millis();
+    reason = etm.sleep(1000, sleepidle);
+    sleepcheck("for wake()", reason, WAKE_INT, millis() - start, 30);
+    host_clock_yieldstep(0);
+    host_clock_virtual(false);
+}
+
+int main(int argc, char **argv){
+    unsigned long scale = 1;
+    if(argc > 1)
+        scale = strtoul(argv[1], NULL, 10);
+    if(scale == 0)
+        scale = 1;
+
+    bench_poll(scale);
+    bench_urcmix(scale);
+    bench_publish(scale);
+    bench_rtt(scale);
+    bench_encoding(scale, ETM_ENC_HEX, "hex");
+    bench_encoding(scale, ETM_ENC_BINARY, "binary");
+    bench_reentry();
+    bench_cbor(scale);
+    bench_filter(scale);
+    bench_batch(scale);
+    bench_udp(scale);
+    bench_lz(scale);
+    bench_qos1(scale);
+    bench_topics();
+    bench_stream();
+    bench_timeout();
+    bench_store();
+    bench_recover();
+    bench_sleep();
+    return 0;
+}
@@ -0,0 +1,50 @@
+/***************************************************************************
+  Print eseyeCBOR payloads in diagnostic notation.
+
+  Usage: etm_cbordump [hex...]    (reads hex lines from stdin without args)
+
+  The hex is what AT+EMQPUBLISH carries or a subscribed message as logged,
+  e.g. etm_cbordump a26174f94d606168f95228
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "cbor_decode.h"
+
+static int dumphex(const char *hex){
+    std::vector<uint8_t> data;
+    unsigned int byte;
+    for(; hex[0] != 0 && hex[1] != 0; hex += 2){
+        if(sscanf(hex, "%2x", &byte) != 1)
+            break;
+        data.push_back(byte);
+    }
+    size_t offset = 0;
+    while(offset < data.size()){
+        std::string out;
+        long used = cbordiag(&data[offset], data.size() - offset, out);
+        if(used < 0){
+            printf("invalid CBOR at offset %zu\n", offset);
+            return 1;
+        }
+        printf("%s\n", out.c_str());
+        offset += used;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv){
+    int res = 0;
+    if(argc > 1){
+        for(int i = 1; i < argc; i++)
+            res |= dumphex(argv[i]);
+        return res;
+    }
+    char line[4096];
+    while(fgets(line, sizeof(line), stdin) != NULL){
+        line[strcspn(line, "\r\n")] = 0;
+        res |= dumphex(line);
+    }
+    return res;
+}
@@ -0,0 +1,347 @@
+/***************************************************************************
+  Emulated Eseye Telemetry Module for host builds of eseyetelemetrymodule.
+ ***************************************************************************/
+
+#include "etm_emulator.h"
+
+static int hexval(char c){
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+EtmEmulator::EtmEmulator(){
+    this->hook = NULL;
+    this->hookctx = NULL;
+    this->pubcb = NULL;
+    this->pubctx = NULL;
+    this->latency = 0;
+    this->acklatency = 0;
+    this->reset();
+}
+
+void EtmEmulator::reset(void){
+    this->output.clear();
+    this->outpos = 0;
+    this->cmdline.clear();
+    this->sendfail = false;
+    this->failevery = 0;
+    this->failtopic = -1;
+    this->allerror = false;
+    this->discard = false;
+    this->rawremaining = 0;
+    this->rawidx = -1;
+    this->openerror = 0;
+    this->mqttstarted = false;
+    this->udpstarted = false;
+    this->lastpubidx = -1;
+    this->lastpayload.clear();
+    memset(&this->stats, 0, sizeof(this->stats));
+    for(int i = 0; i < EMU_MAX_TOPICS; i++){
+        this->pubopen[i] = false;
+        this->subopen[i] = false;
+    }
+}
+
+void EtmEmulator::setlatency(unsigned long ms){
+    this->latency = ms;
+}
+
+void EtmEmulator::setacklatency(unsigned long ms){
+    this->acklatency = ms;
+}
+
+void EtmEmulator::setsendfail(bool fail){
+    this->sendfail = fail;
+}
+
+void EtmEmulator::setsendfailevery(unsigned long n){
+    this->failevery = n;
+}
+
+void EtmEmulator::setsendfailtopic(int idx){
+    this->failtopic = idx;
+}
+
+void EtmEmulator::publishcb(_emupubcb cb, void *ctx){
+    this->pubcb = cb;
+    this->pubctx = ctx;
+}
+
+void EtmEmulator::setopenerror(int err){
+    this->openerror = err;
+}
+
+void EtmEmulator::seterror(bool error){
+    this->allerror = error;
+}
+
+void EtmEmulator::setdiscard(bool discardall){
+    this->discard = discardall;
+}
+
+void EtmEmulator::commandhook(_emucmdhook cmdhook, void *ctx){
+    this->hook = cmdhook;
+    this->hookctx = ctx;
+}
+
+/* Modem to host direction */
+
+void EtmEmulator::queue(unsigned long due, const std::string &data, bool ack){
+    /* Keep output in order - a response can't overtake an earlier one, except a
+     * :SEND OK/FAIL still waiting for the broker (or the line being read) */
+    size_t pos = this->output.size();
+    while(!ack && pos > 0 && this->output[pos - 1].ack && this->output[pos - 1].due > due &&
+          (pos > 1 || this->outpos == 0))
+        pos--;
+    if(pos > 0 && this->output[pos - 1].due > due)
+        due = this->output[pos - 1].due;
+    this->output.insert(this->output.begin() + pos, {due, data, ack});
+}
+
+bool EtmEmulator::ready(void){
+    if(this->output.empty())
+        return false;
+    return (long)(millis() - this->output.front().due) >= 0;
+}
+
+int EtmEmulator::available(){
+    if(!this->ready())
+        return 0;
+    return (int)(this->output.front().data.size() - this->outpos);
+}
+
+int EtmEmulator::peek(){
+    if(!this->ready())
+        return -1;
+    return (uint8_t)this->output.front().data[this->outpos];
+}
+
+int EtmEmulator::read(){
+    if(!this->ready())
+        return -1;
+    const std::string &front = this->output.front().data;
+    int c = (uint8_t)front[this->outpos++];
+    if(this->outpos >= front.size()){
+        this->output.pop_front();
+        this->outpos = 0;
+    }
+    this->stats.txbytes++;
+    return c;
+}
+
+void EtmEmulator::inject(const char *line){
+    this->queue(millis(), std::string(line) + "\r\n");
+}
+
+void EtmEmulator::injectraw(const uint8_t *data, size_t len){
+    this->queue(millis(), std::string((const char *)data, len));
+}
+
+void EtmEmulator::respond(const char *line){
+    this->queue(millis() + this->latency, std::string(line) + "\r\n");
+}
+
+void EtmEmulator::boot(void){
+    this->reset();
+    this->inject("APP RDY");
+    this->inject("+ETM:IDLE");
+}
+
+void EtmEmulator::deliver(int subidx, const uint8_t *payload, uint16_t len){
+    char hdr[24];
+    snprintf(hdr, sizeof(hdr), "+EMQ:%d,%u\r\n", subidx, len);
+    std::string msg(hdr);
+    msg.append((const char *)payload, len);
+    this->queue(millis(), msg);
+}
+
+void EtmEmulator::deliverdatagram(const uint8_t *payload, uint16_t len){
+    char hdr[16];
+    snprintf(hdr, sizeof(hdr), "+EUDP:%u\r\n", len);
+    std::string msg(hdr);
+    msg.append((const char *)payload, len);
+    this->queue(millis(), msg);
+}
+
+/* Host to modem direction */
+
+size_t EtmEmulator::write(uint8_t c){
+    return this->write(&c, 1);
+}
+
+size_t EtmEmulator::write(const uint8_t *buffer, size_t size){
+    this->stats.writecalls++;
+    this->stats.rxbytes += size;
+    if(this->discard){
+        for(size_t i = 0; i < size; i++){
+            if(buffer[i] == '\n')
+                this->queue(0, "OK\r\n:SEND OK\r\n");
+        }
+        return size;
+    }
+    for(size_t i = 0; i < size; i++){
+        char c = (char)buffer[i];
+        if(this->rawremaining > 0){
+            this->lastpayload.push_back((uint8_t)c);
+            if(--this->rawremaining == 0)
+                this->publishdone(this->rawidx);
+            continue;
+        }
+        if(c == '\n'){
+            if(!this->cmdline.empty() && this->cmdline.back() == '\r')
+                this->cmdline.pop_back();
+            if(!this->cmdline.empty())
+                this->command(this->cmdline.c_str());
+            this->cmdline.clear();
+        }else{
+            this->cmdline.push_back(c);
+        }
+    }
+    return size;
+}
+
+void EtmEmulator::command(const char *cmd){
+    this->stats.commands++;
+    if(this->hook != NULL && this->hook(this, cmd, this->hookctx))
+        return;
+    if(this->allerror){
+        this->stats.errors++;
+        this->respond("ERROR");
+        return;
+    }
+    if(strncmp(cmd, "AT+EMQPUBLISH=", 14) == 0){
+        this->publishcmd(cmd + 14);
+    }else if(strncmp(cmd, "AT+EMQSUBOPEN=", 14) == 0){
+        this->opencmd(cmd + 14, true, true);
+    }else if(strncmp(cmd, "AT+EMQSUBCLOSE=", 15) == 0){
+        this->opencmd(cmd + 15, true, false);
+    }else if(strncmp(cmd, "AT+EMQPUBOPEN=", 14) == 0){
+        this->opencmd(cmd + 14, false, true);
+    }else if(strncmp(cmd, "AT+EMQPUBCLOSE=", 15) == 0){
+        this->opencmd(cmd + 15, false, false);
+    }else if(strcmp(cmd, "AT+ETMSTATE=startmqtt") == 0){
+        this->mqttstarted = true;
+        this->respond("OK");
+        this->respond("+ETM:EMQRDY");
+    }else if(strncmp(cmd, "AT+EUDPSEND=", 12) == 0){
+        this->udpsendcmd(cmd + 12);
+    }else if(strcmp(cmd, "AT+ETMSTATE=startudp") == 0){
+        this->udpstarted = true;
+        this->respond("OK");
+        this->respond("+ETM:EURDY");
+    }else if(strcmp(cmd, "AT+ETMSTATE?") == 0){
+        this->respond(this->mqttstarted ? "+ETMSTATE: 6" : "+ETMSTATE: 0");
+        this->respond("OK");
+    }else if(strncmp(cmd, "AT+ETMSTATE=", 12) == 0 || strcmp(cmd, "ATE0") == 0 || strcmp(cmd, "AT") == 0){
+        this->respond("OK");
+    }else{
+        this->stats.errors++;
+        this->respond("ERROR");
+    }
+}
+
+void EtmEmulator::opencmd(const char *args, bool sub, bool open){
+    char urc[32];
+    int idx = strtol(args, NULL, 10);
+    if(idx < 0 || idx >= EMU_MAX_TOPICS || !this->mqttstarted){
+        this->stats.errors++;
+        this->respond("ERROR");
+        return;
+    }
+    bool *table = sub ? this->subopen : this->pubopen;
+    int err = 0;
+    if(open){
+        err = table[idx] ? -2 : this->openerror;
+        if(err == 0)
+            table[idx] = true;
+    }else{
+        table[idx] = false;
+    }
+    this->respond("OK");
+    snprintf(urc, sizeof(urc), "+EMQ%s%s:%d,%d", sub ? "SUB" : "PUB", open ? "OPEN" : "CLOSE", idx, err);
+    this->respond(urc);
+}
+
+/* AT+EMQPUBLISH=<idx>,<qos>,"<hex>" or AT+EMQPUBLISH=<idx>,<qos>,<len> followed
+ * by <len> raw bytes after the > prompt */
+void EtmEmulator::publishcmd(const char *args){
+    char *endptr;
+    int idx = strtol(args, &endptr, 10);
+    const char *hex = strchr(endptr, '"');
+    const char *lenptr = strrchr(endptr, ',');
+    if(idx < 0 || idx >= EMU_MAX_TOPICS || !this->pubopen[idx] || lenptr == NULL){
+        this->stats.errors++;
+        this->respond("ERROR");
+        return;
+    }
+    this->lastpayload.clear();
+    if(hex == NULL){
+        this->rawremaining = strtoul(lenptr + 1, NULL, 10);
+        this->rawidx = idx;
+        this->queue(millis(), "> ");
+        if(this->rawremaining == 0)
+            this->publishdone(idx);
+        return;
+    }
+    if(this->hexpayload(hex + 1))
+        this->publishdone(idx);
+}
+
+/* AT+EUDPSEND="<hex>" or AT+EUDPSEND=<len> followed by <len> raw bytes after the > prompt */
+void EtmEmulator::udpsendcmd(const char *args){
+    if(!this->udpstarted){
+        this->stats.errors++;
+        this->respond("ERROR");
+        return;
+    }
+    this->lastpayload.clear();
+    if(args[0] != '"'){
+        this->rawremaining = strtoul(args, NULL, 10);
+        this->rawidx = EMU_UDP_IDX;
+        this->queue(millis(), "> ");
+        if(this->rawremaining == 0)
+            this->publishdone(EMU_UDP_IDX);
+        return;
+    }
+    if(this->hexpayload(args + 1))
+        this->publishdone(EMU_UDP_IDX);
+}
+
+/* Decode an ascii-hex payload up to its closing quote into lastpayload - answers ERROR if it is bad */
+bool EtmEmulator::hexpayload(const char *hex){
+    while(hex[0] != '"' && hex[0] != 0 && hex[1] != 0){
+        int hi = hexval(hex[0]), lo = hexval(hex[1]);
+        if(hi < 0 || lo < 0){
+            this->stats.errors++;
+            this->respond("ERROR");
+            return false;
+        }
+        this->lastpayload.push_back((uint8_t)((hi << 4) | lo));
+        hex += 2;
+    }
+    return true;
+}
+
+void EtmEmulator::publishdone(int idx){
+    this->lastpubidx = idx;
+    if(idx == EMU_UDP_IDX){
+        /* Datagrams are only acknowledged by the OK */
+        this->stats.datagrams++;
+        this->stats.datagrambytes += this->lastpayload.size();
+        this->respond("OK");
+        return;
+    }
+    this->stats.publishes++;
+    this->stats.publishbytes += this->lastpayload.size();
+    bool fail = this->sendfail || idx == this->failtopic ||
+                (this->failevery != 0 && this->stats.publishes % this->failevery == 0);
+    if(this->pubcb != NULL)
+        this->pubcb(this->pubctx, idx, this->lastpayload.data(), this->lastpayload.size(), !fail);
+    this->respond("OK");
+    this->queue(millis() + this->latency + this->acklatency, fail ? ":SEND FAIL\r\n" : ":SEND OK\r\n", true);
+}
@@ -0,0 +1,138 @@
+/***************************************************************************
+  Emulated Eseye Telemetry Module for host builds of eseyetelemetrymodule.
+
+  EtmEmulator is a Stream that stands in for the modem UART. Lines written
+  by the library are parsed as AT commands and answered with the same
+  OK/ERROR responses and +ETM/+EMQ URCs that a BG96 running ETM produces.
+  Responses are released after a configurable latency measured with
+  millis(), so both the real and the virtual host clock can be used.
+
+  Tests and benchmarks script the modem by injecting URCs, delivering
+  subscribed messages, forcing errors and hooking individual commands.
+ ***************************************************************************/
+
+#ifndef ETM_EMULATOR_H__
+#define ETM_EMULATOR_H__
+
+#include <deque>
+#include <string>
+#include <vector>
+#include "Arduino.h"
+
+#define EMU_MAX_TOPICS 32
+/* rawidx/lastpubidx for a datagram */
+#define EMU_UDP_IDX -2
+
+class EtmEmulator;
+
+/* Command hook - return true if the command has been answered by the hook */
+typedef bool (*_emucmdhook)(EtmEmulator *emu, const char *cmd, void *ctx);
+/* Called for each publish with whether it will be answered :SEND OK */
+typedef void (*_emupubcb)(void *ctx, int idx, const uint8_t *payload, size_t len, bool ok);
+
+struct emuStats{
+  unsigned long rxbytes;
+  unsigned long txbytes;
+  unsigned long commands;
+  unsigned long publishes;
+  unsigned long publishbytes;
+  unsigned long datagrams;
+  unsigned long datagrambytes;
+  unsigned long errors;
+  unsigned long writecalls;
+};
+
+class EtmEmulator : public Stream
+{
+public:
+    EtmEmulator();
+
+    /* Stream interface (modem side of the UART) */
+    int available();
+    int read();
+    int peek();
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+
+    /* Power-up sequence: APP RDY followed by +ETM:IDLE */
+    void boot(void);
+    /* Queue a line (CRLF appended) or raw bytes from the modem */
+    void inject(const char *line);
+    void injectraw(const uint8_t *data, size_t len);
+    /* Deliver a message on a subscribed topic index */
+    void deliver(int subidx, const uint8_t *payload, uint16_t len);
+    /* Deliver a datagram received in UDP mode */
+    void deliverdatagram(const uint8_t *payload, uint16_t len);
+
+    /* Delay between a command and its responses */
+    void setlatency(unsigned long ms);
+    /* Time from a publish's OK to its :SEND OK/FAIL (the broker round trip).
+     * Later responses overtake a :SEND OK/FAIL that is still waiting */
+    void setacklatency(unsigned long ms);
+    /* Answer publishes with :SEND FAIL instead of :SEND OK */
+    void setsendfail(bool fail);
+    /* Answer every nth publish with :SEND FAIL (0 for none) */
+    void setsendfailevery(unsigned long n);
+    /* Answer every publish on topic idx with :SEND FAIL (-1 for none) */
+    void setsendfailtopic(int idx);
+    void publishcb(_emupubcb cb, void *ctx);
+    /* Error code returned in the next PUBOPEN/SUBOPEN URCs (0 = success) */
+    void setopenerror(int err);
+    /* Answer every command with ERROR */
+    void seterror(bool error);
+    void commandhook(_emucmdhook hook, void *ctx);
+    /* Count written bytes without parsing them, answering each line with
+     * OK and :SEND OK (fast publish sink) */
+    void setdiscard(bool discard);
+    /* Drop all queued output and reset the emulated ETM state */
+    void reset(void);
+
+    /* Respond to a command after the configured latency */
+    void respond(const char *line);
+
+    struct emuStats stats;
+    /* Last published message or datagram (lastpubidx EMU_UDP_IDX) */
+    int lastpubidx;
+    std::vector<uint8_t> lastpayload;
+    bool mqttstarted;
+    bool udpstarted;
+    bool pubopen[EMU_MAX_TOPICS];
+    bool subopen[EMU_MAX_TOPICS];
+
+private:
+    struct pending{
+      unsigned long due;
+      std::string data;
+      bool ack;
+    };
+    std::deque<pending> output;
+    size_t outpos;
+    std::string cmdline;
+    unsigned long latency;
+    unsigned long acklatency;
+    bool sendfail;
+    unsigned long failevery;
+    int failtopic;
+    bool allerror;
+    bool discard;
+    /* Binary publish payload still to be received after the > prompt */
+    size_t rawremaining;
+    int rawidx;
+    int openerror;
+    _emucmdhook hook;
+    void *hookctx;
+    _emupubcb pubcb;
+    void *pubctx;
+
+    void queue(unsigned long due, const std::string &data, bool ack = false);
+    bool ready(void);
+    void command(const char *cmd);
+    void publishcmd(const char *args);
+    void publishdone(int idx);
+    void udpsendcmd(const char *args);
+    bool hexpayload(const char *hex);
+    void opencmd(const char *args, bool sub, bool open);
+};
+
+#endif // ETM_EMULATOR_H__
@@ -0,0 +1,459 @@
+/***************************************************************************
+  Replay an eseyeTrace capture (see etmtrace.h) through the library.
+
+  The bytes the modem sent are fed back through poll() at the times they
+  were captured, on the virtual clock. The commands in the captured output
+  are turned back into the library calls that made them (subscribe(),
+  pubreg(), publish(), updateState(), sendAT() ...) at the same times, and
+  what the library writes is compared byte for byte with the capture. A
+  matching replay reproduces the field session; a difference shows where
+  the library now behaves differently. The wall time of the replay can be
+  used as a performance regression figure.
+
+  Usage: etm_replay [-v] [-n repeats] trace     replay and compare
+         etm_replay -d trace                     print the trace as text
+         etm_replay -s trace                     capture a scripted session
+                                                 against the emulator
+  Exits non-zero if the replayed output differs from the capture.
+ ***************************************************************************/
+
+#include <time.h>
+#include <string>
+#include <vector>
+#include <list>
+#include "etm_emulator.h"
+#include "eseyetelemetrymodule.h"
+#include "etmtrace.h"
+
+struct tracerec{
+    unsigned long time;
+    bool tx;
+    std::string data;
+};
+
+static double now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static bool loadtrace(const char *path, std::vector<tracerec> *recs, unsigned long *basetime){
+    FILE *f = fopen(path, "rb");
+    if(f == NULL){
+        perror(path);
+        return false;
+    }
+    std::string raw;
+    char tmp[4096];
+    size_t n;
+    while((n = fread(tmp, 1, sizeof(tmp), f)) > 0)
+        raw.append(tmp, n);
+    fclose(f);
+    if(raw.size() < TRACE_HDRLEN || raw[0] != 'E' || raw[1] != 'T' || raw[2] != TRACE_VERSION){
+        fprintf(stderr, "%s: not an eseyeTrace capture\n", path);
+        return false;
+    }
+    const uint8_t *p = (const uint8_t *)raw.data();
+    unsigned long time = p[3] | (p[4] << 8) | ((unsigned long)p[5] << 16) | ((unsigned long)p[6] << 24);
+    *basetime = time;
+    size_t pos = TRACE_HDRLEN;
+    while(pos < raw.size()){
+        tracerec rec;
+        uint8_t tag = p[pos++];
+        unsigned long delta = 0;
+        int shift = 0;
+        uint8_t b;
+        do{
+            if(pos >= raw.size())
+                goto truncated;
+            b = p[pos++];
+            delta |= (unsigned long)(b & 0x7f) << shift;
+            shift += 7;
+        }while(b & 0x80);
+        if(pos + (tag & 0x7f) + 1 > raw.size())
+            goto truncated;
+        time += delta;
+        rec.time = time;
+        rec.tx = (tag & TRACE_TX) != 0;
+        rec.data.assign((const char *)&p[pos], (tag & 0x7f) + 1);
+        pos += rec.data.size();
+        recs->push_back(rec);
+    }
+    return true;
+truncated:
+    fprintf(stderr, "%s: truncated at byte %zu\n", path, pos);
+    return false;
+}
+
+static std::string printable(const std::string &s){
+    std::string out;
+    char tmp[8];
+    for(size_t i = 0; i < s.size(); i++){
+        uint8_t c = s[i];
+        if(c == '\r')
+            out += "\\r";
+        else if(c == '\n')
+            out += "\\n";
+        else if(c < 0x20 || c >= 0x7f){
+            snprintf(tmp, sizeof(tmp), "\\x%02X", c);
+            out += tmp;
+        }else{
+            out += (char)c;
+        }
+    }
+    return out;
+}
+
+static int decode(const std::vector<tracerec> &recs, unsigned long basetime){
+    for(size_t i = 0; i < recs.size(); i++){
+        printf("%10.3f %c %s\n", (recs[i].time - basetime) / 1000.0, recs[i].tx ? '>' : '<', printable(recs[i].data).c_str());
+    }
+    return 0;
+}
+
+/* Modem side of the replay - captured input is released once the virtual
+ * clock reaches it, and never ahead of the record being replayed */
+class ReplayStream : public Stream
+{
+public:
+    ReplayStream(const std::vector<tracerec> *recs) : recs(recs), next(0), offset(0), limit(0) { this->skip(); }
+
+    int available(){
+        if(this->next >= this->limit || this->next >= this->recs->size() || (*this->recs)[this->next].time > millis())
+            return 0;
+        return (*this->recs)[this->next].data.size() - this->offset;
+    }
+    int peek(){
+        if(this->available() == 0)
+            return -1;
+        return (uint8_t)(*this->recs)[this->next].data[this->offset];
+    }
+    int read(){
+        int c = this->peek();
+        if(c < 0)
+            return c;
+        if(++this->offset == (*this->recs)[this->next].data.size()){
+            this->next++;
+            this->offset = 0;
+            this->skip();
+        }
+        return c;
+    }
+    size_t write(uint8_t c){
+        this->written += (char)c;
+        return 1;
+    }
+    size_t write(const uint8_t *buffer, size_t size){
+        this->written.append((const char *)buffer, size);
+        return size;
+    }
+    using Print::write;
+
+    boolean pending(void){ return this->next < this->recs->size(); }
+
+    const std::vector<tracerec> *recs;
+    size_t next;
+    size_t offset;
+    /* Records before this index may be read */
+    size_t limit;
+    std::string written;
+
+private:
+    void skip(void){
+        while(this->next < this->recs->size() && (*this->recs)[this->next].tx)
+            this->next++;
+    }
+};
+
+static unsigned long msgs, msgbytes, urcs;
+static bool verbose;
+
+static void replaymsg(uint8_t *data, uint8_t length){
+    msgs++;
+    msgbytes += length;
+}
+
+static void replaydatagram(void *ctx, uint8_t *data, uint16_t length){
+    msgs++;
+    msgbytes += length;
+}
+
+static void replayurc(char *data){
+    urcs++;
+    if(verbose)
+        printf("  urc %s\n", data);
+}
+
+static int hexval(char c){
+    if(c >= '0' && c <= '9')
+        return c - '0';
+    if(c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if(c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* Turns the captured output back into library calls */
+struct replayer{
+    eseyeETM *etm;
+    ReplayStream *rs;
+    std::string tx;         /* All captured output */
+    size_t parsed;          /* Output turned into calls so far */
+    std::list<std::string> topics;
+    unsigned long calls;
+    unsigned long mismatched;
+
+    /* A line that ends at or before end - returns false if there isn't one */
+    bool nextline(size_t end, std::string *line){
+        size_t eol = this->tx.find("\r\n", this->parsed);
+        if(eol == std::string::npos || eol + 2 > end)
+            return false;
+        line->assign(this->tx, this->parsed, eol - this->parsed);
+        this->parsed = eol + 2;
+        return true;
+    }
+
+    void checkidx(const char *what, int expected, int got){
+        if(expected != got){
+            this->mismatched++;
+            if(verbose)
+                printf("  %s returned %d, capture used %d\n", what, got, expected);
+        }
+    }
+
+    void call(const std::string &line){
+        int idx, qos, len, n = 0;
+        char topic[256];
+        const char *s = line.c_str();
+        this->calls++;
+        if(verbose)
+            printf("%10lu call %s\n", millis(), printable(line).c_str());
+        if(line == "ATE0"){
+            /* Sent by the library itself on APP RDY */
+            this->calls--;
+        }else if(sscanf(s, "AT+EMQSUBOPEN=%d,\"%255[^\"]\"", &idx, topic) == 2){
+            this->topics.push_back(topic);
+            this->checkidx("subscribe", idx, this->etm->subscribe((char *)this->topics.back().c_str(), replaymsg));
+        }else if(sscanf(s, "AT+EMQPUBOPEN=%d,\"%255[^\"]\"", &idx, topic) == 2){
+            this->topics.push_back(topic);
+            this->checkidx("pubreg", idx, this->etm->pubreg((char *)this->topics.back().c_str()));
+        }else if(sscanf(s, "AT+EMQSUBCLOSE=%d", &idx) == 1){
+            this->etm->unsubscribe(idx);
+        }else if(sscanf(s, "AT+EMQPUBCLOSE=%d", &idx) == 1){
+            this->etm->pubunreg(idx);
+        }else if(sscanf(s, "AT+EMQPUBLISH=%d,%d,\"%n", &idx, &qos, &n) == 2 && n > 0){
+            std::vector<uint8_t> data;
+            for(size_t i = n; i + 1 < line.size() && line[i] != '"'; i += 2)
+                data.push_back(hexval(line[i]) << 4 | hexval(line[i + 1]));
+            this->etm->txencoding(ETM_ENC_HEX);
+            this->etm->publish(idx, qos, data.data(), data.size());
+        }else if(sscanf(s, "AT+EMQPUBLISH=%d,%d,%d", &idx, &qos, &len) == 3){
+            /* The raw payload follows the command in the capture */
+            std::vector<uint8_t> data(this->tx.begin() + this->parsed, this->tx.begin() + std::min(this->tx.size(), this->parsed + len));
+            this->parsed += data.size();
+            this->etm->txencoding(ETM_ENC_BINARY);
+            this->etm->publish(idx, qos, data.data(), data.size());
+        }else if(strncmp(s, "AT+EUDPSEND=\"", 13) == 0){
+            std::vector<uint8_t> data;
+            for(size_t i = 13; i + 1 < line.size() && line[i] != '"'; i += 2)
+                data.push_back(hexval(line[i]) << 4 | hexval(line[i + 1]));
+            this->etm->txencoding(ETM_ENC_HEX);
+            this->etm->sendDatagram(data.data(), data.size());
+        }else if(sscanf(s, "AT+EUDPSEND=%d", &len) == 1){
+            std::vector<uint8_t> data(this->tx.begin() + this->parsed, this->tx.begin() + std::min(this->tx.size(), this->parsed + len));
+            this->parsed += data.size();
+            this->etm->txencoding(ETM_ENC_BINARY);
+            this->etm->sendDatagram(data.data(), data.size());
+        }else if(line == "AT+ETMSTATE?"){
+            this->etm->updateState(ETM_STATE_ONCE);
+        }else if(line == "AT+ETMSTATE=1"){
+            this->etm->updateState(ETM_STATE_ON);
+        }else if(line == "AT+ETMSTATE=0"){
+            this->etm->updateState(ETM_STATE_OFF);
+        }else if(line == "AT+ETMSTATE=startmqtt"){
+            this->etm->startproto(ETM_MQTT);
+        }else if(line == "AT+ETMSTATE=startudp"){
+            this->etm->startproto(ETM_UDP);
+        }else{
+            std::string cmd = line + "\r\n";
+            this->etm->sendAT((char *)cmd.c_str());
+        }
+    }
+};
+
+static int replay(const std::vector<tracerec> &recs, unsigned long basetime, int repeats){
+    double best = 0;
+    bool same = true;
+    for(int r = 0; r < repeats; r++){
+        host_clock_virtual(true);
+        host_clock_set(basetime);
+        ReplayStream rs(&recs);
+        eseyeETM etm(&rs);
+        struct replayer rp;
+        struct etmstats st;
+        rp.etm = &etm;
+        rp.rs = &rs;
+        rp.parsed = 0;
+        rp.calls = 0;
+        rp.mismatched = 0;
+        msgs = msgbytes = urcs = 0;
+        for(size_t i = 0; i < recs.size(); i++){
+            if(recs[i].tx)
+                rp.tx += recs[i].data;
+        }
+
+        double start = now_us();
+        etm.init(replayurc);
+        etm.datagramcb(replaydatagram);
+        size_t txend = 0;
+        std::string line;
+        for(size_t i = 0; i < recs.size(); i++){
+            if((long)(recs[i].time - millis()) > 0)
+                host_clock_set(recs[i].time);
+            if(recs[i].tx){
+                /* Calls may wait for the modem, so let input flow by time alone */
+                txend += recs[i].data.size();
+                rs.limit = recs.size();
+                while(rp.nextline(txend, &line))
+                    rp.call(line);
+            }else{
+                rs.limit = i + 1;
+            }
+            etm.poll();
+        }
+        rs.limit = recs.size();
+        while(rs.pending()){
+            host_clock_advance(1);
+            etm.poll();
+        }
+        double elapsed = now_us() - start;
+        if(r == 0 || elapsed < best)
+            best = elapsed;
+        if(r > 0)
+            continue;
+
+        etm.stats(&st, false);
+        size_t rxbytes = 0;
+        for(size_t i = 0; i < recs.size(); i++){
+            if(!recs[i].tx)
+                rxbytes += recs[i].data.size();
+        }
+        printf("records %zu, %.3f s, %zu bytes in, %zu bytes out\n", recs.size(),
+               recs.empty() ? 0.0 : (recs.back().time - basetime) / 1000.0, rxbytes, rp.tx.size());
+        printf("calls %lu, lines %lu, urcs %lu, messages %lu (%lu bytes), timeouts %u, send ok %u fail %u\n",
+               rp.calls, (unsigned long)st.lines, urcs, msgs, msgbytes, st.timeouts, st.sendok, st.sendfail);
+        if(rp.mismatched > 0)
+            printf("%lu topic indexes differ from the capture\n", rp.mismatched);
+        if(rs.written == rp.tx){
+            printf("output matches the capture\n");
+        }else{
+            size_t at = 0;
+            while(at < rs.written.size() && at < rp.tx.size() && rs.written[at] == rp.tx[at])
+                at++;
+            size_t from = at > 20 ? at - 20 : 0;
+            printf("output differs at byte %zu of %zu\n", at, rp.tx.size());
+            printf("  capture: %s\n", printable(rp.tx.substr(from, 60)).c_str());
+            printf("  replay:  %s\n", printable(rs.written.substr(from, 60)).c_str());
+            same = false;
+        }
+    }
+    printf("replay took %.1f us%s\n", best, repeats > 1 ? " (best)" : "");
+    return same ? 0 : 1;
+}
+
+/* Writes a dump() to a file */
+class FilePrint : public Print
+{
+public:
+    FilePrint(FILE *f) : f(f) {}
+    size_t write(uint8_t c){ return fwrite(&c, 1, 1, this->f); }
+    size_t write(const uint8_t *buffer, size_t size){ return fwrite(buffer, 1, size, this->f); }
+    using Print::write;
+private:
+    FILE *f;
+};
+
+/* A short session covering the commands the replayer understands */
+static int synthesise(const char *path){
+    static uint8_t tracebuf[16384];
+    EtmEmulator emu;
+    eseyeTrace trace(&emu, tracebuf, sizeof(tracebuf));
+    eseyeETM etm(&trace);
+    uint8_t payload[40];
+
+    host_clock_virtual(true);
+    host_clock_set(100000);
+    trace.clear();
+    emu.setlatency(20);
+    emu.boot();
+    etm.init();
+    while(!isdone(etm.urcseen, ETM_IDLE))
+        etm.poll();
+    etm.startproto(ETM_MQTT);
+    etm.waitSync();
+    while(!isdone(etm.urcseen, ETM_MQTT_RDY))
+        etm.poll();
+    etm.updateState(ETM_STATE_ONCE);
+    int sub = etm.subscribeconfirm((char *)"update", replaymsg);
+    int pub = etm.pubregconfirm((char *)"Temperature");
+    for(int i = 0; i < 10; i++){
+        snprintf((char *)payload, sizeof(payload), "{\"t\":%d.%d}", 20 + i, i);
+        etm.txencoding(i & 1 ? ETM_ENC_BINARY : ETM_ENC_HEX);
+        etm.publishconfirm(pub, 1, payload, strlen((char *)payload));
+        emu.deliver(sub, payload, strlen((char *)payload));
+        unsigned long start = millis();
+        while(millis() - start < 500){
+            host_clock_advance(1);
+            etm.poll();
+        }
+    }
+    etm.pubunreg(pub);
+    etm.unsubscribe(sub);
+    etm.waitSync();
+    for(int i = 0; i < 100; i++){
+        host_clock_advance(1);
+        etm.poll();
+    }
+
+    FILE *f = fopen(path, "wb");
+    if(f == NULL){
+        perror(path);
+        return 1;
+    }
+    FilePrint out(f);
+    uint32_t n = trace.dump(&out);
+    fclose(f);
+    printf("%s: %lu bytes, %u dropped records\n", path, (unsigned long)n, trace.dropped());
+    return 0;
+}
+
+int main(int argc, char **argv){
+    int repeats = 1;
+    char mode = 'r';
+    int i;
+    for(i = 1; i < argc && argv[i][0] == '-'; i++){
+        if(strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else if(strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "-s") == 0)
+            mode = argv[i][1];
+        else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            repeats = atoi(argv[++i]);
+        else
+            break;
+    }
+    if(i != argc - 1 || repeats < 1){
+        fprintf(stderr, "usage: etm_replay [-v] [-n repeats] trace | -d trace | -s trace\n");
+        return 2;
+    }
+    if(mode == 's')
+        return synthesise(argv[i]);
+
+    std::vector<tracerec> recs;
+    unsigned long basetime;
+    if(!loadtrace(argv[i], &recs, &basetime))
+        return 2;
+    if(mode == 'd')
+        return decode(recs, basetime);
+    return replay(recs, basetime, repeats);
+}
@@ -0,0 +1,138 @@
+/***************************************************************************
+  Stress test for eseyeRxRing on the host.
+
+  A producer thread stands in for the uart interrupt and puts subscribed
+  messages, each carrying a sequence number, into the ring while the main
+  thread parses them with poll() and stalls now and then like a sketch
+  reading a slow sensor.
+
+    lossless - the producer waits while the ring is full, so every message
+               must arrive, in order and intact
+    overrun  - the producer drops bytes when the ring is full, as an ISR
+               would; the parser must recover and the ring must count the
+               loss and report a full high-water mark
+
+  Usage: etm_ringstress [messages]
+  Exits non-zero if a check fails.
+ ***************************************************************************/
+
+#include <atomic>
+#include <thread>
+#include <time.h>
+#include "etm_emulator.h"
+#include "eseyetelemetrymodule.h"
+#include "etmring.h"
+
+#define RING_SIZE 256
+#define MSG_LEN   24
+
+typedef eseyeRxRing<RING_SIZE> hostring;
+
+static unsigned long received, badmsgs, outoforder, nextseq;
+
+/* Payload is "seq=%010lu" padded with '.' to MSG_LEN */
+static void checkmsg(uint8_t *data, uint8_t length){
+    char text[MSG_LEN + 1];
+    unsigned long seq;
+    received++;
+    if(length != MSG_LEN){
+        badmsgs++;
+        return;
+    }
+    memcpy(text, data, MSG_LEN);
+    text[MSG_LEN] = 0;
+    if(sscanf(text, "seq=%lu", &seq) != 1){
+        badmsgs++;
+        return;
+    }
+    for(int i = 14; i < MSG_LEN; i++){
+        if(text[i] != '.'){
+            badmsgs++;
+            return;
+        }
+    }
+    if(seq != nextseq)
+        outoforder++;
+    nextseq = seq + 1;
+}
+
+static std::string message(unsigned long seq){
+    char hdr[24], body[MSG_LEN + 1];
+    snprintf(hdr, sizeof(hdr), "+EMQ:0,%d\r\n", MSG_LEN);
+    snprintf(body, sizeof(body), "seq=%010lu", seq);
+    memset(body + 14, '.', MSG_LEN - 14);
+    return std::string(hdr) + std::string(body, MSG_LEN);
+}
+
+static void produce(hostring *ring, unsigned long count, bool wait, std::atomic<bool> *done){
+    for(unsigned long seq = 0; seq < count; seq++){
+        std::string msg = message(seq);
+        for(size_t i = 0; i < msg.size(); i++){
+            while(wait && ring->space() == 0)
+                std::this_thread::yield();
+            ring->put((uint8_t)msg[i]);
+        }
+        /* Bursts with a gap now and then */
+        if((seq & 63) == 63)
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    done->store(true);
+}
+
+/* Subscribe through the ring, pumping the emulator's replies in by hand */
+static void startsession(eseyeETM *etm, EtmEmulator *emu, hostring *ring){
+    emu->boot();
+    etm->init();
+    while(!isdone(etm->urcseen, ETM_IDLE)){
+        ring->pump();
+        etm->poll();
+    }
+    etm->startproto(ETM_MQTT);
+    while(!isdone(etm->urcseen, ETM_MQTT_RDY) || etm->inSync() == false){
+        ring->pump();
+        etm->poll();
+    }
+    int idx = etm->subscribe((char *)"stress", checkmsg);
+    while(etm->substate(idx) != SUB_TOPIC_SUBSCRIBED || etm->inSync() == false){
+        ring->pump();
+        etm->poll();
+    }
+}
+
+static bool run(const char *name, unsigned long count, bool wait){
+    EtmEmulator emu;
+    hostring ring(&emu);
+    eseyeETM etm(&ring);
+    std::atomic<bool> done(false);
+    unsigned long polls = 0;
+
+    startsession(&etm, &emu, &ring);
+    ring.resetstats();
+    received = badmsgs = outoforder = nextseq = 0;
+
+    std::thread producer(produce, &ring, count, wait, &done);
+    while(done.load() == false || ring.available() > 0){
+        etm.poll();
+        /* A slow sensor read every so often */
+        if((++polls & 1023) == 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(wait ? 200 : 2000));
+    }
+    producer.join();
+    etm.poll();
+
+    printf("%-9s sent %lu received %lu bad %lu out-of-order %lu highwater %u/%u overruns %u\n",
+           name, count, received, badmsgs, outoforder, ring.highwater(), ring.capacity(), ring.overruns());
+    if(wait)
+        return received == count && badmsgs == 0 && outoforder == 0 && ring.overruns() == 0;
+    /* Lost bytes may corrupt the odd message, but parsing must carry on */
+    return ring.overruns() > 0 && ring.highwater() == ring.capacity() && received > 0;
+}
+
+int main(int argc, char **argv){
+    unsigned long count = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    bool ok = true;
+    ok &= run("lossless", count, true);
+    ok &= run("overrun", count / 10, false);
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Report the code and RAM footprint of the library in a few configurations.
+#
+#   ./footprint.sh                 host compiler
+#   CXX=avr-g++ SIZE=avr-size CPPFLAGS="-mmcu=atmega328p -I<core> -I<variant>" ./footprint.sh
+#
+# text/data/bss are for the library object alone. data+bss is the static RAM
+# used, the instance sizes are what each eseyeETMSized<> object adds on top.
+
+CXX=${CXX:-g++}
+SIZE=${SIZE:-size}
+LIBDIR=$(dirname "$0")/../..
+HOSTDIR=$(dirname "$0")
+TMP=${TMPDIR:-/tmp}/etm_footprint.$$
+mkdir -p "$TMP"
+trap 'rm -rf "$TMP"' EXIT
+
+# The host shim stands in for the Arduino core unless the caller supplies one
+case "$CPPFLAGS" in
+  *-I*) INC="-I$LIBDIR" ;;
+  *)    INC="-I$HOSTDIR -I$LIBDIR" ;;
+esac
+
+FULL="-DFILTER_OK -DDEBUG_ESEYETELEMETRYMODULE -DTIMEOUT_RESPONSES -DPUB_QUEUE -DPUB_RETRY -DBINARY_TRANSFER -DPUB_FILTER -DSTORE_FORWARD -DUDP_TRANSFER -DSESSION_RECOVERY -DETM_STATS"
+
+config() {
+  name=$1; shift
+  flags="-DARDUINO=100 -DETM_CUSTOM_CONFIG $*"
+  if ! $CXX $CPPFLAGS $INC $flags -Os -c -o "$TMP/$name.o" "$LIBDIR/eseyetelemetrymodule.cpp"; then
+    echo "$name: build failed"
+    return
+  fi
+  sizes=$($SIZE "$TMP/$name.o" | awk 'NR==2 { print $1, $2, $3 }')
+  inst=""
+  cat > "$TMP/inst.cpp" <<EOF
+#include <stdio.h>
+#include "eseyetelemetrymodule.h"
+int main(void){
+  printf("%u %u\n", (unsigned)sizeof(eseyeETM), (unsigned)sizeof(eseyeETMSized<1, 1, 64, 0>));
+  return 0;
+}
+EOF
+  # Instance sizes can only be measured when the compiler targets this machine
+  if [ "$CXX" = "g++" ] || [ "$CXX" = "c++" ] || [ "$CXX" = "clang++" ]; then
+    if $CXX $CPPFLAGS $INC $flags -o "$TMP/inst" "$TMP/inst.cpp" 2>/dev/null; then
+      inst=$("$TMP/inst")
+    fi
+  fi
+  set -- $sizes $inst
+  printf "%-10s %8s %8s %8s %10s %10s\n" "$name" "$1" "$2" "$3" "${4:--}" "${5:--}"
+}
+
+printf "%-10s %8s %8s %8s %10s %10s\n" config text data bss eseyeETM "<1,1,64,0>"
+config full    $FULL
+config nodebug -DFILTER_OK -DTIMEOUT_RESPONSES -DPUB_QUEUE -DPUB_RETRY -DBINARY_TRANSFER -DPUB_FILTER -DSTORE_FORWARD -DUDP_TRANSFER -DSESSION_RECOVERY -DETM_STATS
+config noqueue -DFILTER_OK -DTIMEOUT_RESPONSES -DBINARY_TRANSFER
+config minimal -DFILTER_OK
+config bare
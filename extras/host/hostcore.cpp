@@ -0,0 +1,90 @@
+/***************************************************************************
+  Host implementation of the Arduino timing and pin API used by the
+  eseyetelemetrymodule library host build.
+ ***************************************************************************/
+
+#include <time.h>
+#include "Arduino.h"
+
+#define HOST_MAX_PINS 128
+
+static bool clockvirtual = false;
+static unsigned long virtualms = 0;
+static unsigned long yieldstep = 1;
+static void (*yieldhook)(void *ctx) = NULL;
+static void *yieldctx = NULL;
+static uint8_t pinlevel[HOST_MAX_PINS];
+
+static unsigned long long monotonic_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+unsigned long millis(void){
+    if(clockvirtual)
+        return virtualms;
+    return (unsigned long)(monotonic_us() / 1000);
+}
+
+unsigned long micros(void){
+    if(clockvirtual)
+        return virtualms * 1000UL;
+    return (unsigned long)monotonic_us();
+}
+
+void delay(unsigned long ms){
+    unsigned long start = millis();
+    if(clockvirtual){
+        virtualms += ms;
+        if(yieldhook != NULL)
+            yieldhook(yieldctx);
+        return;
+    }
+    while(millis() - start < ms)
+        yield();
+}
+
+void yield(void){
+    if(clockvirtual)
+        virtualms += yieldstep;
+    if(yieldhook != NULL)
+        yieldhook(yieldctx);
+}
+
+void host_clock_virtual(bool enable){
+    clockvirtual = enable;
+}
+
+void host_clock_set(unsigned long ms){
+    virtualms = ms;
+}
+
+void host_clock_advance(unsigned long ms){
+    virtualms += ms;
+}
+
+void host_clock_yieldstep(unsigned long ms){
+    yieldstep = ms;
+}
+
+void host_yield_hook(void (*hook)(void *ctx), void *ctx){
+    yieldhook = hook;
+    yieldctx = ctx;
+}
+
+void pinMode(uint8_t pin, uint8_t mode){
+    (void)pin;
+    (void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val){
+    if(pin < HOST_MAX_PINS)
+        pinlevel[pin] = val;
+}
+
+int digitalRead(uint8_t pin){
+    if(pin < HOST_MAX_PINS)
+        return pinlevel[pin];
+    return LOW;
+}
@@ -0,0 +1,60 @@
+/***************************************************************************
+  File backed eseyeStore for host builds of eseyetelemetrymodule.
+ ***************************************************************************/
+
+#include "hoststore.h"
+
+/* File layout: a header of magic, record size, record count, head and count
+ * (16-bit little endian each) followed by the records */
+#define HOSTSTORE_HDRLEN 10
+
+HostFileStore::HostFileStore(const char *path, uint16_t records, uint16_t recsize){
+    this->records = records;
+    this->size = recsize;
+    this->fp = fopen(path, "r+b");
+    if(this->fp == NULL)
+        this->fp = fopen(path, "w+b");
+}
+
+HostFileStore::~HostFileStore(){
+    if(this->fp != NULL)
+        fclose(this->fp);
+}
+
+bool HostFileStore::io(long offset, void *buf, size_t len, bool write){
+    if(this->fp == NULL || fseek(this->fp, offset, SEEK_SET) != 0)
+        return false;
+    if(write)
+        return fwrite(buf, 1, len, this->fp) == len && fflush(this->fp) == 0;
+    return fread(buf, 1, len, this->fp) == len;
+}
+
+boolean HostFileStore::readrec(uint16_t slot, uint8_t *rec){
+    return this->io(HOSTSTORE_HDRLEN + (long)slot * this->size, rec, this->size, false);
+}
+
+boolean HostFileStore::writerec(uint16_t slot, const uint8_t *rec){
+    return this->io(HOSTSTORE_HDRLEN + (long)slot * this->size, (void *)rec, this->size, true);
+}
+
+boolean HostFileStore::load(uint16_t *head, uint16_t *count){
+    uint8_t hdr[HOSTSTORE_HDRLEN];
+    if(this->io(0, hdr, sizeof(hdr), false) == false)
+        return false;
+    if(hdr[0] != 'E' || hdr[1] != 'S')
+        return false;
+    if((hdr[2] | (hdr[3] << 8)) != this->size || (hdr[4] | (hdr[5] << 8)) != this->records)
+        return false;
+    *head = hdr[6] | (hdr[7] << 8);
+    *count = hdr[8] | (hdr[9] << 8);
+    return *head < this->records && *count <= this->records;
+}
+
+void HostFileStore::save(uint16_t head, uint16_t count){
+    uint8_t hdr[HOSTSTORE_HDRLEN] = {'E', 'S',
+        (uint8_t)this->size, (uint8_t)(this->size >> 8),
+        (uint8_t)this->records, (uint8_t)(this->records >> 8),
+        (uint8_t)head, (uint8_t)(head >> 8),
+        (uint8_t)count, (uint8_t)(count >> 8)};
+    this->io(0, hdr, sizeof(hdr), true);
+}
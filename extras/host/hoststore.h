@@ -0,0 +1,36 @@
+/***************************************************************************
+  File backed eseyeStore for host builds of eseyetelemetrymodule.
+
+  Keeps store-and-forward records, and the ring position, in a file so a
+  host program can be stopped and restarted without losing publishes -
+  the host equivalent of eseyePageStore on EEPROM.
+ ***************************************************************************/
+
+#ifndef HOSTSTORE_H__
+#define HOSTSTORE_H__
+
+#include <stdio.h>
+#include "etmstore.h"
+
+class HostFileStore : public eseyeStore
+{
+public:
+    HostFileStore(const char *path, uint16_t records, uint16_t recsize);
+    ~HostFileStore();
+    bool isopen(void) { return this->fp != NULL; }
+
+    uint16_t capacity(void) { return this->records; }
+    uint16_t recsize(void) { return this->size; }
+    boolean readrec(uint16_t slot, uint8_t *rec);
+    boolean writerec(uint16_t slot, const uint8_t *rec);
+    boolean load(uint16_t *head, uint16_t *count);
+    void save(uint16_t head, uint16_t count);
+
+private:
+    FILE *fp;
+    uint16_t records;
+    uint16_t size;
+    bool io(long offset, void *buf, size_t len, bool write);
+};
+
+#endif // HOSTSTORE_H__
@@ -0,0 +1,271 @@
+/***************************************************************************
+  Gateway load test for the Linux backend.
+
+  Creates one pty per modem and runs an emulated ETM modem (etm_emulator)
+  on the master side of each, all from one "modem bank" thread. The
+  library side opens the pty slaves with PosixSerial, exactly as it would
+  /dev/ttyUSBn, and an EtmReactor drives every eseyeETM instance from a
+  few threads. Each node starts MQTT, registers a publish topic and a
+  subscription with the asynchronous calls, then publishes its messages
+  while the bank delivers messages to it.
+
+  Reports wall time, message rates and the reactor threads' CPU time, and
+  exits non-zero if any node failed or the run did not finish in time.
+
+  Usage: etm_gateway [-m modems] [-t threads] [-n messages] [-i interval ms]
+ ***************************************************************************/
+
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include "etm_emulator.h"
+#include "etmreactor.h"
+
+#define GW_DELIVERMS  50
+#define GW_RUNLIMIT   60000UL
+#define GW_INFLIGHT   4
+
+/* Node states */
+#define NODE_BOOT     0
+#define NODE_START    1
+#define NODE_OPEN     2
+#define NODE_RUN      3
+#define NODE_DONE     4
+#define NODE_FAILED   5
+
+struct node{
+  eseyeETM *etm;
+  int state;
+  int pubop;
+  int subop;
+  int pubidx;
+  int sent;
+  int acked;
+  int failed;
+  int inflight;
+  unsigned long received;
+  unsigned long last;
+};
+
+struct bank{
+  std::vector<EtmEmulator *> emu;
+  std::vector<int> master;
+  std::vector<std::string> pending;
+  std::atomic<bool> running;
+};
+
+static int messages = 50;
+static unsigned long interval = 20;
+static std::atomic<int> finished(0);
+
+static void pubdone(void *ctx, int op, int result){
+    struct node *n = (struct node *)ctx;
+    n->inflight--;
+    if(result < 0)
+        n->failed++;
+    else
+        n->acked++;
+}
+
+static void cmdmsg(void *ctx, int idx, uint8_t *data, uint16_t length){
+    ((struct node *)ctx)->received++;
+}
+
+static void finish(struct node *n, int state){
+    n->state = state;
+    finished++;
+}
+
+/* The application's loop() for one modem - runs on its reactor thread */
+static void nodeloop(eseyeETMBase *etm, void *ctx){
+    struct node *n = (struct node *)ctx;
+    uint8_t payload[24];
+
+    switch(n->state){
+    case NODE_BOOT:
+        if(isdone(etm->urcseen, ETM_IDLE)){
+            etm->startproto(ETM_MQTT);
+            n->state = NODE_START;
+        }
+        break;
+    case NODE_START:
+        if(isdone(etm->urcseen, ETM_MQTT_RDY)){
+            etm->topicreg("gw/cmd", cmdmsg, n);
+            n->pubop = etm->pubregasync((char *)"gw/data");
+            n->subop = etm->subscribeasync((char *)"gw/cmd", NULL);
+            if(n->pubop < 0 || n->subop < 0)
+                finish(n, NODE_FAILED);
+            else
+                n->state = NODE_OPEN;
+        }
+        break;
+    case NODE_OPEN:
+        if(etm->opready(n->pubop) && etm->opready(n->subop)){
+            n->pubidx = etm->opresult(n->pubop);
+            if(n->pubidx < 0 || etm->opresult(n->subop) < 0)
+                finish(n, NODE_FAILED);
+            else
+                n->state = NODE_RUN;
+        }
+        break;
+    case NODE_RUN:
+        if(n->sent < messages && n->inflight < GW_INFLIGHT && millis() - n->last >= interval){
+            int len = snprintf((char *)payload, sizeof(payload), "{\"seq\":%d}", n->sent);
+            if(etm->publishasync(n->pubidx, 1, payload, len, pubdone, n) >= 0){
+                n->sent++;
+                n->inflight++;
+                n->last = millis();
+            }
+        }
+        if(n->acked + n->failed == messages)
+            finish(n, n->failed ? NODE_FAILED : NODE_DONE);
+        break;
+    }
+}
+
+/* Open a pty pair - returns the master fd and the slave path */
+static int openpty(std::string *path){
+    int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    if(grantpt(fd) != 0 || unlockpt(fd) != 0){
+        close(fd);
+        return -1;
+    }
+    *path = ptsname(fd);
+    return fd;
+}
+
+/* Move bytes between the pty masters and the emulated modems */
+static void bankrun(struct bank *b){
+    struct epoll_event ev, events[64];
+    uint8_t buf[512];
+    unsigned long lastdeliver = millis();
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    for(size_t i = 0; i < b->master.size(); i++){
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, b->master[i], &ev);
+    }
+    for(size_t i = 0; i < b->emu.size(); i++)
+        b->emu[i]->boot();
+
+    while(b->running){
+        /* 1ms so the emulators' queued responses go out on time */
+        int n = epoll_wait(epfd, events, 64, 1);
+        for(int i = 0; i < n; i++){
+            int idx = events[i].data.u32;
+            ssize_t len;
+            while((len = read(b->master[idx], buf, sizeof(buf))) > 0)
+                b->emu[idx]->write(buf, len);
+        }
+        bool deliver = millis() - lastdeliver >= GW_DELIVERMS;
+        if(deliver)
+            lastdeliver = millis();
+        for(size_t i = 0; i < b->emu.size(); i++){
+            EtmEmulator *emu = b->emu[i];
+            if(deliver && emu->subopen[0])
+                emu->deliver(0, (const uint8_t *)"{\"cmd\":\"ping\"}", 14);
+            while(emu->available() > 0)
+                b->pending[i] += (char)emu->read();
+            if(b->pending[i].empty())
+                continue;
+            ssize_t len = write(b->master[i], b->pending[i].data(), b->pending[i].size());
+            if(len > 0)
+                b->pending[i].erase(0, len);
+        }
+    }
+    close(epfd);
+}
+
+int main(int argc, char **argv){
+    int modems = 48;
+    int threads = 2;
+    int opt;
+    struct bank b;
+    struct reactorstats st;
+
+    while((opt = getopt(argc, argv, "m:t:n:i:")) != -1){
+        switch(opt){
+        case 'm': modems = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'n': messages = atoi(optarg); break;
+        case 'i': interval = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "usage: %s [-m modems] [-t threads] [-n messages] [-i interval ms]\n", argv[0]);
+            return 2;
+        }
+    }
+    if(modems < 1 || threads < 1 || messages < 1){
+        fprintf(stderr, "modems, threads and messages must be at least 1\n");
+        return 2;
+    }
+
+    std::vector<PosixSerial *> ports;
+    std::vector<struct node> nodes(modems);
+    EtmReactor gw(threads, 20);
+    for(int i = 0; i < modems; i++){
+        std::string path;
+        int fd = openpty(&path);
+        PosixSerial *port = new PosixSerial();
+        if(fd < 0 || !port->open(path.c_str(), 115200)){
+            fprintf(stderr, "pty %d: %s\n", i, strerror(errno));
+            return 1;
+        }
+        b.master.push_back(fd);
+        b.emu.push_back(new EtmEmulator());
+        b.pending.push_back(std::string());
+        ports.push_back(port);
+        memset(&nodes[i], 0, sizeof(nodes[i]));
+        nodes[i].etm = new eseyeETM(port);
+        nodes[i].etm->init();
+        gw.add(nodes[i].etm, port, nodeloop, &nodes[i]);
+    }
+
+    unsigned long start = millis();
+    b.running = true;
+    std::thread modembank(bankrun, &b);
+    gw.start();
+    while(finished < modems && millis() - start < GW_RUNLIMIT)
+        delay(10);
+    unsigned long elapsed = millis() - start;
+    gw.stop();
+    b.running = false;
+    modembank.join();
+
+    unsigned long acked = 0, failed = 0, received = 0;
+    int done = 0;
+    for(int i = 0; i < modems; i++){
+        acked += nodes[i].acked;
+        failed += nodes[i].failed;
+        received += nodes[i].received;
+        if(nodes[i].state == NODE_DONE)
+            done++;
+    }
+    gw.stats(&st);
+    printf("modems %d, reactor threads %d, %d messages each every %lums\n", modems, threads, messages, interval);
+    printf("%-28s %14lu ms\n", "elapsed", elapsed);
+    printf("%-28s %14d of %d\n", "nodes done", done, modems);
+    printf("%-28s %14lu (%lu failed)\n", "publishes acked", acked, failed);
+    printf("%-28s %14.1f msg/s\n", "publish rate", elapsed ? acked * 1000.0 / elapsed : 0.0);
+    printf("%-28s %14lu\n", "messages received", received);
+    printf("%-28s %14lu (%lu readable, %lu timed polls)\n", "reactor wakeups", st.wakeups, st.readable, st.timed);
+    printf("%-28s %14lu ms (%.1f%% of one core)\n", "reactor cpu", st.cpums, elapsed ? st.cpums * 100.0 / elapsed : 0.0);
+    if(st.cpums > 0)
+        printf("%-28s %14.0f\n", "modems per core at this load", modems * (double)elapsed / st.cpums);
+
+    for(int i = 0; i < modems; i++){
+        delete nodes[i].etm;
+        delete ports[i];
+        delete b.emu[i];
+        close(b.master[i]);
+    }
+    return done == modems ? 0 : 1;
+}
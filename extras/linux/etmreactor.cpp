@@ -0,0 +1,189 @@
+/***************************************************************************
+  epoll reactor driving many eseyeETM instances on a Linux gateway.
+ ***************************************************************************/
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "etmreactor.h"
+
+/* epoll data for a worker's wake-up eventfd - modems use their index */
+#define REACTOR_WAKE 0xffffffffU
+#define REACTOR_MAXEVENTS 64
+
+EtmReactor::EtmReactor(int threads, unsigned long tickms) : running(false){
+    this->tickms = tickms;
+    if(threads < 1)
+        threads = 1;
+    for(int i = 0; i < threads; i++){
+        worker *w = new worker;
+        w->epfd = -1;
+        w->wakefd = -1;
+        memset(&w->st, 0, sizeof(w->st));
+        this->workers.push_back(w);
+    }
+}
+
+EtmReactor::~EtmReactor(){
+    this->stop();
+    for(size_t i = 0; i < this->workers.size(); i++)
+        delete this->workers[i];
+}
+
+int EtmReactor::add(eseyeETMBase *etm, PosixSerial *port, _reactorcb loop, void *ctx){
+    if(this->running || etm == NULL || port == NULL || port->fd() < 0)
+        return -1;
+    modem m;
+    m.etm = etm;
+    m.port = port;
+    m.loop = loop;
+    m.ctx = ctx;
+    /* Spread modems over the workers */
+    m.worker = this->modems.size() % this->workers.size();
+    m.attached = false;
+    this->modems.push_back(m);
+    this->workers[m.worker]->modems.push_back(this->modems.size() - 1);
+    return this->modems.size() - 1;
+}
+
+bool EtmReactor::start(void){
+    struct epoll_event ev;
+    if(this->running)
+        return false;
+    for(size_t i = 0; i < this->workers.size(); i++){
+        worker *w = this->workers[i];
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(w->epfd < 0 || w->wakefd < 0)
+            return false;
+        ev.events = EPOLLIN;
+        ev.data.u32 = REACTOR_WAKE;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev);
+        for(size_t j = 0; j < w->modems.size(); j++){
+            modem *m = &this->modems[w->modems[j]];
+            ev.events = EPOLLIN;
+            ev.data.u32 = w->modems[j];
+            m->attached = epoll_ctl(w->epfd, EPOLL_CTL_ADD, m->port->fd(), &ev) == 0;
+        }
+    }
+    this->running = true;
+    for(size_t i = 0; i < this->workers.size(); i++)
+        this->workers[i]->thread = std::thread(&EtmReactor::run, this, this->workers[i]);
+    return true;
+}
+
+void EtmReactor::stop(void){
+    uint64_t one = 1;
+    if(this->running == false)
+        return;
+    this->running = false;
+    for(size_t i = 0; i < this->workers.size(); i++){
+        if(write(this->workers[i]->wakefd, &one, sizeof(one)) < 0){
+            /* The counter can't overflow, so this is never reached */
+        }
+    }
+    for(size_t i = 0; i < this->workers.size(); i++){
+        worker *w = this->workers[i];
+        if(w->thread.joinable())
+            w->thread.join();
+        close(w->epfd);
+        close(w->wakefd);
+        w->epfd = -1;
+        w->wakefd = -1;
+    }
+}
+
+bool EtmReactor::post(int modem, _reactorcb cb, void *ctx){
+    uint64_t one = 1;
+    if(modem < 0 || (size_t)modem >= this->modems.size() || cb == NULL)
+        return false;
+    worker *w = this->workers[this->modems[modem].worker];
+    {
+        std::lock_guard<std::mutex> guard(w->lock);
+        w->queue.push_back({modem, cb, ctx});
+    }
+    return w->wakefd < 0 || write(w->wakefd, &one, sizeof(one)) == sizeof(one);
+}
+
+void EtmReactor::stats(struct reactorstats *total){
+    memset(total, 0, sizeof(*total));
+    for(size_t i = 0; i < this->workers.size(); i++){
+        total->wakeups += this->workers[i]->st.wakeups;
+        total->readable += this->workers[i]->st.readable;
+        total->timed += this->workers[i]->st.timed;
+        total->cpums += this->workers[i]->st.cpums;
+    }
+}
+
+/* poll() one modem and run its loop */
+void EtmReactor::service(int idx, bool readable, worker *w){
+    modem *m = &this->modems[idx];
+    m->etm->poll();
+    if(readable)
+        w->st.readable++;
+    else
+        w->st.timed++;
+    /* A port that has gone away reads as always ready - stop watching it */
+    if(m->port->failed() && m->attached){
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, m->port->fd(), NULL);
+        m->attached = false;
+    }
+    if(m->loop != NULL)
+        m->loop(m->etm, m->ctx);
+}
+
+void EtmReactor::run(worker *w){
+    struct epoll_event events[REACTOR_MAXEVENTS];
+    std::vector<posted> calls;
+    unsigned long lasttick = millis();
+    struct timespec cpu;
+
+    while(this->running){
+        /* Sleep until input, a posted call, the tick or the nearest library deadline */
+        unsigned long now = millis();
+        unsigned long elapsed = now - lasttick;
+        unsigned long timeout = elapsed >= this->tickms ? 0 : this->tickms - elapsed;
+        for(size_t i = 0; i < w->modems.size() && timeout > 0; i++){
+            unsigned long due = this->modems[w->modems[i]].etm->nextdeadline();
+            if(due < timeout)
+                timeout = due;
+        }
+        int n = epoll_wait(w->epfd, events, REACTOR_MAXEVENTS, (int)timeout);
+        if(n < 0 && errno != EINTR)
+            break;
+        w->st.wakeups++;
+        for(int i = 0; i < n; i++){
+            if(events[i].data.u32 == REACTOR_WAKE){
+                uint64_t count;
+                if(read(w->wakefd, &count, sizeof(count)) < 0){
+                    /* Already drained by an earlier wake */
+                }
+                {
+                    std::lock_guard<std::mutex> guard(w->lock);
+                    calls.swap(w->queue);
+                }
+                for(size_t j = 0; j < calls.size(); j++)
+                    calls[j].cb(this->modems[calls[j].modem].etm, calls[j].ctx);
+                calls.clear();
+            }else{
+                this->service(events[i].data.u32, true, w);
+            }
+        }
+        /* Deadlines and the application's timers */
+        now = millis();
+        if(now - lasttick >= this->tickms){
+            lasttick = now;
+            for(size_t i = 0; i < w->modems.size(); i++)
+                this->service(w->modems[i], false, w);
+        }else{
+            for(size_t i = 0; i < w->modems.size(); i++){
+                if(this->modems[w->modems[i]].etm->nextdeadline() == 0)
+                    this->service(w->modems[i], false, w);
+            }
+        }
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    w->st.cpums = cpu.tv_sec * 1000UL + cpu.tv_nsec / 1000000;
+}
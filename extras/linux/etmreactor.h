@@ -0,0 +1,90 @@
+/***************************************************************************
+  epoll reactor driving many eseyeETM instances on a Linux gateway.
+
+  Each modem is given to one of a few worker threads, and only that
+  thread ever touches its eseyeETM, so the library needs no locking. A
+  worker sleeps in epoll_wait() on its modems' fds and calls poll() on a
+  modem only when its port is readable, or when the modem has work due
+  (nextdeadline()). After each poll() the modem's loop callback runs -
+  the application's loop() for that modem. Anything else that has to
+  touch a modem from another thread goes through post().
+
+    EtmReactor gw(2);
+    for(i = 0; i < n; i++)
+        gw.add(&etm[i], &port[i], nodeloop, &node[i]);
+    gw.start();
+
+  Callbacks run on the reactor threads and must not block, so use the
+  asynchronous calls (pubregasync() etc.) rather than the *confirm() ones.
+ ***************************************************************************/
+
+#ifndef ETMREACTOR_H__
+#define ETMREACTOR_H__
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "eseyetelemetrymodule.h"
+#include "posixserial.h"
+
+/* Application callback run on the modem's reactor thread */
+typedef void (*_reactorcb)(eseyeETMBase *etm, void *ctx);
+
+struct reactorstats{
+  unsigned long wakeups;    /* epoll_wait() returns */
+  unsigned long readable;   /* poll() calls for input */
+  unsigned long timed;      /* poll() calls for a deadline or tick */
+  unsigned long cpums;      /* Thread CPU time */
+};
+
+class EtmReactor
+{
+public:
+    /* loop callbacks also run at least every tickms */
+    EtmReactor(int threads = 1, unsigned long tickms = 100);
+    ~EtmReactor();
+
+    /* Add a modem before start() - returns its index or -1 */
+    int add(eseyeETMBase *etm, PosixSerial *port, _reactorcb loop = NULL, void *ctx = NULL);
+    bool start(void);
+    void stop(void);
+    /* Run cb on modem's thread - safe from any thread */
+    bool post(int modem, _reactorcb cb, void *ctx);
+    /* Totals over all threads - cpums is only filled in once stopped */
+    void stats(struct reactorstats *total);
+
+private:
+    struct modem{
+      eseyeETMBase *etm;
+      PosixSerial *port;
+      _reactorcb loop;
+      void *ctx;
+      int worker;
+      bool attached;
+    };
+    struct posted{
+      int modem;
+      _reactorcb cb;
+      void *ctx;
+    };
+    struct worker{
+      int epfd;
+      int wakefd;
+      std::thread thread;
+      std::vector<int> modems;
+      std::mutex lock;
+      std::vector<posted> queue;
+      struct reactorstats st;
+    };
+
+    std::vector<modem> modems;
+    std::vector<worker *> workers;
+    unsigned long tickms;
+    std::atomic<bool> running;
+
+    void run(worker *w);
+    void service(int idx, bool readable, worker *w);
+};
+
+#endif // ETMREACTOR_H__
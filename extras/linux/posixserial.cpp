@@ -0,0 +1,146 @@
+/***************************************************************************
+  POSIX serial port Stream for Linux builds of eseyetelemetrymodule.
+ ***************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include "posixserial.h"
+
+PosixSerial::PosixSerial(){
+    this->portfd = -1;
+    this->error = false;
+    this->rxlen = 0;
+    this->rxpos = 0;
+}
+
+PosixSerial::~PosixSerial(){
+    this->close();
+}
+
+static speed_t baudflag(unsigned long baud){
+    switch(baud){
+      case 9600:    return B9600;
+      case 19200:   return B19200;
+      case 38400:   return B38400;
+      case 57600:   return B57600;
+      case 115200:  return B115200;
+      case 230400:  return B230400;
+      case 460800:  return B460800;
+      case 921600:  return B921600;
+      default:      return B0;
+    }
+}
+
+bool PosixSerial::open(const char *path, unsigned long baud){
+    struct termios tio;
+    speed_t speed = baudflag(baud);
+    if(speed == B0){
+        errno = EINVAL;
+        return false;
+    }
+    int fd = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if(fd < 0)
+        return false;
+    if(tcgetattr(fd, &tio) != 0){
+        ::close(fd);
+        return false;
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~CRTSCTS;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    if(tcsetattr(fd, TCSANOW, &tio) != 0){
+        ::close(fd);
+        return false;
+    }
+    tcflush(fd, TCIOFLUSH);
+    return this->attach(fd);
+}
+
+bool PosixSerial::attach(int fd){
+    int flags = fcntl(fd, F_GETFL);
+    if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return false;
+    this->close();
+    this->portfd = fd;
+    this->error = false;
+    return true;
+}
+
+void PosixSerial::close(void){
+    if(this->portfd >= 0)
+        ::close(this->portfd);
+    this->portfd = -1;
+    this->rxlen = 0;
+    this->rxpos = 0;
+}
+
+/* Refill the receive buffer if it is empty - false if there is nothing to read */
+bool PosixSerial::fill(void){
+    if(this->rxpos < this->rxlen)
+        return true;
+    if(this->portfd < 0 || this->error)
+        return false;
+    ssize_t n = ::read(this->portfd, this->rxbuf, sizeof(this->rxbuf));
+    if(n <= 0){
+        /* A raw tty returns 0 when empty (VMIN 0) - a hangup shows up as EIO */
+        if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            this->error = true;
+        return false;
+    }
+    this->rxlen = n;
+    this->rxpos = 0;
+    return true;
+}
+
+int PosixSerial::available(){
+    if(this->fill() == false)
+        return 0;
+    return this->rxlen - this->rxpos;
+}
+
+int PosixSerial::peek(){
+    if(this->fill() == false)
+        return -1;
+    return this->rxbuf[this->rxpos];
+}
+
+int PosixSerial::read(){
+    if(this->fill() == false)
+        return -1;
+    return this->rxbuf[this->rxpos++];
+}
+
+size_t PosixSerial::write(uint8_t c){
+    return this->write(&c, 1);
+}
+
+size_t PosixSerial::write(const uint8_t *buffer, size_t size){
+    size_t done = 0;
+    while(done < size && this->portfd >= 0 && !this->error){
+        ssize_t n = ::write(this->portfd, buffer + done, size - done);
+        if(n > 0){
+            done += n;
+        }else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            /* The tty is full - wait for room rather than drop a command */
+            struct pollfd pfd = {this->portfd, POLLOUT, 0};
+            ::poll(&pfd, 1, 100);
+        }else if(n < 0 && errno == EINTR){
+            continue;
+        }else{
+            this->error = true;
+        }
+    }
+    return done;
+}
+
+void PosixSerial::flush(){
+    if(this->portfd >= 0)
+        tcdrain(this->portfd);
+}
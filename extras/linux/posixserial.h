@@ -0,0 +1,60 @@
+/***************************************************************************
+  POSIX serial port Stream for Linux builds of eseyetelemetrymodule.
+
+  Opens a tty (a BG96 on /dev/ttyUSBn, or the slave side of a pty) in raw
+  mode and non-blocking, so poll() never waits on the port. Reads are
+  buffered: available() only calls read(2) once the buffer is empty, and
+  returns 0 once the port has nothing more, which is what lets a level
+  triggered epoll reactor (etmreactor.h) call poll() only when the fd is
+  readable. Writes block until the tty has taken every byte.
+
+    PosixSerial modem;
+    if(!modem.open("/dev/ttyUSB2", 115200)) ...
+    eseyeETM myAWS(&modem);
+
+  Built against the host Arduino shim (extras/host/Arduino.h), whose
+  millis() runs from CLOCK_MONOTONIC.
+ ***************************************************************************/
+
+#ifndef POSIXSERIAL_H__
+#define POSIXSERIAL_H__
+
+#include "Arduino.h"
+
+#define POSIXSERIAL_BUFSIZE 256
+
+class PosixSerial : public Stream
+{
+public:
+    PosixSerial();
+    ~PosixSerial();
+    /* Open and configure a tty - returns false and leaves errno set on failure */
+    bool open(const char *path, unsigned long baud = 115200);
+    /* Use an fd that is already open, e.g. a pty master. The Stream owns it from now on */
+    bool attach(int fd);
+    void close(void);
+    int fd(void) { return this->portfd; }
+
+    int available();
+    int read();
+    int peek();
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+    /* Wait for output to drain */
+    void flush();
+
+    /* The port has closed or failed (hangup, device removed) */
+    bool failed(void) { return this->error; }
+
+private:
+    int portfd;
+    bool error;
+    uint8_t rxbuf[POSIXSERIAL_BUFSIZE];
+    size_t rxlen;
+    size_t rxpos;
+
+    bool fill(void);
+};
+
+#endif // POSIXSERIAL_H__